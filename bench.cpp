@@ -0,0 +1,298 @@
+#include <tmpfile/tmpfile.h>
+
+#include <algorithm>
+#include <chrono>
+#include <functional>
+#include <iostream>
+#include <new>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+// measures construct + destroy of a temporary file, printed as JSON
+// along with the number of heap allocations each one makes
+//
+// tmpfile_bench [--threads N] [--iterations N] [--populations N,N,...] [--dir DIR]
+//
+//   --threads      run with 1, 2, 4, ... up to N threads (default: hardware concurrency)
+//   --iterations   files created and destroyed per thread (default: 2000)
+//   --populations  number of unrelated files already in the directory (default: 0,10000)
+//   --dir          directory to create the benchmark directory in (default: TempFile::TempDir())
+
+// counted per thread so counting does not slow down the threads being measured
+static thread_local size_t allocations = 0;
+
+void * operator new(size_t size) {
+    allocations++;
+    void * p = malloc(size == 0 ? 1 : size);
+    if (p == nullptr) throw std::bad_alloc();
+    return p;
+}
+
+void operator delete(void * p) noexcept {
+    free(p);
+}
+
+void operator delete(void * p, size_t) noexcept {
+    free(p);
+}
+
+struct Case {
+    const char * name;
+    // returns false if the file could not be created
+    std::function<bool(const std::string & dir)> run;
+};
+
+static std::vector<Case> cases() {
+    return {
+        {"TempFile", [](const std::string & dir) {
+            TempFile tmp(dir, "bench");
+            return tmp.is_valid();
+        }},
+        {"TempFileFD", [](const std::string & dir) {
+            TempFileFD tmp(dir, "bench");
+            return tmp.is_valid();
+        }},
+        {"TempFileFILE", [](const std::string & dir) {
+            TempFileFILE tmp(dir, "bench");
+            return tmp.is_valid();
+        }},
+        {"TempFileUnique", [](const std::string & dir) {
+            TempFileUnique tmp(dir, "bench");
+            return tmp.is_valid();
+        }},
+        {"TempFile toFD", [](const std::string & dir) {
+            TempFile tmp(dir, "bench");
+            TempFileFD fd = tmp.toFD();
+            return fd.is_valid();
+        }},
+        {"TempFile anonymous", [](const std::string & dir) {
+            TempFile tmp(dir, "bench", "", TEMP_FILE_CREATE_ANONYMOUS);
+            return tmp.is_valid();
+        }},
+        {"TempFile memfd", [](const std::string & dir) {
+            TempFile tmp(dir, "bench", "", TEMP_FILE_CREATE_MEMFD);
+            return tmp.is_valid();
+        }},
+        {"TempFile unique name", [](const std::string & dir) {
+            TempFile tmp(dir, "bench", "", TEMP_FILE_CREATE_UNIQUE_NAME);
+            return tmp.is_valid();
+        }},
+        {"TempFile deferred cleanup", [](const std::string & dir) {
+            TempFile tmp(dir, "bench", "", TEMP_FILE_CREATE_DEFERRED_CLEANUP);
+            return tmp.is_valid();
+        }},
+        {"TempFile on first use", [](const std::string & dir) {
+            TempFile tmp(dir, "bench", "", TEMP_FILE_CREATE_ON_FIRST_USE);
+            return tmp.is_valid();
+        }},
+        {"TempFile fanout", [](const std::string & dir) {
+            TempFile tmp(dir, "bench", "", TEMP_FILE_CREATE_FANOUT);
+            return tmp.is_valid();
+        }},
+        {"TempFile preallocated", [](const std::string & dir) {
+            TempFile tmp(dir, "bench", "", 0, 1 << 20, TEMP_FILE_PREALLOCATE_KEEP_SIZE);
+            return tmp.is_valid();
+        }},
+        {"mkstemp", [](const std::string & dir) {
+            std::string path = dir + "/benchXXXXXX";
+            int fd = mkstemp(&path[0]);
+            if (fd < 0) return false;
+            close(fd);
+            unlink(path.c_str());
+            return true;
+        }},
+        {"tmpfile", [](const std::string &) {
+            FILE * file = tmpfile();
+            if (file == nullptr) return false;
+            fclose(file);
+            return true;
+        }},
+#if defined(O_TMPFILE)
+        {"O_TMPFILE", [](const std::string & dir) {
+            int fd = open(dir.c_str(), O_TMPFILE | O_RDWR, 0600);
+            if (fd < 0) return false;
+            close(fd);
+            return true;
+        }},
+#endif
+#if defined(MFD_ALLOW_SEALING)
+        {"memfd_create", [](const std::string &) {
+            int fd = memfd_create("bench", 0);
+            if (fd < 0) return false;
+            close(fd);
+            return true;
+        }},
+#endif
+    };
+}
+
+struct Result {
+    double seconds = 0;
+    size_t operations = 0;
+    size_t failures = 0;
+    size_t allocations = 0;
+    std::vector<double> latencies;
+};
+
+static Result run(const Case & c, const std::string & dir, size_t threads, size_t iterations) {
+    std::vector<std::vector<double>> latencies(threads);
+    std::vector<size_t> failures(threads, 0);
+    std::vector<size_t> thread_allocations(threads, 0);
+
+    auto start = std::chrono::steady_clock::now();
+    std::vector<std::thread> workers;
+    for (size_t t = 0; t < threads; t++) {
+        workers.emplace_back([&, t] {
+            latencies[t].reserve(iterations);
+            // the first file of a thread sets up its name generator and counters, keep that out of the count
+            c.run(dir);
+            for (size_t i = 0; i < iterations; i++) {
+                auto before = std::chrono::steady_clock::now();
+                size_t allocations_before = allocations;
+                if (!c.run(dir)) failures[t]++;
+                thread_allocations[t] += allocations - allocations_before;
+                auto after = std::chrono::steady_clock::now();
+                latencies[t].push_back(std::chrono::duration<double, std::micro>(after - before).count());
+            }
+        });
+    }
+    for (auto & worker : workers) {
+        worker.join();
+    }
+    // deferred cleanup is only done once everything is deleted
+    TempFile::flush_cleanup();
+    auto end = std::chrono::steady_clock::now();
+
+    Result result;
+    result.seconds = std::chrono::duration<double>(end - start).count();
+    result.operations = threads * iterations;
+    for (size_t t = 0; t < threads; t++) {
+        result.failures += failures[t];
+        result.allocations += thread_allocations[t];
+        result.latencies.insert(result.latencies.end(), latencies[t].begin(), latencies[t].end());
+    }
+    std::sort(result.latencies.begin(), result.latencies.end());
+    return result;
+}
+
+static double percentile(const std::vector<double> & sorted, double p) {
+    if (sorted.size() == 0) return 0;
+    size_t index = static_cast<size_t>(p * (sorted.size() - 1));
+    return sorted[index];
+}
+
+static std::string json_string(const std::string & s) {
+    std::string out = "\"";
+    for (char c : s) {
+        if (c == '"' || c == '\\') out += '\\';
+        out += c;
+    }
+    return out + "\"";
+}
+
+static std::vector<size_t> parse_list(const char * arg) {
+    std::vector<size_t> list;
+    std::string s = arg;
+    size_t pos = 0;
+    while (pos <= s.length()) {
+        size_t comma = s.find(',', pos);
+        if (comma == std::string::npos) comma = s.length();
+        if (comma > pos) list.push_back(std::stoul(s.substr(pos, comma - pos)));
+        pos = comma + 1;
+    }
+    return list;
+}
+
+int main(int argc, char ** argv) {
+    size_t max_threads = std::max(1u, std::thread::hardware_concurrency());
+    size_t iterations = 2000;
+    std::vector<size_t> populations = {0, 10000};
+    std::string parent = TempFile::TempDir();
+
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "--threads" && i + 1 < argc) {
+            max_threads = std::stoul(argv[++i]);
+        } else if (arg == "--iterations" && i + 1 < argc) {
+            iterations = std::stoul(argv[++i]);
+        } else if (arg == "--populations" && i + 1 < argc) {
+            populations = parse_list(argv[++i]);
+        } else if (arg == "--dir" && i + 1 < argc) {
+            parent = argv[++i];
+        } else {
+            std::cerr << "usage: " << argv[0] << " [--threads N] [--iterations N] [--populations N,N,...] [--dir DIR]" << std::endl;
+            return 1;
+        }
+    }
+
+    std::vector<size_t> thread_counts;
+    for (size_t t = 1; t < max_threads; t *= 2) {
+        thread_counts.push_back(t);
+    }
+    thread_counts.push_back(max_threads);
+
+    std::string dir = parent + "/tmpfile_benchXXXXXX";
+    if (mkdtemp(&dir[0]) == nullptr) {
+        std::cerr << "failed to create benchmark directory in " << parent << ": " << strerror(errno) << std::endl;
+        return 1;
+    }
+
+    std::vector<Case> all = cases();
+    bool first = true;
+
+    std::cout << "{\n  \"dir\": " << json_string(dir) << ",\n  \"iterations\": " << iterations << ",\n  \"results\": [";
+
+    std::vector<std::string> population_files;
+    for (size_t population : populations) {
+        // fill the directory with unrelated files, the same way a busy spill directory looks
+        while (population_files.size() < population) {
+            std::string path = dir + "/population" + std::to_string(population_files.size());
+            int fd = open(path.c_str(), O_RDWR | O_CREAT, 0600);
+            if (fd >= 0) close(fd);
+            population_files.push_back(path);
+        }
+        while (population_files.size() > population) {
+            unlink(population_files.back().c_str());
+            population_files.pop_back();
+        }
+
+        for (const Case & c : all) {
+            for (size_t threads : thread_counts) {
+                Result result = run(c, dir, threads, iterations);
+                std::cout << (first ? "\n" : ",\n");
+                first = false;
+                std::cout << "    {\"case\": " << json_string(c.name)
+                          << ", \"threads\": " << threads
+                          << ", \"population\": " << population
+                          << ", \"operations\": " << result.operations
+                          << ", \"failures\": " << result.failures
+                          << ", \"ops_per_second\": " << (result.seconds > 0 ? result.operations / result.seconds : 0)
+                          << ", \"p50_us\": " << percentile(result.latencies, 0.50)
+                          << ", \"p99_us\": " << percentile(result.latencies, 0.99)
+                          << ", \"p999_us\": " << percentile(result.latencies, 0.999)
+                          << ", \"allocations_per_op\": " << (result.operations > 0 ? double(result.allocations) / result.operations : 0)
+                          << "}" << std::flush;
+            }
+        }
+    }
+    std::cout << "\n  ]\n}" << std::endl;
+
+    for (const std::string & path : population_files) {
+        unlink(path.c_str());
+    }
+    // the fanout case leaves the subdirectories its files were spread over
+    TempFile::prune_fanout(dir);
+    if (rmdir(dir.c_str()) != 0) {
+        std::cerr << "failed to remove benchmark directory " << dir << ": " << strerror(errno) << std::endl;
+        return 1;
+    }
+    return 0;
+}
@@ -85,7 +85,21 @@ int main() {
             "const std::string & dir, const std::string & template_prefix, const std::string & template_suffix, int open_mode, bool log_create_close",
             {
                 "construct(dir, template_prefix, template_suffix, open_mode, log_create_close);",
-                "if (dir.length() == 0) {\n        return construct(TempDir(), template_prefix, template_suffix, open_mode, log_create_close);\n    }"
+                "return construct(dir, template_prefix, template_suffix, open_mode, 0, log_create_close);"
+            }
+        },
+        {
+            "const std::string & dir, const std::string & template_prefix, const std::string & template_suffix, int open_mode, int create_flags",
+            {
+                "construct(dir, template_prefix, template_suffix, open_mode, create_flags);",
+                "return construct(dir, template_prefix, template_suffix, open_mode, create_flags, false);"
+            }
+        },
+        {
+            "const std::string & dir, const std::string & template_prefix, const std::string & template_suffix, int open_mode, int create_flags, bool log_create_close",
+            {
+                "construct(dir, template_prefix, template_suffix, open_mode, create_flags, log_create_close);",
+                "if (dir.length() == 0) {\n        return construct(TempDir(), template_prefix, template_suffix, open_mode, create_flags, log_create_close);\n    }"
             }
         }
     };
@@ -103,7 +117,6 @@ int main() {
 
     for (auto& p : header) {
         printf("TempFileFILE::TempFileFILE(%s) {\n", p.first);
-        printf("    data = std::make_shared<CleanUp>();\n");
         printf("    %s\n", p.second.first);
         printf("}\n");
     }
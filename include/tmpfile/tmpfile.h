@@ -7,22 +7,405 @@
 #include <Windows.h>
 #endif
 
+#include <atomic>
+#include <cstdio>
+#include <cstdint>
+#include <condition_variable>
+#include <cstddef>
 #include <memory>
+#include <mutex>
 #include <string>
+#include <thread>
+#include <utility>
+#include <vector>
 
 class TempFile;
 class TempFileFD;
 class TempFileFILE;
+class TempFileUnique;
+class TempDirSet;
+struct TempFileLazyFd;
+struct TempFileSpool;
+struct TempFilePending;
 
 #define TEMP_FILE_OPEN_MODE_READ (1 << 0)
 #define TEMP_FILE_OPEN_MODE_WRITE (1 << 1)
 #define TEMP_FILE_OPEN_MODE_BINARY (1 << 2)
 
+// create an unnamed file with O_TMPFILE, detach links it into the directory
+#define TEMP_FILE_CREATE_ANONYMOUS (1 << 0)
+// create the file with memfd_create, it lives only in memory
+#define TEMP_FILE_CREATE_MEMFD (1 << 1)
+// name the file after the boot id, pid, thread and a counter instead of random letters
+#define TEMP_FILE_CREATE_UNIQUE_NAME (1 << 2)
+// close and delete the file on a background thread, see TempFile::flush_cleanup
+#define TEMP_FILE_CREATE_DEFERRED_CLEANUP (1 << 3)
+// keep only the path while the file is idle, the descriptor is closed and reopened by get_handle, see TempFile::set_fd_cache_limit
+#define TEMP_FILE_CREATE_LAZY_FD (1 << 4)
+// create the file two subdirectories below dir, named after a hash of the file name, see TempFile::prune_fanout
+#define TEMP_FILE_CREATE_FANOUT (1 << 5)
+// only reserve a name, the file is created by the first get_handle, pin, detach, seal or conversion, see TempFile::is_created
+#define TEMP_FILE_CREATE_ON_FIRST_USE (1 << 6)
+
+#define TEMP_FILE_SEAL_SHRINK (1 << 0)
+#define TEMP_FILE_SEAL_GROW (1 << 1)
+#define TEMP_FILE_SEAL_WRITE (1 << 2)
+#define TEMP_FILE_SEAL_SEAL (1 << 3)
+
+// reserve the blocks without changing the size of the file, appends then fill them in
+#define TEMP_FILE_PREALLOCATE_KEEP_SIZE (1 << 0)
+// construct fails with ENOSPC if the space cannot be reserved, without it preallocation is only a hint
+#define TEMP_FILE_PREALLOCATE_FAIL_FAST (1 << 1)
+// the file is going to be read from start to end, or at random, passed to posix_fadvise
+#define TEMP_FILE_PREALLOCATE_SEQUENTIAL (1 << 2)
+#define TEMP_FILE_PREALLOCATE_RANDOM (1 << 3)
+// reading the file does not update its access time, set with F_SETFL
+#define TEMP_FILE_PREALLOCATE_NOATIME (1 << 4)
+
+// what TempFile::commit_to does if the destination exists, replacing it is the default
+#define TEMP_FILE_COMMIT_REPLACE 0
+// fail with EEXIST instead
+#define TEMP_FILE_COMMIT_NOREPLACE (1 << 0)
+// swap the two, the previous file is left at the temporary path and deleted with the handle
+#define TEMP_FILE_COMMIT_EXCHANGE (1 << 1)
+
+// how much of a commit survives a crash once commit_to returns
+#define TEMP_FILE_DURABILITY_NONE 0
+// the data of the file is synced with fdatasync before it is renamed
+#define TEMP_FILE_DURABILITY_DATA 1
+// and the directory is synced after, so the rename is durable too
+#define TEMP_FILE_DURABILITY_FULL 2
+
+// how a TempFileMap is going to be accessed, passed to madvise
+#define TEMP_FILE_ADVISE_NORMAL 0
+#define TEMP_FILE_ADVISE_SEQUENTIAL 1
+#define TEMP_FILE_ADVISE_RANDOM 2
+#define TEMP_FILE_ADVISE_WILLNEED 3
+// the pages are dropped from memory, a shared mapping reads them back from the file
+#define TEMP_FILE_ADVISE_DONTNEED 4
+
+// a snapshot of what every thread has done, see TempFile::stats
+struct TempFileStats {
+    static const size_t histogram_buckets = 64;
+
+    // files created, by construct and construct_many
+    uint64_t creates = 0;
+    // names that already existed and had to be generated again
+    uint64_t collisions = 0;
+    // constructs that failed
+    uint64_t fatal_errors = 0;
+    // files deleted, including those deleted by the deferred cleanup thread
+    uint64_t unlinks = 0;
+    uint64_t detaches = 0;
+    uint64_t conversions_to_fd = 0;
+    uint64_t conversions_to_file = 0;
+    uint64_t conversions_to_handle = 0;
+    // descriptors of TEMP_FILE_CREATE_LAZY_FD files closed by the fd cache, and opened again by get_handle or pin
+    uint64_t fd_evictions = 0;
+    uint64_t fd_reopens = 0;
+    // SpooledTempFile buffers that grew past their threshold and were written to a file
+    uint64_t spills = 0;
+    // files renamed over their destination by commit_to and commit_many, and the directory syncs they needed
+    uint64_t commits = 0;
+    uint64_t dir_syncs = 0;
+    // bytes moved by copy_to and copy_from
+    uint64_t bytes_copied = 0;
+    // files that share the blocks of the file they were cloned from
+    uint64_t clones = 0;
+    // bytes reserved by preallocate, and preallocations that failed with ENOSPC or EDQUOT
+    uint64_t preallocated_bytes = 0;
+    uint64_t preallocation_failures = 0;
+
+    // bucket 0 counts 0ns, bucket i counts latencies in [2^(i-1), 2^i) nanoseconds
+    uint64_t construct_latency[histogram_buckets] = {};
+    uint64_t cleanup_latency[histogram_buckets] = {};
+
+    // upper bound in nanoseconds of the bucket holding the p-th fraction (0 to 1) of the latencies
+    uint64_t construct_percentile(double p) const;
+    uint64_t cleanup_percentile(double p) const;
+};
+
+// what was found out about a directory when it was opened, see TempFile::temp_dir_info
+struct TempDirInfo {
+    std::string path;
+    // kept open until the TempDirInfo is destroyed, -1 if the directory could not be opened
+    int dirfd = -1;
+    // errno of opening the directory, 0 if it was opened
+    int error = 0;
+    // f_type reported by statfs, 0 where it is not known
+    uint64_t filesystem = 0;
+    // the filesystem lives in memory (tmpfs or ramfs)
+    bool tmpfs = false;
+    // TEMP_FILE_CREATE_ANONYMOUS can create files in it
+    bool anonymous_files = false;
+    // files in it can share their blocks with FICLONE
+    bool reflink = false;
+    uint64_t block_size = 0;
+    // at the time the directory was probed
+    uint64_t free_bytes = 0;
+    uint64_t total_bytes = 0;
+
+    TempDirInfo() = default;
+    TempDirInfo(const TempDirInfo &) = delete;
+    TempDirInfo & operator=(const TempDirInfo &) = delete;
+    ~TempDirInfo();
+};
+
+// every directory takes its turn
+#define TEMP_DIR_SET_ROUND_ROBIN 0
+// the directory whose filesystem has the fewest bytes in use
+#define TEMP_DIR_SET_LEAST_USED 1
+// directories get files in proportion to their free space
+#define TEMP_DIR_SET_MOST_FREE 2
+
+/* Several directories, usually on different devices, that temporary files
+   are spread over. pick is lock-free and takes the same time however many
+   directories there are, it reads a table of 64 slots that is rebuilt from
+   statvfs at most once per refresh interval.  */
+class TempDirSet {
+private:
+    static const size_t slots = 64;
+
+    std::vector<std::shared_ptr<const TempDirInfo>> dirs;
+    // the directories that could be opened, round robin goes through these
+    std::vector<uint16_t> usable;
+
+    int policy;
+    uint64_t refresh_interval_ns;
+
+    std::unique_ptr<std::atomic<uint64_t>[]> free_bytes_;
+    std::unique_ptr<std::atomic<uint64_t>[]> used_bytes_;
+
+    std::atomic<uint16_t> table[slots];
+    std::atomic<size_t> next {0};
+    std::atomic<uint64_t> refreshed_at {0};
+
+    std::mutex mutex;
+
+    void rebuild();
+    void refresh_locked();
+
+public:
+
+    // directories that cannot be opened are skipped, refresh_interval_ms is 1000 unless given
+    TempDirSet(const std::vector<std::string> & dirs);
+    TempDirSet(const std::vector<std::string> & dirs, int policy);
+    TempDirSet(const std::vector<std::string> & dirs, int policy, uint64_t refresh_interval_ms);
+
+    TempDirSet(const TempDirSet &) = delete;
+    TempDirSet & operator=(const TempDirSet &) = delete;
+
+    // the directory the next file goes in
+    const std::string & pick();
+
+    // reads the free and used space of every directory now and rebuilds the table
+    void refresh();
+
+    size_t size() const;
+    const TempDirInfo & dir(size_t index) const;
+    // as of the last refresh
+    uint64_t free_bytes(size_t index) const;
+    uint64_t used_bytes(size_t index) const;
+};
+
+#define TEMP_FILE_EVENT_CREATED 1
+#define TEMP_FILE_EVENT_CREATED_ANONYMOUS 2
+#define TEMP_FILE_EVENT_DETACHED 3
+#define TEMP_FILE_EVENT_DELETED 4
+#define TEMP_FILE_EVENT_RELEASED_ANONYMOUS 5
+
+// what log_create_close reports, passed to the sink set by TempFile::set_event_sink
+struct TempFileEvent {
+    // one of TEMP_FILE_EVENT_*
+    int type;
+    // the file descriptor (HANDLE on windows) if the file is still open, otherwise -1
+    int64_t fd;
+    // nanoseconds since the unix epoch
+    uint64_t timestamp;
+    // not null terminated
+    const char * path;
+    size_t path_length;
+};
+
+class TempFileEventSink {
+public:
+    // called on the thread that created or cleaned up the file, should not block
+    virtual void event(const TempFileEvent & event) = 0;
+    virtual void flush() {}
+    virtual ~TempFileEventSink() {}
+};
+
+// prints each event to std::cout as a line of text, used unless another sink is set
+class TempFileConsoleSink : public TempFileEventSink {
+public:
+    void event(const TempFileEvent & event) override;
+    void flush() override;
+};
+
+// how an event is stored by TempFileLogSink, each record is followed by path_length bytes of path
+struct TempFileEventRecord {
+    uint64_t timestamp;
+    int64_t fd;
+    // numbered from 1 in the order threads first logged to the sink
+    uint32_t thread;
+    uint16_t type;
+    uint16_t path_length;
+};
+
+/* Queues each event into a ring buffer owned by the calling thread without
+   taking a lock, a background thread drains the buffers of every thread
+   to a log file of TempFileEventRecord. Events are dropped, and counted,
+   if a thread logs faster than the buffers are drained.  */
+class TempFileLogSink : public TempFileEventSink {
+private:
+    struct Buffer;
+
+    uint64_t id;
+
+    size_t record_capacity;
+    size_t path_capacity;
+
+    FILE * file = nullptr;
+
+    std::mutex mutex;
+    std::condition_variable wake_cv;
+    std::vector<std::shared_ptr<Buffer>> thread_buffers;
+    uint32_t threads = 0;
+    bool stop = false;
+
+    std::atomic<bool> running {false};
+    std::atomic<bool> stopped {false};
+    std::atomic<uint64_t> dropped_ {0};
+
+    // not a std::thread member, a forked child has to be able to forget it
+    std::thread * writer = nullptr;
+
+    Buffer * thread_buffer();
+    bool start();
+    void drain(std::vector<char> & out);
+    void run();
+    void shutdown();
+
+    friend struct LogSinkRegistry;
+
+public:
+
+    // appends to the file at path, records_per_thread and path_bytes_per_thread are rounded up to a power of 2
+    TempFileLogSink(const std::string & path);
+    TempFileLogSink(const std::string & path, size_t records_per_thread, size_t path_bytes_per_thread);
+
+    TempFileLogSink(const TempFileLogSink &) = delete;
+    TempFileLogSink & operator=(const TempFileLogSink &) = delete;
+
+    bool is_valid() const;
+
+    void event(const TempFileEvent & event) override;
+
+    // waits until every event queued so far is written to the file
+    void flush() override;
+
+    uint64_t dropped() const;
+
+    ~TempFileLogSink();
+};
+
+/* The path of a temporary file, kept small for processes with millions of
+   live files. The part before and after the generated name, the directory,
+   prefix and suffix, is interned once in a table shared by every file and
+   only the generated name is kept inline. A path that does not fit that
+   form is kept in full.  */
+class TempFilePath {
+public:
+    static const size_t unique_max = 19;
+
+private:
+    // index into the interned table, 0 if the path is empty or kept in full
+    uint32_t stem = 0;
+    uint8_t unique_length = 0;
+    char unique[unique_max];
+    // the path kept in full, or the path built by str, freed when the path changes
+    mutable std::atomic<std::string *> full {nullptr};
+
+    void assign(const char * head, size_t head_length, const char * unique, size_t unique_length, const char * tail, size_t tail_length, uint32_t fanout_at);
+
+public:
+    TempFilePath() = default;
+    TempFilePath(TempFilePath && other) noexcept;
+    TempFilePath & operator=(TempFilePath && other) noexcept;
+    ~TempFilePath();
+
+    bool empty() const;
+    size_t length() const;
+
+    // writes the path to buffer, null terminated and truncated to size, returns the length of the whole path
+    size_t copy(char * buffer, size_t size) const;
+
+    // the whole path, built on first use and kept until the path changes
+    const std::string & str() const;
+
+    // keeps path[unique_begin, path.length() - tail_length) inline and interns the rest
+    void assign(const std::string & path, size_t unique_begin, size_t tail_length);
+    void assign(const char * head, size_t head_length, const char * unique, size_t unique_length, const char * tail, size_t tail_length);
+    // the two subdirectories of a TEMP_FILE_CREATE_FANOUT path at path[fanout_at] are kept inline too
+    void assign(const std::string & path, size_t unique_begin, size_t tail_length, size_t fanout_at);
+
+    bool fanned_out() const;
+
+    void clear();
+    void swap(TempFilePath & other);
+};
+
+/* An intrusively counted pointer to the CleanUp of a TempFile, TempFileFD
+   or TempFileFILE. The empty state holds nothing and allocates nothing.  */
+template <typename T>
+class TempFileRef {
+private:
+    T * ptr = nullptr;
+
+public:
+    TempFileRef() = default;
+    explicit TempFileRef(T * ptr) : ptr(ptr) {}
+
+    TempFileRef(const TempFileRef & other) : ptr(other.ptr) {
+        if (ptr != nullptr) ptr->refs.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    TempFileRef(TempFileRef && other) noexcept : ptr(other.ptr) {
+        other.ptr = nullptr;
+    }
+
+    TempFileRef & operator=(TempFileRef other) noexcept {
+        std::swap(ptr, other.ptr);
+        return *this;
+    }
+
+    ~TempFileRef() {
+        if (ptr != nullptr && ptr->refs.fetch_sub(1, std::memory_order_acq_rel) == 1) T::destroy(ptr);
+    }
+
+    T * get() const { return ptr; }
+    T * operator->() const { return ptr; }
+    T & operator*() const { return *ptr; }
+    explicit operator bool() const { return ptr != nullptr; }
+
+    // true if no other handle shares the CleanUp
+    bool unique() const { return ptr != nullptr && ptr->refs.load(std::memory_order_acquire) == 1; }
+
+    // gives up the CleanUp without dropping the reference to it
+    T * release() {
+        T * p = ptr;
+        ptr = nullptr;
+        return p;
+    }
+};
+
 class TempFile {
 private:
     struct CleanUp {
 
-        std::string path;
+        std::atomic<uint32_t> refs {1};
+
+        TempFilePath path;
 
         bool fatal_path = false;
 
@@ -30,12 +413,26 @@ private:
 
         bool log_create_close = false;
 
+        bool anonymous = false;
+
+        bool memfd = false;
+
+        bool deferred_cleanup = false;
+
+        size_t template_suffix_length = 0;
+
 #if defined(_WIN32)
         HANDLE fd;
 #else
         int fd;
 #endif
 
+        // owns the descriptor instead of fd for TEMP_FILE_CREATE_LAZY_FD, fd is then -1
+        TempFileLazyFd * lazy = nullptr;
+
+        // what TEMP_FILE_CREATE_ON_FIRST_USE still has to create, path is then only the reserved name
+        std::atomic<TempFilePending *> pending {nullptr};
+
         CleanUp();
 
         bool is_valid() const;
@@ -48,28 +445,84 @@ private:
 
         void reset();
 
+        // exchanges everything but refs
+        void swap(CleanUp & other);
+
+        // allocated with room for any of the CleanUp types, so a conversion can reuse it
+        static CleanUp * create();
+        static void destroy(CleanUp * data);
+
         ~CleanUp();
     };
 
-    std::shared_ptr<CleanUp> data;
+    TempFileRef<CleanUp> data;
 
+    static void * allocate_cleanup();
+    static void deallocate_cleanup(void * storage);
+
+    // shared with TempFileUnique, which keeps its CleanUp inline
+    static bool construct_data(CleanUp & data, const std::string & dir, const std::string & template_prefix, const std::string & template_suffix, int create_flags, bool log_create_close);
+    static void detach_data(CleanUp & data);
+    // creates the file of a TEMP_FILE_CREATE_ON_FIRST_USE handle, returns whether data is valid afterwards
+    static bool materialize(CleanUp & data);
+    // syncs and renames the file to path, whose directory is open as dirfd, the directory itself is not synced
+    static bool commit_data(CleanUp & data, const std::string & path, int dirfd, int durability, int commit_flags);
+    static bool commit_path(CleanUp & data, const std::string & path, int durability, int commit_flags);
 
 public:
 
     static std::string TempDir();
 
+    // the directory TempDir names, opened and probed on first use and kept until invalidate_temp_dir
+    // files created with an empty dir are created relative to its dirfd
+    static std::shared_ptr<const TempDirInfo> temp_dir_info();
+    // TempDir and temp_dir_info look the directory up again on their next call, for example after TMPDIR changed
+    static void invalidate_temp_dir();
+    // opens and probes dir, nothing is cached
+    static std::shared_ptr<const TempDirInfo> probe_dir(const std::string & dir);
+
+    // removes the empty subdirectories TEMP_FILE_CREATE_FANOUT left in dir, returns how many were removed
+    static size_t prune_fanout(const std::string & dir);
+
+    // waits until every file queued by TEMP_FILE_CREATE_DEFERRED_CLEANUP has been closed and deleted
+    static void flush_cleanup();
+
+    // sums the counters and latency histograms of every thread, cheap enough to poll
+    static TempFileStats stats();
+
+    // sends the events of every file with log_create_close to sink, nullptr restores the TempFileConsoleSink
+    // a sink that has been set is kept alive until the program exits
+    static void set_event_sink(std::shared_ptr<TempFileEventSink> sink);
+
+    // how many descriptors of TEMP_FILE_CREATE_LAZY_FD files may stay open, the least recently used are closed first
+    // pinned descriptors count towards the limit but are never closed, by default half of RLIMIT_NOFILE
+    static void set_fd_cache_limit(size_t limit);
+    static size_t fd_cache_limit();
+
     TempFile();
     TempFile(const std::string & dir, const std::string & template_prefix);
     TempFile(const std::string & dir, const std::string & template_prefix, bool log_create_close);
     TempFile(const std::string & dir, const std::string & template_prefix, const std::string & template_suffix);
     TempFile(const std::string & dir, const std::string & template_prefix, const std::string & template_suffix, bool log_create_close);
+    TempFile(const std::string & dir, const std::string & template_prefix, const std::string & template_suffix, int create_flags);
+    TempFile(const std::string & dir, const std::string & template_prefix, const std::string & template_suffix, int create_flags, bool log_create_close);
+    // reserves preallocate_size bytes for the file as preallocate does, with TEMP_FILE_PREALLOCATE_FAIL_FAST the file is not kept if that fails
+    TempFile(const std::string & dir, const std::string & template_prefix, const std::string & template_suffix, int create_flags, uint64_t preallocate_size, int preallocate_flags);
+    TempFile(const std::string & dir, const std::string & template_prefix, const std::string & template_suffix, int create_flags, uint64_t preallocate_size, int preallocate_flags, bool log_create_close);
 
+    // a TEMP_FILE_CREATE_ON_FIRST_USE file is valid from construct on, if creating it fails later it becomes invalid
     bool is_valid() const;
+    // false until a TEMP_FILE_CREATE_ON_FIRST_USE file was created
+    bool is_created() const;
 
     bool construct(const std::string & dir, const std::string & template_prefix);
     bool construct(const std::string & dir, const std::string & template_prefix, bool log_create_close);
     bool construct(const std::string & dir, const std::string & template_prefix, const std::string & template_suffix);
     bool construct(const std::string & dir, const std::string & template_prefix, const std::string & template_suffix, bool log_create_close);
+    bool construct(const std::string & dir, const std::string & template_prefix, const std::string & template_suffix, int create_flags);
+    bool construct(const std::string & dir, const std::string & template_prefix, const std::string & template_suffix, int create_flags, bool log_create_close);
+    bool construct(const std::string & dir, const std::string & template_prefix, const std::string & template_suffix, int create_flags, uint64_t preallocate_size, int preallocate_flags);
+    bool construct(const std::string & dir, const std::string & template_prefix, const std::string & template_suffix, int create_flags, uint64_t preallocate_size, int preallocate_flags, bool log_create_close);
 
     // pointers are implicitly convertible to bool
     inline TempFile(const std::string & dir, const std::string & template_prefix, char * template_suffix) : TempFile(dir, template_prefix, std::string(template_suffix)) {}
@@ -77,7 +530,48 @@ public:
     inline bool construct(const std::string & dir, const std::string & template_prefix, char * template_suffix) { return construct(dir, template_prefix, std::string(template_suffix)); }
     inline bool construct(const std::string & dir, const std::string & template_prefix, const char * template_suffix) { return construct(dir, template_prefix, std::string(template_suffix)); }
 
+    // the file is created in dirs.pick()
+    TempFile(TempDirSet & dirs, const std::string & template_prefix);
+    TempFile(TempDirSet & dirs, const std::string & template_prefix, bool log_create_close);
+    TempFile(TempDirSet & dirs, const std::string & template_prefix, const std::string & template_suffix);
+    TempFile(TempDirSet & dirs, const std::string & template_prefix, const std::string & template_suffix, bool log_create_close);
+    TempFile(TempDirSet & dirs, const std::string & template_prefix, const std::string & template_suffix, int create_flags);
+    TempFile(TempDirSet & dirs, const std::string & template_prefix, const std::string & template_suffix, int create_flags, bool log_create_close);
+    TempFile(TempDirSet & dirs, const std::string & template_prefix, const std::string & template_suffix, int create_flags, uint64_t preallocate_size, int preallocate_flags);
+    TempFile(TempDirSet & dirs, const std::string & template_prefix, const std::string & template_suffix, int create_flags, uint64_t preallocate_size, int preallocate_flags, bool log_create_close);
+
+    bool construct(TempDirSet & dirs, const std::string & template_prefix);
+    bool construct(TempDirSet & dirs, const std::string & template_prefix, bool log_create_close);
+    bool construct(TempDirSet & dirs, const std::string & template_prefix, const std::string & template_suffix);
+    bool construct(TempDirSet & dirs, const std::string & template_prefix, const std::string & template_suffix, bool log_create_close);
+    bool construct(TempDirSet & dirs, const std::string & template_prefix, const std::string & template_suffix, int create_flags);
+    bool construct(TempDirSet & dirs, const std::string & template_prefix, const std::string & template_suffix, int create_flags, bool log_create_close);
+    bool construct(TempDirSet & dirs, const std::string & template_prefix, const std::string & template_suffix, int create_flags, uint64_t preallocate_size, int preallocate_flags);
+    bool construct(TempDirSet & dirs, const std::string & template_prefix, const std::string & template_suffix, int create_flags, uint64_t preallocate_size, int preallocate_flags, bool log_create_close);
+
+    inline TempFile(TempDirSet & dirs, const std::string & template_prefix, char * template_suffix) : TempFile(dirs, template_prefix, std::string(template_suffix)) {}
+    inline TempFile(TempDirSet & dirs, const std::string & template_prefix, const char * template_suffix) : TempFile(dirs, template_prefix, std::string(template_suffix)) {}
+    inline bool construct(TempDirSet & dirs, const std::string & template_prefix, char * template_suffix) { return construct(dirs, template_prefix, std::string(template_suffix)); }
+    inline bool construct(TempDirSet & dirs, const std::string & template_prefix, const char * template_suffix) { return construct(dirs, template_prefix, std::string(template_suffix)); }
+
+    // creates count files in dir, errors receives errno for each file or 0 if it was created
+    static std::vector<TempFile> construct_many(const std::string & dir, const std::string & template_prefix, const std::string & template_suffix, size_t count);
+    static std::vector<TempFile> construct_many(const std::string & dir, const std::string & template_prefix, const std::string & template_suffix, size_t count, bool log_create_close);
+    static std::vector<TempFile> construct_many(const std::string & dir, const std::string & template_prefix, const std::string & template_suffix, size_t count, std::vector<int> & errors);
+    static std::vector<TempFile> construct_many(const std::string & dir, const std::string & template_prefix, const std::string & template_suffix, size_t count, std::vector<int> & errors, bool log_create_close);
+
+    #if !defined(_WIN32)
+    // creates a file as construct does holding a copy of source, which shares its blocks with FICLONE where the filesystem can
+    // and is copied with copy_file_range elsewhere, nothing is created if source cannot be opened, errno tells why it is invalid
+    static TempFile clone(const std::string & source, const std::string & dir, const std::string & template_prefix);
+    static TempFile clone(const std::string & source, const std::string & dir, const std::string & template_prefix, const std::string & template_suffix);
+    static TempFile clone(const std::string & source, const std::string & dir, const std::string & template_prefix, const std::string & template_suffix, int create_flags);
+    static TempFile clone(const std::string & source, const std::string & dir, const std::string & template_prefix, const std::string & template_suffix, int create_flags, bool log_create_close);
+    #endif
+
     const std::string & get_path() const;
+    // writes the path to buffer without allocating, returns the length of the whole path
+    size_t get_path(char * buffer, size_t size) const;
 
     TempFile & detach();
 
@@ -89,18 +583,66 @@ public:
 
     TempFile & reset();
 
+    // keeps the descriptor open until a matching unpin and returns it, reopening it if it was closed
+    // for a TEMP_FILE_CREATE_LAZY_FD file the result of get_handle may be closed by the next file that is opened
+    #if defined(_WIN32)
+    HANDLE pin();
+    #else
+    int pin();
+    #endif
+    void unpin();
+
+    bool seal(int seals);
+
+    // reserves size bytes for the file with fallocate so it is written in few extents, and applies the hints in preallocate_flags
+    // where the filesystem cannot reserve space it only checks there is enough free, returns false with ENOSPC if there is not
+    bool preallocate(uint64_t size);
+    bool preallocate(uint64_t size, int preallocate_flags);
+
+    #if !defined(_WIN32)
+    // copies the whole file to fd at its offset, or to path which is created or truncated, returns the bytes copied or -1
+    // copy_from copies what fd holds after its offset, or all of path, into the file at its offset
+    // the kernel copies the data with copy_file_range, sendfile or splice, large copies between two files use several threads
+    int64_t copy_to(int fd);
+    int64_t copy_to(const std::string & path);
+    int64_t copy_from(int fd);
+    int64_t copy_from(const std::string & path);
+    // makes the file a copy of fd or path, or of length bytes of it from offset, 0 meaning until its end
+    // the blocks are shared with FICLONE or FICLONERANGE where the filesystem can, otherwise they are copied as copy_from does
+    bool clone_from(int fd);
+    bool clone_from(int fd, uint64_t offset, uint64_t length);
+    bool clone_from(const std::string & path);
+    bool clone_from(const std::string & path, uint64_t offset, uint64_t length);
+    #endif
+
+    // renames the file over path, which has to be on the same filesystem, by default with TEMP_FILE_DURABILITY_FULL
+    // the handle then keeps path and never deletes it, get_path names it, except with TEMP_FILE_COMMIT_EXCHANGE
+    // a committed file cannot be committed again, that fails with EBADF
+    bool commit_to(const std::string & path);
+    bool commit_to(const std::string & path, int durability);
+    bool commit_to(const std::string & path, int durability, int commit_flags);
+
+    // commits files[i] to paths[i], each directory is synced once for all files committed into it
+    // errors receives errno for each file or 0 if it was committed, returns how many were committed
+    static size_t commit_many(std::vector<TempFile> & files, const std::vector<std::string> & paths, int durability);
+    static size_t commit_many(std::vector<TempFile> & files, const std::vector<std::string> & paths, int durability, int commit_flags);
+    static size_t commit_many(std::vector<TempFile> & files, const std::vector<std::string> & paths, int durability, int commit_flags, std::vector<int> & errors);
+
     TempFileFD toFD();
     TempFileFILE toFILE();
     TempFileFILE toFILE(int open_mode);
     friend TempFileFD;
     friend TempFileFILE;
+    friend TempFileUnique;
 };
 
 class TempFileFD {
 private:
     struct CleanUp {
 
-        std::string path;
+        std::atomic<uint32_t> refs {1};
+
+        TempFilePath path;
 
         bool fatal_path = false;
 
@@ -108,8 +650,19 @@ private:
 
         bool log_create_close = false;
 
+        bool anonymous = false;
+
+        bool memfd = false;
+
+        bool deferred_cleanup = false;
+
+        size_t template_suffix_length = 0;
+
         int fd;
 
+        // owns the descriptor instead of fd for TEMP_FILE_CREATE_LAZY_FD, fd is then -1
+        TempFileLazyFd * lazy = nullptr;
+
         CleanUp();
 
         bool is_valid() const;
@@ -122,20 +675,34 @@ private:
 
         void reset();
 
+        // allocated with room for any of the CleanUp types, so a conversion can reuse it
+        static CleanUp * create();
+        static void destroy(CleanUp * data);
+
         ~CleanUp();
     };
 
-    std::shared_ptr<CleanUp> data;
+    TempFileRef<CleanUp> data;
 
 public:
 
     static inline std::string TempDir() { return TempFile::TempDir(); }
+    static inline std::shared_ptr<const TempDirInfo> temp_dir_info() { return TempFile::temp_dir_info(); }
+    static inline void flush_cleanup() { TempFile::flush_cleanup(); }
+    static inline TempFileStats stats() { return TempFile::stats(); }
+    static inline void set_fd_cache_limit(size_t limit) { TempFile::set_fd_cache_limit(limit); }
+    static inline size_t fd_cache_limit() { return TempFile::fd_cache_limit(); }
 
     TempFileFD();
     TempFileFD(const std::string & dir, const std::string & template_prefix);
     TempFileFD(const std::string & dir, const std::string & template_prefix, bool log_create_close);
     TempFileFD(const std::string & dir, const std::string & template_prefix, const std::string & template_suffix);
     TempFileFD(const std::string & dir, const std::string & template_prefix, const std::string & template_suffix, bool log_create_close);
+    TempFileFD(const std::string & dir, const std::string & template_prefix, const std::string & template_suffix, int create_flags);
+    TempFileFD(const std::string & dir, const std::string & template_prefix, const std::string & template_suffix, int create_flags, bool log_create_close);
+    // reserves preallocate_size bytes for the file as preallocate does, with TEMP_FILE_PREALLOCATE_FAIL_FAST the file is not kept if that fails
+    TempFileFD(const std::string & dir, const std::string & template_prefix, const std::string & template_suffix, int create_flags, uint64_t preallocate_size, int preallocate_flags);
+    TempFileFD(const std::string & dir, const std::string & template_prefix, const std::string & template_suffix, int create_flags, uint64_t preallocate_size, int preallocate_flags, bool log_create_close);
 
     bool is_valid() const;
 
@@ -143,6 +710,10 @@ public:
     bool construct(const std::string & dir, const std::string & template_prefix, bool log_create_close);
     bool construct(const std::string & dir, const std::string & template_prefix, const std::string & template_suffix);
     bool construct(const std::string & dir, const std::string & template_prefix, const std::string & template_suffix, bool log_create_close);
+    bool construct(const std::string & dir, const std::string & template_prefix, const std::string & template_suffix, int create_flags);
+    bool construct(const std::string & dir, const std::string & template_prefix, const std::string & template_suffix, int create_flags, bool log_create_close);
+    bool construct(const std::string & dir, const std::string & template_prefix, const std::string & template_suffix, int create_flags, uint64_t preallocate_size, int preallocate_flags);
+    bool construct(const std::string & dir, const std::string & template_prefix, const std::string & template_suffix, int create_flags, uint64_t preallocate_size, int preallocate_flags, bool log_create_close);
 
     // pointers are implicitly convertible to bool
     inline TempFileFD(const std::string & dir, const std::string & template_prefix, char * template_suffix) : TempFileFD(dir, template_prefix, std::string(template_suffix)) {}
@@ -150,7 +721,40 @@ public:
     inline bool construct(const std::string & dir, const std::string & template_prefix, char * template_suffix) { return construct(dir, template_prefix, std::string(template_suffix)); }
     inline bool construct(const std::string & dir, const std::string & template_prefix, const char * template_suffix) { return construct(dir, template_prefix, std::string(template_suffix)); }
 
+    // the file is created in dirs.pick()
+    TempFileFD(TempDirSet & dirs, const std::string & template_prefix);
+    TempFileFD(TempDirSet & dirs, const std::string & template_prefix, bool log_create_close);
+    TempFileFD(TempDirSet & dirs, const std::string & template_prefix, const std::string & template_suffix);
+    TempFileFD(TempDirSet & dirs, const std::string & template_prefix, const std::string & template_suffix, bool log_create_close);
+    TempFileFD(TempDirSet & dirs, const std::string & template_prefix, const std::string & template_suffix, int create_flags);
+    TempFileFD(TempDirSet & dirs, const std::string & template_prefix, const std::string & template_suffix, int create_flags, bool log_create_close);
+    TempFileFD(TempDirSet & dirs, const std::string & template_prefix, const std::string & template_suffix, int create_flags, uint64_t preallocate_size, int preallocate_flags);
+    TempFileFD(TempDirSet & dirs, const std::string & template_prefix, const std::string & template_suffix, int create_flags, uint64_t preallocate_size, int preallocate_flags, bool log_create_close);
+
+    bool construct(TempDirSet & dirs, const std::string & template_prefix);
+    bool construct(TempDirSet & dirs, const std::string & template_prefix, bool log_create_close);
+    bool construct(TempDirSet & dirs, const std::string & template_prefix, const std::string & template_suffix);
+    bool construct(TempDirSet & dirs, const std::string & template_prefix, const std::string & template_suffix, bool log_create_close);
+    bool construct(TempDirSet & dirs, const std::string & template_prefix, const std::string & template_suffix, int create_flags);
+    bool construct(TempDirSet & dirs, const std::string & template_prefix, const std::string & template_suffix, int create_flags, bool log_create_close);
+    bool construct(TempDirSet & dirs, const std::string & template_prefix, const std::string & template_suffix, int create_flags, uint64_t preallocate_size, int preallocate_flags);
+    bool construct(TempDirSet & dirs, const std::string & template_prefix, const std::string & template_suffix, int create_flags, uint64_t preallocate_size, int preallocate_flags, bool log_create_close);
+
+    inline TempFileFD(TempDirSet & dirs, const std::string & template_prefix, char * template_suffix) : TempFileFD(dirs, template_prefix, std::string(template_suffix)) {}
+    inline TempFileFD(TempDirSet & dirs, const std::string & template_prefix, const char * template_suffix) : TempFileFD(dirs, template_prefix, std::string(template_suffix)) {}
+    inline bool construct(TempDirSet & dirs, const std::string & template_prefix, char * template_suffix) { return construct(dirs, template_prefix, std::string(template_suffix)); }
+    inline bool construct(TempDirSet & dirs, const std::string & template_prefix, const char * template_suffix) { return construct(dirs, template_prefix, std::string(template_suffix)); }
+
+    #if !defined(_WIN32)
+    static TempFileFD clone(const std::string & source, const std::string & dir, const std::string & template_prefix);
+    static TempFileFD clone(const std::string & source, const std::string & dir, const std::string & template_prefix, const std::string & template_suffix);
+    static TempFileFD clone(const std::string & source, const std::string & dir, const std::string & template_prefix, const std::string & template_suffix, int create_flags);
+    static TempFileFD clone(const std::string & source, const std::string & dir, const std::string & template_prefix, const std::string & template_suffix, int create_flags, bool log_create_close);
+    #endif
+
     const std::string & get_path() const;
+    // writes the path to buffer without allocating, returns the length of the whole path
+    size_t get_path(char * buffer, size_t size) const;
 
     TempFileFD & detach();
 
@@ -158,18 +762,42 @@ public:
     
     TempFileFD & reset();
 
+    // keeps the descriptor open until a matching unpin and returns it, reopening it if it was closed
+    // for a TEMP_FILE_CREATE_LAZY_FD file the result of get_handle may be closed by the next file that is opened
+    int pin();
+    void unpin();
+
+    bool seal(int seals);
+
+    bool preallocate(uint64_t size);
+    bool preallocate(uint64_t size, int preallocate_flags);
+
+    #if !defined(_WIN32)
+    int64_t copy_to(int fd);
+    int64_t copy_to(const std::string & path);
+    int64_t copy_from(int fd);
+    int64_t copy_from(const std::string & path);
+    bool clone_from(int fd);
+    bool clone_from(int fd, uint64_t offset, uint64_t length);
+    bool clone_from(const std::string & path);
+    bool clone_from(const std::string & path, uint64_t offset, uint64_t length);
+    #endif
+
     TempFile toHandle();
     TempFileFILE toFILE();
     TempFileFILE toFILE(int open_mode);
     friend TempFile;
     friend TempFileFILE;
+    friend TempFileUnique;
 };
 
 class TempFileFILE {
 private:
     struct CleanUp {
 
-        std::string path;
+        std::atomic<uint32_t> refs {1};
+
+        TempFilePath path;
 
         bool fatal_path = false;
 
@@ -177,6 +805,14 @@ private:
 
         bool log_create_close = false;
 
+        bool anonymous = false;
+
+        bool memfd = false;
+
+        bool deferred_cleanup = false;
+
+        size_t template_suffix_length = 0;
+
         FILE* fd;
 
         CleanUp();
@@ -191,14 +827,21 @@ private:
 
         void reset();
 
+        // allocated with room for any of the CleanUp types, so a conversion can reuse it
+        static CleanUp * create();
+        static void destroy(CleanUp * data);
+
         ~CleanUp();
     };
 
-    std::shared_ptr<CleanUp> data;
+    TempFileRef<CleanUp> data;
 
 public:
 
     static inline std::string TempDir() { return TempFile::TempDir(); }
+    static inline std::shared_ptr<const TempDirInfo> temp_dir_info() { return TempFile::temp_dir_info(); }
+    static inline void flush_cleanup() { TempFile::flush_cleanup(); }
+    static inline TempFileStats stats() { return TempFile::stats(); }
 
     bool is_valid() const;
 
@@ -216,6 +859,8 @@ public:
     TempFileFILE(const std::string & dir, const std::string & template_prefix, const std::string & template_suffix, int open_mode);
     TempFileFILE(const std::string & dir, const std::string & template_prefix, const std::string & template_suffix, bool log_create_close);
     TempFileFILE(const std::string & dir, const std::string & template_prefix, const std::string & template_suffix, int open_mode, bool log_create_close);
+    TempFileFILE(const std::string & dir, const std::string & template_prefix, const std::string & template_suffix, int open_mode, int create_flags);
+    TempFileFILE(const std::string & dir, const std::string & template_prefix, const std::string & template_suffix, int open_mode, int create_flags, bool log_create_close);
 
     bool construct();
     bool construct(const std::string & dir);
@@ -229,10 +874,14 @@ public:
     bool construct(const std::string & dir, const std::string & template_prefix, const std::string & template_suffix, int open_mode);
     bool construct(const std::string & dir, const std::string & template_prefix, const std::string & template_suffix, bool log_create_close);
     bool construct(const std::string & dir, const std::string & template_prefix, const std::string & template_suffix, int open_mode, bool log_create_close);
+    bool construct(const std::string & dir, const std::string & template_prefix, const std::string & template_suffix, int open_mode, int create_flags);
+    bool construct(const std::string & dir, const std::string & template_prefix, const std::string & template_suffix, int open_mode, int create_flags, bool log_create_close);
 
     // generated by gen.exe -- header end
 
     const std::string & get_path() const;
+    // writes the path to buffer without allocating, returns the length of the whole path
+    size_t get_path(char * buffer, size_t size) const;
 
     TempFileFILE & detach();
 
@@ -240,9 +889,345 @@ public:
     
     TempFileFILE & reset();
 
+    bool seal(int seals);
+
     TempFile toHandle();
     TempFileFD toFD();
     friend TempFile;
     friend TempFileFD;
+    friend TempFileUnique;
 };
+
+/* A TempFile that cannot be copied, only moved. The CleanUp is kept inline
+   so creating, moving and destroying one never allocates or touches an
+   atomic. toHandle gives up the file to a shared TempFile.  */
+class TempFileUnique {
+private:
+    TempFile::CleanUp data;
+
+    TempFile release();
+
+public:
+
+    TempFileUnique();
+    TempFileUnique(const std::string & dir, const std::string & template_prefix);
+    TempFileUnique(const std::string & dir, const std::string & template_prefix, bool log_create_close);
+    TempFileUnique(const std::string & dir, const std::string & template_prefix, const std::string & template_suffix);
+    TempFileUnique(const std::string & dir, const std::string & template_prefix, const std::string & template_suffix, bool log_create_close);
+    TempFileUnique(const std::string & dir, const std::string & template_prefix, const std::string & template_suffix, int create_flags);
+    TempFileUnique(const std::string & dir, const std::string & template_prefix, const std::string & template_suffix, int create_flags, bool log_create_close);
+    // reserves preallocate_size bytes for the file as preallocate does, with TEMP_FILE_PREALLOCATE_FAIL_FAST the file is not kept if that fails
+    TempFileUnique(const std::string & dir, const std::string & template_prefix, const std::string & template_suffix, int create_flags, uint64_t preallocate_size, int preallocate_flags);
+    TempFileUnique(const std::string & dir, const std::string & template_prefix, const std::string & template_suffix, int create_flags, uint64_t preallocate_size, int preallocate_flags, bool log_create_close);
+
+    TempFileUnique(const TempFileUnique &) = delete;
+    TempFileUnique & operator=(const TempFileUnique &) = delete;
+
+    TempFileUnique(TempFileUnique && other) noexcept;
+    TempFileUnique & operator=(TempFileUnique && other) noexcept;
+
+    bool is_valid() const;
+    bool is_created() const;
+
+    bool construct(const std::string & dir, const std::string & template_prefix);
+    bool construct(const std::string & dir, const std::string & template_prefix, bool log_create_close);
+    bool construct(const std::string & dir, const std::string & template_prefix, const std::string & template_suffix);
+    bool construct(const std::string & dir, const std::string & template_prefix, const std::string & template_suffix, bool log_create_close);
+    bool construct(const std::string & dir, const std::string & template_prefix, const std::string & template_suffix, int create_flags);
+    bool construct(const std::string & dir, const std::string & template_prefix, const std::string & template_suffix, int create_flags, bool log_create_close);
+    bool construct(const std::string & dir, const std::string & template_prefix, const std::string & template_suffix, int create_flags, uint64_t preallocate_size, int preallocate_flags);
+    bool construct(const std::string & dir, const std::string & template_prefix, const std::string & template_suffix, int create_flags, uint64_t preallocate_size, int preallocate_flags, bool log_create_close);
+
+    // pointers are implicitly convertible to bool
+    inline TempFileUnique(const std::string & dir, const std::string & template_prefix, char * template_suffix) : TempFileUnique(dir, template_prefix, std::string(template_suffix)) {}
+    inline TempFileUnique(const std::string & dir, const std::string & template_prefix, const char * template_suffix) : TempFileUnique(dir, template_prefix, std::string(template_suffix)) {}
+    inline bool construct(const std::string & dir, const std::string & template_prefix, char * template_suffix) { return construct(dir, template_prefix, std::string(template_suffix)); }
+    inline bool construct(const std::string & dir, const std::string & template_prefix, const char * template_suffix) { return construct(dir, template_prefix, std::string(template_suffix)); }
+
+    // the file is created in dirs.pick()
+    TempFileUnique(TempDirSet & dirs, const std::string & template_prefix);
+    TempFileUnique(TempDirSet & dirs, const std::string & template_prefix, bool log_create_close);
+    TempFileUnique(TempDirSet & dirs, const std::string & template_prefix, const std::string & template_suffix);
+    TempFileUnique(TempDirSet & dirs, const std::string & template_prefix, const std::string & template_suffix, bool log_create_close);
+    TempFileUnique(TempDirSet & dirs, const std::string & template_prefix, const std::string & template_suffix, int create_flags);
+    TempFileUnique(TempDirSet & dirs, const std::string & template_prefix, const std::string & template_suffix, int create_flags, bool log_create_close);
+    TempFileUnique(TempDirSet & dirs, const std::string & template_prefix, const std::string & template_suffix, int create_flags, uint64_t preallocate_size, int preallocate_flags);
+    TempFileUnique(TempDirSet & dirs, const std::string & template_prefix, const std::string & template_suffix, int create_flags, uint64_t preallocate_size, int preallocate_flags, bool log_create_close);
+
+    bool construct(TempDirSet & dirs, const std::string & template_prefix);
+    bool construct(TempDirSet & dirs, const std::string & template_prefix, bool log_create_close);
+    bool construct(TempDirSet & dirs, const std::string & template_prefix, const std::string & template_suffix);
+    bool construct(TempDirSet & dirs, const std::string & template_prefix, const std::string & template_suffix, bool log_create_close);
+    bool construct(TempDirSet & dirs, const std::string & template_prefix, const std::string & template_suffix, int create_flags);
+    bool construct(TempDirSet & dirs, const std::string & template_prefix, const std::string & template_suffix, int create_flags, bool log_create_close);
+    bool construct(TempDirSet & dirs, const std::string & template_prefix, const std::string & template_suffix, int create_flags, uint64_t preallocate_size, int preallocate_flags);
+    bool construct(TempDirSet & dirs, const std::string & template_prefix, const std::string & template_suffix, int create_flags, uint64_t preallocate_size, int preallocate_flags, bool log_create_close);
+
+    inline TempFileUnique(TempDirSet & dirs, const std::string & template_prefix, char * template_suffix) : TempFileUnique(dirs, template_prefix, std::string(template_suffix)) {}
+    inline TempFileUnique(TempDirSet & dirs, const std::string & template_prefix, const char * template_suffix) : TempFileUnique(dirs, template_prefix, std::string(template_suffix)) {}
+    inline bool construct(TempDirSet & dirs, const std::string & template_prefix, char * template_suffix) { return construct(dirs, template_prefix, std::string(template_suffix)); }
+    inline bool construct(TempDirSet & dirs, const std::string & template_prefix, const char * template_suffix) { return construct(dirs, template_prefix, std::string(template_suffix)); }
+
+    const std::string & get_path() const;
+    // writes the path to buffer without allocating, returns the length of the whole path
+    size_t get_path(char * buffer, size_t size) const;
+
+    TempFileUnique & detach();
+
+    #if defined(_WIN32)
+    HANDLE get_handle() const;
+    #else
+    int get_handle() const;
+    #endif
+
+    TempFileUnique & reset();
+
+    // keeps the descriptor open until a matching unpin and returns it, reopening it if it was closed
+    // for a TEMP_FILE_CREATE_LAZY_FD file the result of get_handle may be closed by the next file that is opened
+    #if defined(_WIN32)
+    HANDLE pin();
+    #else
+    int pin();
+    #endif
+    void unpin();
+
+    bool seal(int seals);
+
+    bool preallocate(uint64_t size);
+    bool preallocate(uint64_t size, int preallocate_flags);
+
+    #if !defined(_WIN32)
+    int64_t copy_to(int fd);
+    int64_t copy_to(const std::string & path);
+    int64_t copy_from(int fd);
+    int64_t copy_from(const std::string & path);
+    bool clone_from(int fd);
+    bool clone_from(int fd, uint64_t offset, uint64_t length);
+    bool clone_from(const std::string & path);
+    bool clone_from(const std::string & path, uint64_t offset, uint64_t length);
+    #endif
+
+    bool commit_to(const std::string & path);
+    bool commit_to(const std::string & path, int durability);
+    bool commit_to(const std::string & path, int durability, int commit_flags);
+
+    TempFile toHandle();
+    TempFileFD toFD();
+    TempFileFILE toFILE();
+    TempFileFILE toFILE(int open_mode);
+};
+
+class TempFilePool {
+private:
+    std::string dir;
+    std::string template_prefix;
+    std::string template_suffix;
+
+    size_t capacity;
+    size_t low_water;
+
+    std::vector<TempFile> files;
+
+    std::mutex mutex;
+    std::condition_variable refill_cv;
+    bool refill_requested = false;
+    bool stop = false;
+
+    std::atomic<size_t> hits_ {0};
+    std::atomic<size_t> misses_ {0};
+
+    std::thread refill_thread;
+
+    void refill();
+
+public:
+
+    // keeps up to capacity files ready, refilled in the background once fewer than low_water remain
+    TempFilePool(const std::string & dir, const std::string & template_prefix, size_t capacity);
+    TempFilePool(const std::string & dir, const std::string & template_prefix, const std::string & template_suffix, size_t capacity);
+    TempFilePool(const std::string & dir, const std::string & template_prefix, const std::string & template_suffix, size_t capacity, size_t low_water);
+
+    TempFilePool(const TempFilePool &) = delete;
+    TempFilePool & operator=(const TempFilePool &) = delete;
+
+    TempFile acquire();
+
+    size_t size();
+
+    size_t hits() const;
+    size_t misses() const;
+
+    ~TempFilePool();
+};
+
+/* Keeps what is written in memory until more than threshold bytes were
+   written, only then a TempFileUnique is created and everything buffered
+   is moved into it with one write. A file that stays small never touches
+   the filesystem. Like a FILE, one thread uses it at a time.  */
+class SpooledTempFile {
+private:
+    std::unique_ptr<TempFileSpool> spool;
+
+public:
+
+    SpooledTempFile();
+    // the file is created in dir when more than threshold bytes were written, as TempFileUnique would
+    SpooledTempFile(const std::string & dir, const std::string & template_prefix, size_t threshold);
+    SpooledTempFile(const std::string & dir, const std::string & template_prefix, const std::string & template_suffix, size_t threshold);
+    SpooledTempFile(const std::string & dir, const std::string & template_prefix, const std::string & template_suffix, int create_flags, size_t threshold);
+
+    SpooledTempFile(const SpooledTempFile &) = delete;
+    SpooledTempFile & operator=(const SpooledTempFile &) = delete;
+
+    SpooledTempFile(SpooledTempFile && other) noexcept;
+    SpooledTempFile & operator=(SpooledTempFile && other) noexcept;
+
+    ~SpooledTempFile();
+
+    bool is_valid() const;
+
+    // read and write at the current position, return the number of bytes or -1 with errno set
+    // a write that would go past threshold rolls over first, if that fails nothing is written
+    int64_t write(const void * buffer, size_t size);
+    int64_t read(void * buffer, size_t size);
+    // SEEK_SET, SEEK_CUR or SEEK_END, returns the new position or -1, seeking past the end leaves a hole of zeros once written
+    int64_t seek(int64_t offset, int whence);
+    int64_t tell() const;
+    uint64_t size() const;
+
+    size_t threshold() const;
+    bool rolled_over() const;
+    // moves the data into the file now, returns false with errno set if it could not be created or written
+    bool rollover();
+
+    // a stream reading and writing the same data at the same position, opened on first use and closed with this
+    // it has its own buffer, fflush it before calling read, write or seek directly
+    // nullptr with ENOSYS on windows and where the c library has neither fopencookie nor funopen
+    FILE * get_handle();
+
+    // empty until rolled over
+    const std::string & get_path() const;
+
+    // forgets the data and deletes the file, if any
+    SpooledTempFile & reset();
+
+    // rolls over and gives up the file, this is then invalid
+    TempFile toHandle();
+};
+
+#if !defined(_WIN32)
+/* A TempFileFD mapped into memory with MAP_SHARED, the whole file is mapped
+   and data() points at its first byte. The mapping is removed before the
+   file is closed or deleted, by reset, toFD and the destructor.  */
+class TempFileMap {
+private:
+    TempFileFD file;
+
+    std::byte * data_ = nullptr;
+    size_t size_ = 0;
+
+    bool map(size_t size);
+    void unmap();
+
+public:
+
+    TempFileMap();
+    // creates the file as TempFileFD would and maps size zeroed bytes of it
+    TempFileMap(const std::string & dir, const std::string & template_prefix, size_t size);
+    TempFileMap(const std::string & dir, const std::string & template_prefix, const std::string & template_suffix, size_t size);
+    TempFileMap(const std::string & dir, const std::string & template_prefix, const std::string & template_suffix, int create_flags, size_t size);
+    // maps file at its current size
+    explicit TempFileMap(TempFileFD && file);
+
+    TempFileMap(const TempFileMap &) = delete;
+    TempFileMap & operator=(const TempFileMap &) = delete;
+
+    TempFileMap(TempFileMap && other) noexcept;
+    TempFileMap & operator=(TempFileMap && other) noexcept;
+
+    ~TempFileMap();
+
+    bool is_valid() const;
+
+    // nullptr while the size is 0
+    std::byte * data() const;
+    size_t size() const;
+    std::byte * begin() const;
+    std::byte * end() const;
+
+    // changes the size of the file with ftruncate and of the mapping with mremap, new bytes are zero
+    // data() may move, pointers into the old mapping are invalid afterwards
+    bool resize(size_t size);
+
+    // one of TEMP_FILE_ADVISE_*, for the whole mapping or the pages holding [offset, offset + length)
+    bool advise(int advice);
+    bool advise(int advice, size_t offset, size_t length);
+
+    // writes the dirty pages back to the file with msync, only needed if the file outlives the process
+    bool sync();
+
+    const std::string & get_path() const;
+    // writes the path to buffer without allocating, returns the length of the whole path
+    size_t get_path(char * buffer, size_t size) const;
+
+    int get_handle() const;
+
+    TempFileMap & detach();
+
+    TempFileMap & reset();
+
+    // unmaps and gives up the file, this is then invalid
+    TempFileFD toFD();
+};
+#endif
+
+#if !defined(_WIN32)
+/* A directory created like mkdtemp, private to its owner (mode 0700).
+   Destroying or resetting it removes everything inside it, relative to
+   directory descriptors, and a large tree is removed by several threads.  */
+class TempDirectory {
+private:
+    std::string path;
+
+    int fd = -1;
+
+    bool detached = false;
+
+    bool log_create_close = false;
+
+public:
+
+    TempDirectory();
+    TempDirectory(const std::string & dir, const std::string & template_prefix);
+    TempDirectory(const std::string & dir, const std::string & template_prefix, bool log_create_close);
+
+    TempDirectory(const TempDirectory &) = delete;
+    TempDirectory & operator=(const TempDirectory &) = delete;
+
+    TempDirectory(TempDirectory && other) noexcept;
+    TempDirectory & operator=(TempDirectory && other) noexcept;
+
+    ~TempDirectory();
+
+    bool is_valid() const;
+
+    bool construct(const std::string & dir, const std::string & template_prefix);
+    bool construct(const std::string & dir, const std::string & template_prefix, bool log_create_close);
+
+    // if creation failed this is the path that was attempted
+    const std::string & get_path() const;
+
+    // a descriptor of the directory, for openat and friends
+    int get_handle() const;
+
+    // the directory and everything in it are kept when this is reset or destroyed
+    TempDirectory & detach();
+
+    TempDirectory & reset();
+
+    // removes everything inside the directory open as dirfd, the directory itself is kept
+    // returns false with errno set if anything could not be removed
+    static bool remove_contents(int dirfd);
+};
+#endif
 #endif // LIB_TMPFILE_H
\ No newline at end of file
@@ -12,23 +12,35 @@
 #include <unistd.h>
 #endif /* defined(_WIN32) */
 
+#include <algorithm>
+#include <chrono>
+#include <new>
 #include <string>
+#include <unordered_map>
 
-#if defined(_WIN32)
-/* These are the characters used in temporary filenames.  */
-static const char letters[] =
-"abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789";
-#define NUM_LETTERS (62)
-
-static inline int LETTER_ID() {
-    static std::uniform_int_distribution<int> dist{ 0, NUM_LETTERS - 1 };
-    return dist(rng());
-}
-
-#define LETTER_DIST letters[LETTER_ID()]
-#else
+#if !defined(_WIN32)
 #include <string.h> // strdup
 #include <stdlib.h> // free
+#include <fcntl.h> // O_TMPFILE, F_ADD_SEALS
+#include <sys/mman.h> // memfd_create
+#include <stdio.h> // snprintf
+#include <pthread.h> // pthread_atfork
+#include <sys/resource.h> // getrlimit
+#include <sys/stat.h> // mkdirat
+#include <dirent.h> // DT_DIR, fdopendir
+#endif
+
+#if defined(__linux__)
+#include <sys/ioctl.h> // ioctl
+#include <sys/statfs.h> // fstatfs
+#include <linux/fs.h> // FICLONE
+#include <linux/magic.h> // TMPFS_MAGIC, RAMFS_MAGIC
+#include <sys/syscall.h> // SYS_getdents64
+#include <sys/sendfile.h> // sendfile
+#endif
+
+#if !defined(_WIN32)
+#include <sys/statvfs.h> // fstatvfs
 #endif
 
 struct SaveError {
@@ -102,1216 +114,6573 @@ struct SaveError {
     }
 };
 
-std::string TempFile::TempDir() {
-#if defined(_WIN32)
-    char * tmp_dir = (char*)calloc(1, MAX_PATH+1);
-    if (tmp_dir == nullptr) {
-        throw std::bad_alloc();
+// statistics
+
+enum Stat {
+    STAT_CREATES,
+    STAT_COLLISIONS,
+    STAT_FATAL_ERRORS,
+    STAT_UNLINKS,
+    STAT_DETACHES,
+    STAT_CONVERSIONS_TO_FD,
+    STAT_CONVERSIONS_TO_FILE,
+    STAT_CONVERSIONS_TO_HANDLE,
+    STAT_FD_EVICTIONS,
+    STAT_FD_REOPENS,
+    STAT_SPILLS,
+    STAT_COMMITS,
+    STAT_DIR_SYNCS,
+    STAT_BYTES_COPIED,
+    STAT_CLONES,
+    STAT_PREALLOCATED_BYTES,
+    STAT_PREALLOCATION_FAILURES,
+    STAT_COUNT
+};
+
+/* The counters of one thread. Only the owning thread writes them, so they
+   are bumped with a plain load and store instead of a locked add, the
+   atomics only make it safe for TempFile::stats to read them meanwhile.
+   The counters of threads that have exited are merged into a shared
+   ThreadStats, which is written with fetch_add.  */
+struct ThreadStats {
+    static const size_t buckets = TempFileStats::histogram_buckets;
+
+    bool shared = false;
+
+    std::atomic<uint64_t> counters[STAT_COUNT];
+    std::atomic<uint64_t> construct_latency[buckets];
+    std::atomic<uint64_t> cleanup_latency[buckets];
+
+    ThreadStats() {
+        for (auto & c : counters) c.store(0, std::memory_order_relaxed);
+        for (auto & c : construct_latency) c.store(0, std::memory_order_relaxed);
+        for (auto & c : cleanup_latency) c.store(0, std::memory_order_relaxed);
     }
-    DWORD rp = GetTempPathA(MAX_PATH, tmp_dir);
-    if (rp > MAX_PATH || rp == 0) {
-        free(tmp_dir);
-        // failed to get temporary path
-        // it is reasonable to assume subsequent attempts to obtain the path will fail until fixed by user
-        return "";
+
+    void add(std::atomic<uint64_t> & counter, uint64_t n) {
+        if (shared) {
+            counter.fetch_add(n, std::memory_order_relaxed);
+        } else {
+            counter.store(counter.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+        }
     }
-    std::string t = tmp_dir;
-    free(tmp_dir);
-    return t;
-#else
-    /*
-        ISO/IEC 9945 (POSIX): The path supplied by the first environment variable found in the list
-        TMPDIR, TMP, TEMP, TEMPDIR.
-        
-        If none of these are found, "/tmp", or, if macro __ANDROID__ is defined, "/data/local/tmp"
-    */
-    const char * tmp_dir = getenv("TMPDIR");
-    if (tmp_dir == nullptr) {
-        tmp_dir = getenv("TMP");
-        if (tmp_dir == nullptr) {
-            tmp_dir = getenv("TEMP");
-            if (tmp_dir == nullptr) {
-                tmp_dir = getenv("TEMPDIR");
-                if (tmp_dir == nullptr) {
-#ifdef __ANDROID__
-                    tmp_dir = "/data/local/tmp";
-#else
-                    tmp_dir = "/tmp";
+
+    void merge_into(ThreadStats & other) const {
+        for (size_t i = 0; i < STAT_COUNT; i++) other.add(other.counters[i], counters[i].load(std::memory_order_relaxed));
+        for (size_t i = 0; i < buckets; i++) other.add(other.construct_latency[i], construct_latency[i].load(std::memory_order_relaxed));
+        for (size_t i = 0; i < buckets; i++) other.add(other.cleanup_latency[i], cleanup_latency[i].load(std::memory_order_relaxed));
+    }
+
+    void merge_into(TempFileStats & stats) const {
+        stats.creates += counters[STAT_CREATES].load(std::memory_order_relaxed);
+        stats.collisions += counters[STAT_COLLISIONS].load(std::memory_order_relaxed);
+        stats.fatal_errors += counters[STAT_FATAL_ERRORS].load(std::memory_order_relaxed);
+        stats.unlinks += counters[STAT_UNLINKS].load(std::memory_order_relaxed);
+        stats.detaches += counters[STAT_DETACHES].load(std::memory_order_relaxed);
+        stats.conversions_to_fd += counters[STAT_CONVERSIONS_TO_FD].load(std::memory_order_relaxed);
+        stats.conversions_to_file += counters[STAT_CONVERSIONS_TO_FILE].load(std::memory_order_relaxed);
+        stats.conversions_to_handle += counters[STAT_CONVERSIONS_TO_HANDLE].load(std::memory_order_relaxed);
+        stats.fd_evictions += counters[STAT_FD_EVICTIONS].load(std::memory_order_relaxed);
+        stats.fd_reopens += counters[STAT_FD_REOPENS].load(std::memory_order_relaxed);
+        stats.spills += counters[STAT_SPILLS].load(std::memory_order_relaxed);
+        stats.commits += counters[STAT_COMMITS].load(std::memory_order_relaxed);
+        stats.dir_syncs += counters[STAT_DIR_SYNCS].load(std::memory_order_relaxed);
+        stats.bytes_copied += counters[STAT_BYTES_COPIED].load(std::memory_order_relaxed);
+        stats.clones += counters[STAT_CLONES].load(std::memory_order_relaxed);
+        stats.preallocated_bytes += counters[STAT_PREALLOCATED_BYTES].load(std::memory_order_relaxed);
+        stats.preallocation_failures += counters[STAT_PREALLOCATION_FAILURES].load(std::memory_order_relaxed);
+        for (size_t i = 0; i < buckets; i++) stats.construct_latency[i] += construct_latency[i].load(std::memory_order_relaxed);
+        for (size_t i = 0; i < buckets; i++) stats.cleanup_latency[i] += cleanup_latency[i].load(std::memory_order_relaxed);
+    }
+};
+
+/* Every live ThreadStats, and the sum of those whose thread has exited.
+   Never destroyed, files may still be cleaned up during static destruction.  */
+struct StatsRegistry {
+    std::mutex mutex;
+    std::vector<ThreadStats *> threads;
+    ThreadStats retired;
+
+    StatsRegistry() {
+        retired.shared = true;
+#if !defined(_WIN32)
+        pthread_atfork(&StatsRegistry::before_fork, &StatsRegistry::after_fork, &StatsRegistry::after_fork);
 #endif
-                }
+    }
+
+    static StatsRegistry * get() {
+        static StatsRegistry * registry = new StatsRegistry();
+        return registry;
+    }
+
+#if !defined(_WIN32)
+    // the threads of the parent are gone in the child, but their counters are kept
+    static void before_fork() {
+        get()->mutex.lock();
+    }
+
+    static void after_fork() {
+        get()->mutex.unlock();
+    }
+#endif
+};
+
+static thread_local ThreadStats * thread_stats = nullptr;
+
+struct ThreadStatsOwner {
+    ThreadStats * stats = nullptr;
+
+    ~ThreadStatsOwner() {
+        if (stats == nullptr) {
+            return;
+        }
+        StatsRegistry * registry = StatsRegistry::get();
+        {
+            std::lock_guard<std::mutex> lock(registry->mutex);
+            auto it = std::find(registry->threads.begin(), registry->threads.end(), stats);
+            if (it != registry->threads.end()) {
+                registry->threads.erase(it);
             }
+            stats->merge_into(registry->retired);
         }
+        // anything this thread cleans up after this point is counted straight into retired
+        thread_stats = &registry->retired;
+        delete stats;
+        stats = nullptr;
     }
-    return tmp_dir;
-#endif
+};
+
+static thread_local ThreadStatsOwner thread_stats_owner;
+
+static ThreadStats * current_stats() {
+    ThreadStats * stats = thread_stats;
+    if (stats != nullptr) {
+        return stats;
+    }
+    SaveError e;
+    StatsRegistry * registry = StatsRegistry::get();
+    stats = new ThreadStats();
+    {
+        std::lock_guard<std::mutex> lock(registry->mutex);
+        registry->threads.push_back(stats);
+    }
+    thread_stats = stats;
+    thread_stats_owner.stats = stats;
+    return stats;
 }
 
-TempFile::CleanUp::CleanUp() {
-#if defined(_WIN32)
-    fd = INVALID_HANDLE_VALUE;
-#else
-    fd = -1;
-#endif
+static inline void stat_add(Stat stat, uint64_t n = 1) {
+    ThreadStats * stats = current_stats();
+    stats->add(stats->counters[stat], n);
 }
 
-bool TempFile::CleanUp::is_valid() const {
-    return
-#if defined(_WIN32)
-    fd != INVALID_HANDLE_VALUE
+static inline size_t latency_bucket(uint64_t nanoseconds) {
+    size_t bucket = 0;
+#if defined(__GNUC__)
+    if (nanoseconds != 0) bucket = 64 - __builtin_clzll(nanoseconds);
 #else
-    fd >= 0
+    while (nanoseconds != 0) {
+        bucket++;
+        nanoseconds >>= 1;
+    }
 #endif
-    && path.length() != 0;
+    return bucket < TempFileStats::histogram_buckets ? bucket : TempFileStats::histogram_buckets - 1;
 }
 
-void TempFile::CleanUp::detach() {
-    detached = true;
+static inline uint64_t elapsed_ns(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
 }
 
-void TempFile::CleanUp::reset_fd() {
-#if defined(_WIN32)
-    if (fd != INVALID_HANDLE_VALUE) {
-        SaveError e;
-        if (!detached) CloseHandle(fd);
-    }
-    fd = INVALID_HANDLE_VALUE;
-#else
-    if (fd >= 0) {
-        SaveError e;
-        if (!detached) close(fd);
-    }
-    fd = -1;
-#endif
+static inline void stat_construct_latency(uint64_t nanoseconds, uint64_t n = 1) {
+    ThreadStats * stats = current_stats();
+    stats->add(stats->construct_latency[latency_bucket(nanoseconds)], n);
 }
 
-void TempFile::CleanUp::reset_path() {
-    if (!fatal_path && path.length() != 0) {
-        SaveError e;
-        if (log_create_close) {
-            if (detached) {
-                std::cout << "detaching temporary file: " << path << std::endl;
-            } else {
-                std::cout << "deleting temporary file: " << path << std::endl;
-            }
+static inline void stat_cleanup_latency(uint64_t nanoseconds) {
+    ThreadStats * stats = current_stats();
+    stats->add(stats->cleanup_latency[latency_bucket(nanoseconds)], 1);
+}
+
+/* Times a construct from its creation to the end of the scope, and counts
+   it as a create or a fatal error depending on whether DATA ended up valid.  */
+template <typename CleanUp>
+struct ConstructStat {
+    const CleanUp & data;
+    std::chrono::steady_clock::time_point start;
+
+    explicit ConstructStat(const CleanUp & data) : data(data), start(std::chrono::steady_clock::now()) {}
+
+    ~ConstructStat() {
+        stat_construct_latency(elapsed_ns(start));
+        stat_add(data.is_valid() ? STAT_CREATES : STAT_FATAL_ERRORS);
+    }
+};
+
+static uint64_t histogram_percentile(const uint64_t * histogram, double p) {
+    uint64_t total = 0;
+    for (size_t i = 0; i < TempFileStats::histogram_buckets; i++) {
+        total += histogram[i];
+    }
+    if (total == 0) {
+        return 0;
+    }
+    uint64_t rank = static_cast<uint64_t>(p * total);
+    if (rank >= total) rank = total - 1;
+    uint64_t seen = 0;
+    for (size_t i = 0; i < TempFileStats::histogram_buckets; i++) {
+        seen += histogram[i];
+        if (seen > rank) {
+            return i == 0 ? 0 : (i == TempFileStats::histogram_buckets - 1 ? UINT64_MAX : (uint64_t(1) << i) - 1);
         }
-#if defined(_WIN32)
-        if (!detached) DeleteFile(path.c_str());
-#else
-        if (!detached) unlink(path.c_str());
-#endif
     }
-    path = {};
+    return UINT64_MAX;
 }
 
-void TempFile::CleanUp::reset() {
-    reset_fd();
-    reset_path();
-    detached = false;
+uint64_t TempFileStats::construct_percentile(double p) const {
+    return histogram_percentile(construct_latency, p);
 }
 
-TempFile::CleanUp::~CleanUp() {
-    reset();
+uint64_t TempFileStats::cleanup_percentile(double p) const {
+    return histogram_percentile(cleanup_latency, p);
 }
 
-#include <random>
-#include <functional> // std::hash
-#include <chrono> // epoch
-#include <iostream>
-#include <iterator>
-
-static char* rng_get_fallback_buf() {
-    static char buf[1];
-    return buf;
+TempFileStats TempFile::stats() {
+    TempFileStats stats;
+    StatsRegistry * registry = StatsRegistry::get();
+    std::lock_guard<std::mutex> lock(registry->mutex);
+    registry->retired.merge_into(stats);
+    for (ThreadStats * thread : registry->threads) {
+        thread->merge_into(stats);
+    }
+    return stats;
 }
 
-/*
- * Write `n` bytes of high quality random bytes to `buf`
- */
-extern "C" int randombytes(void* buf, size_t n);
+// events
+
+static std::mutex event_sinks_mutex;
 
-static int rng_get_fallback() {
-    static auto unused = randombytes(rng_get_fallback_buf(), sizeof(char));
-    return static_cast<int>(rng_get_fallback_buf()[0]);
+static TempFileEventSink * console_sink() {
+    // never destroyed, files may still be cleaned up during static destruction
+    static TempFileEventSink * sink = new TempFileConsoleSink();
+    return sink;
 }
 
-static auto rng_get() {
-    static int r = std::random_device()();
-    if (r == 0) {
-        static int r2 = rng_get_fallback();
-        return r2 == 0 ? 1 : r2;
+static std::atomic<TempFileEventSink *> event_sink {nullptr};
+
+void TempFile::set_event_sink(std::shared_ptr<TempFileEventSink> sink) {
+    // a thread may still be inside the old sink, so no sink is ever destroyed
+    static auto * kept = new std::vector<std::shared_ptr<TempFileEventSink>>();
+    std::lock_guard<std::mutex> lock(event_sinks_mutex);
+    if (sink == nullptr) {
+        event_sink.store(nullptr, std::memory_order_release);
+        return;
     }
-    else {
-        return r;
+    kept->push_back(sink);
+    event_sink.store(sink.get(), std::memory_order_release);
+}
+
+static inline int64_t event_fd(int fd) {
+    return fd;
+}
+
+static inline int64_t event_fd(FILE * file) {
+#if defined(_WIN32)
+    return file == nullptr ? -1 : _fileno(file);
+#else
+    return file == nullptr ? -1 : fileno(file);
+#endif
+}
+
+#if defined(_WIN32)
+static inline int64_t event_fd(HANDLE handle) {
+    return handle == INVALID_HANDLE_VALUE ? -1 : static_cast<int64_t>(reinterpret_cast<intptr_t>(handle));
+}
+#endif
+
+static void log_event(int type, int64_t fd, const char * path, size_t path_length) {
+    SaveError e;
+    TempFileEvent event;
+    event.type = type;
+    event.fd = fd;
+    event.timestamp = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+    event.path = path;
+    event.path_length = path_length;
+    TempFileEventSink * sink = event_sink.load(std::memory_order_acquire);
+    if (sink == nullptr) {
+        sink = console_sink();
     }
+    sink->event(event);
 }
 
-static void * get_stack_var() {
-    int foo = 6;
-    return std::addressof(foo);
+void TempFileConsoleSink::event(const TempFileEvent & event) {
+    const char * what = "";
+    switch (event.type) {
+        case TEMP_FILE_EVENT_CREATED: what = "created temporary file: "; break;
+        case TEMP_FILE_EVENT_CREATED_ANONYMOUS: what = "created anonymous temporary file: "; break;
+        case TEMP_FILE_EVENT_DETACHED: what = "detaching temporary file: "; break;
+        case TEMP_FILE_EVENT_DELETED: what = "deleting temporary file: "; break;
+        case TEMP_FILE_EVENT_RELEASED_ANONYMOUS: what = "releasing anonymous temporary file: "; break;
+    }
+    std::cout << what;
+    std::cout.write(event.path, event.path_length);
+    std::cout << std::endl;
 }
 
-// static initialization order is unspecified, use macros to guarantee order
-using SEED_TYPE = long unsigned int;
+void TempFileConsoleSink::flush() {
+    std::cout.flush();
+}
 
-template <typename H>
-std::size_t h(const H & ha) {
-    std::size_t hash = std::hash<H>()(ha);
-    return hash == 0 ? 1 : hash;
+static size_t round_up_pow2(size_t n) {
+    size_t p = 1;
+    while (p < n) p <<= 1;
+    return p;
 }
 
-#define HASH_CSTR(c) h(std::string(reinterpret_cast<const char*>(c)))
-#define HASH_CSTRL(c, l) h(std::string(reinterpret_cast<const char*>(c), l))
-#define HASH_INT(c) h(static_cast<int>(c))
-#define HASH_PTR(c) h(reinterpret_cast<size_t>(c))
+/* A single producer single consumer ring of records, and a ring of the
+   path bytes that follow them. The owning thread pushes, the writer
+   thread pops. The path of a record starts where the previous one ended,
+   so records only need to carry the length.  */
+struct TempFileLogSink::Buffer {
+    std::vector<TempFileEventRecord> records;
+    std::vector<char> paths;
 
-#define seed_2 (std::chrono::system_clock::now().time_since_epoch().count() == 0 ? 1 : std::chrono::system_clock::now().time_since_epoch().count())
-#define seed_1 rng_get() * rng_get() * seed_2
-#define seed_3 HASH_CSTR(__FILE__) + HASH_CSTR(__DATE__) + seed_1
-#define seed_4 HASH_INT(__LINE__) + HASH_CSTR(__DATE__) + seed_1
-#define seed_5 HASH_CSTR(__FILE__) + HASH_INT(__LINE__) + HASH_CSTR(__DATE__) + seed_1
-#define seed_6 HASH_PTR(&rng_get) + seed_1
-#define seed_7 reinterpret_cast<size_t>(get_stack_var()) + seed_1
-#define seed_8 seed_2 * seed_1
-#define seed_9 seed_2 * seed_2
-#define seed \
-    static_cast<SEED_TYPE>(seed_1), static_cast<SEED_TYPE>(seed_2), static_cast<SEED_TYPE>(seed_3), \
-    static_cast<SEED_TYPE>(seed_4), static_cast<SEED_TYPE>(seed_5), static_cast<SEED_TYPE>(seed_6), \
-    static_cast<SEED_TYPE>(seed_7), static_cast<SEED_TYPE>(seed_8), static_cast<SEED_TYPE>(seed_9)
+    uint32_t thread = 0;
 
-// use given seq to generate random seeds to produce more random seeds
+    // producer position, written by the owning thread
+    alignas(64) std::atomic<uint64_t> head {0};
+    std::atomic<uint64_t> path_head {0};
 
-class SeedList
-{
-    public:
-    std::vector<std::seed_seq*> seeds;
-    SeedList() {}
+    // consumer position, written by the writer thread
+    alignas(64) std::atomic<uint64_t> tail {0};
+    std::atomic<uint64_t> path_tail {0};
 
-    // mutate the seed N times, the original seed must have randomness
-    std::seed_seq & get(int mutation_count, SEED_TYPE s1, SEED_TYPE s2, SEED_TYPE s3, SEED_TYPE s4, SEED_TYPE s5, SEED_TYPE s6, SEED_TYPE s7, SEED_TYPE s8, SEED_TYPE s9) {
-        // std::cout << "creating seed" << std::endl;
-        std::vector<SEED_TYPE> current_seed_vec = {s1, s2, s3, s4, s5, s6, s7, s8, s9};
-        // std::cout << "seed: { ";
-        // std::copy(current_seed_vec.begin(), current_seed_vec.end(), std::ostream_iterator<SEED_TYPE>(std::cout, ", "));
-        // std::cout << " }" << std::endl;
+    Buffer(size_t record_capacity, size_t path_capacity) : records(record_capacity), paths(path_capacity) {}
+
+    bool push(const TempFileEventRecord & record, const char * path) {
+        uint64_t h = head.load(std::memory_order_relaxed);
+        uint64_t ph = path_head.load(std::memory_order_relaxed);
+        if (h - tail.load(std::memory_order_acquire) >= records.size()) {
+            return false;
+        }
+        if (ph + record.path_length - path_tail.load(std::memory_order_acquire) > paths.size()) {
+            return false;
+        }
+        records[h & (records.size() - 1)] = record;
+        size_t at = ph & (paths.size() - 1);
+        size_t first = std::min<size_t>(record.path_length, paths.size() - at);
+        memcpy(&paths[at], path, first);
+        memcpy(&paths[0], path + first, record.path_length - first);
+        path_head.store(ph + record.path_length, std::memory_order_relaxed);
+        head.store(h + 1, std::memory_order_release);
+        return true;
+    }
 
+    // appends every queued record and its path to out
+    void pop_all(std::vector<char> & out) {
+        uint64_t t = tail.load(std::memory_order_relaxed);
+        uint64_t pt = path_tail.load(std::memory_order_relaxed);
+        uint64_t h = head.load(std::memory_order_acquire);
+        for (; t != h; t++) {
+            const TempFileEventRecord & record = records[t & (records.size() - 1)];
+            const char * bytes = reinterpret_cast<const char *>(&record);
+            out.insert(out.end(), bytes, bytes + sizeof(record));
+            size_t at = pt & (paths.size() - 1);
+            size_t first = std::min<size_t>(record.path_length, paths.size() - at);
+            out.insert(out.end(), &paths[at], &paths[at] + first);
+            out.insert(out.end(), &paths[0], &paths[0] + (record.path_length - first));
+            pt += record.path_length;
+        }
+        path_tail.store(pt, std::memory_order_release);
+        tail.store(t, std::memory_order_release);
+    }
+};
 
-        for (int mutation_c = 0; mutation_c < mutation_count; mutation_c ++) {
+/* Every live TempFileLogSink, so their writers can be stopped across a
+   fork and drained when the program exits. Never destroyed.  */
+struct LogSinkRegistry {
+    std::mutex mutex;
+    std::vector<TempFileLogSink *> sinks;
+    uint64_t next_id = 1;
 
-            auto tmp_seq = std::seed_seq(current_seed_vec.begin(), current_seed_vec.end());
+    static LogSinkRegistry * get() {
+        static LogSinkRegistry * registry = new LogSinkRegistry();
+        return registry;
+    }
 
-            std::mt19937_64 s {tmp_seq};
-            
-            current_seed_vec = {s(), s(), s(), s(), s(), s(), s(), s(), s()};
-            
-            // std::cout << "mutated seed: { ";
-            // std::copy(current_seed_vec.begin(), current_seed_vec.end(), std::ostream_iterator<SEED_TYPE>(std::cout, ", "));
-            // std::cout << " }" << std::endl;
+    LogSinkRegistry() {
+#if !defined(_WIN32)
+        pthread_atfork(&LogSinkRegistry::before_fork, &LogSinkRegistry::after_fork_parent, &LogSinkRegistry::after_fork_child);
+#endif
+        atexit(&LogSinkRegistry::shutdown);
+    }
+
+    static void shutdown() {
+        LogSinkRegistry * registry = get();
+        std::lock_guard<std::mutex> lock(registry->mutex);
+        for (TempFileLogSink * sink : registry->sinks) {
+            sink->shutdown();
         }
+    }
 
-        seeds.push_back(new std::seed_seq(current_seed_vec.begin(), current_seed_vec.end()));
-        return *seeds.back();
+#if !defined(_WIN32)
+    // no sink mutex may be held by the writer across the fork
+    static void before_fork() {
+        LogSinkRegistry * registry = get();
+        registry->mutex.lock();
+        for (TempFileLogSink * sink : registry->sinks) {
+            sink->mutex.lock();
+        }
     }
 
-    std::seed_seq & get(SEED_TYPE s1, SEED_TYPE s2, SEED_TYPE s3, SEED_TYPE s4, SEED_TYPE s5, SEED_TYPE s6, SEED_TYPE s7, SEED_TYPE s8, SEED_TYPE s9) {
-        return get(1, s1, s2, s3, s4, s5, s6, s7, s8, s9);
+    static void after_fork_parent() {
+        LogSinkRegistry * registry = get();
+        for (TempFileLogSink * sink : registry->sinks) {
+            sink->mutex.unlock();
+        }
+        registry->mutex.unlock();
     }
 
-    ~SeedList() {
-        for(auto s : seeds) {
-            // std::cout << "deleting seed" << std::endl;
-            delete s;
+    // the writer does not exist in the child, it is started again by the next event
+    static void after_fork_child() {
+        LogSinkRegistry * registry = get();
+        for (TempFileLogSink * sink : registry->sinks) {
+            sink->writer = nullptr;
+            sink->running.store(false, std::memory_order_relaxed);
+            sink->mutex.unlock();
         }
+        registry->mutex.unlock();
     }
+#endif
 };
 
+/* The buffers of the calling thread, one per sink. Freed when the thread
+   exits, after which the thread writes its events through the sink mutex.  */
+struct ThreadLogBuffers {
+    std::vector<std::pair<uint64_t, std::shared_ptr<void>>> buffers;
+};
 
-// 1 mutation is sufficient to generate a randomized seed
-//   for all seed components as long as one component contains true randomness
-//  however we can mutate more times if needed
+static thread_local ThreadLogBuffers * thread_log_buffers = nullptr;
+static thread_local bool thread_log_buffers_gone = false;
 
-static inline std::mt19937_64& rng() {
-    static SeedList seq_list;
-    static std::mt19937_64 rng_ {seq_list.get(1, seed)};
-    return rng_;
-}
+struct ThreadLogBuffersOwner {
+    ThreadLogBuffers * buffers = nullptr;
 
-TempFile::TempFile() {
-    data = std::make_shared<CleanUp>();
+    ~ThreadLogBuffersOwner() {
+        delete buffers;
+        thread_log_buffers = nullptr;
+        thread_log_buffers_gone = true;
+    }
+};
+
+static thread_local ThreadLogBuffersOwner thread_log_buffers_owner;
+
+TempFileLogSink::TempFileLogSink(const std::string & path) : TempFileLogSink(path, 1024, 64 * 1024) {}
+
+TempFileLogSink::TempFileLogSink(const std::string & path, size_t records_per_thread, size_t path_bytes_per_thread) {
+    record_capacity = round_up_pow2(records_per_thread == 0 ? 1 : records_per_thread);
+    path_capacity = round_up_pow2(path_bytes_per_thread == 0 ? 1 : path_bytes_per_thread);
+    file = fopen(path.c_str(), "ab");
+#if !defined(_WIN32)
+    if (file != nullptr) {
+        // the writer thread must not leak the log into children that exec
+        fcntl(fileno(file), F_SETFD, FD_CLOEXEC);
+    }
+#endif
+    LogSinkRegistry * registry = LogSinkRegistry::get();
+    std::lock_guard<std::mutex> lock(registry->mutex);
+    id = registry->next_id++;
+    registry->sinks.push_back(this);
 }
 
-TempFile::TempFile(const std::string & dir, const std::string & template_prefix) {
-    data = std::make_shared<CleanUp>();
-    construct(dir, template_prefix);
+bool TempFileLogSink::is_valid() const {
+    return file != nullptr;
 }
 
-TempFile::TempFile(const std::string & dir, const std::string & template_prefix, bool log_create_close) {
-    data = std::make_shared<CleanUp>();
-    construct(dir, template_prefix, log_create_close);
+uint64_t TempFileLogSink::dropped() const {
+    return dropped_.load(std::memory_order_relaxed);
 }
 
-TempFile::TempFile(const std::string & dir, const std::string & template_prefix, const std::string & template_suffix) {
-    data = std::make_shared<CleanUp>();
-    construct(dir, template_prefix, template_suffix);
+TempFileLogSink::Buffer * TempFileLogSink::thread_buffer() {
+    if (thread_log_buffers_gone) {
+        return nullptr;
+    }
+    ThreadLogBuffers * buffers = thread_log_buffers;
+    if (buffers == nullptr) {
+        buffers = new ThreadLogBuffers();
+        thread_log_buffers = buffers;
+        thread_log_buffers_owner.buffers = buffers;
+    }
+    for (auto & entry : buffers->buffers) {
+        if (entry.first == id) {
+            return static_cast<Buffer *>(entry.second.get());
+        }
+    }
+    auto buffer = std::make_shared<Buffer>(record_capacity, path_capacity);
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        buffer->thread = ++threads;
+        thread_buffers.push_back(buffer);
+    }
+    buffers->buffers.emplace_back(id, buffer);
+    return buffer.get();
 }
 
-TempFile::TempFile(const std::string & dir, const std::string & template_prefix, const std::string & template_suffix, bool log_create_close) {
-    data = std::make_shared<CleanUp>();
-    construct(dir, template_prefix, template_suffix, log_create_close);
+void TempFileLogSink::event(const TempFileEvent & event) {
+    if (file == nullptr) {
+        return;
+    }
+    TempFileEventRecord record;
+    record.timestamp = event.timestamp;
+    record.fd = event.fd;
+    record.thread = 0;
+    record.type = static_cast<uint16_t>(event.type);
+    record.path_length = static_cast<uint16_t>(std::min<size_t>(event.path_length, UINT16_MAX));
+
+    Buffer * buffer = stopped.load(std::memory_order_acquire) ? nullptr : thread_buffer();
+    if (buffer == nullptr) {
+        // there is no writer any more, or this thread has already exited
+        std::lock_guard<std::mutex> lock(mutex);
+        fwrite(&record, sizeof(record), 1, file);
+        fwrite(event.path, 1, record.path_length, file);
+        fflush(file);
+        return;
+    }
+    record.thread = buffer->thread;
+    if (!buffer->push(record, event.path)) {
+        dropped_.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+    if (!running.load(std::memory_order_acquire)) {
+        start();
+    }
 }
 
-bool TempFile::is_valid() const {
-    return this->data->is_valid();
+bool TempFileLogSink::start() {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (running.load(std::memory_order_relaxed)) {
+        return true;
+    }
+    if (stop) {
+        return false;
+    }
+    try {
+        writer = new std::thread(&TempFileLogSink::run, this);
+    } catch (...) {
+        // the events stay queued until flush is called
+        return false;
+    }
+    running.store(true, std::memory_order_release);
+    return true;
 }
 
-bool TempFile::construct(const std::string & dir, const std::string & template_prefix) {
-    return construct(dir, template_prefix, "", false);
+// must be called with mutex held, it is the only consumer of the buffers
+void TempFileLogSink::drain(std::vector<char> & out) {
+    out.clear();
+    for (size_t i = 0; i < thread_buffers.size();) {
+        // once the thread has exited nothing more can be queued, drain it one last time
+        bool exited = thread_buffers[i].use_count() == 1;
+        std::atomic_thread_fence(std::memory_order_acquire);
+        thread_buffers[i]->pop_all(out);
+        if (exited) {
+            thread_buffers.erase(thread_buffers.begin() + i);
+            continue;
+        }
+        i++;
+    }
+    if (out.size() != 0) {
+        fwrite(out.data(), 1, out.size(), file);
+        fflush(file);
+    }
 }
 
-bool TempFile::construct(const std::string & dir, const std::string & template_prefix, bool log_create_close) {
-    return construct(dir, template_prefix, "", log_create_close);
+void TempFileLogSink::run() {
+    static const auto interval = std::chrono::milliseconds(10);
+    std::vector<char> out;
+    std::unique_lock<std::mutex> lock(mutex);
+    while (!stop) {
+        wake_cv.wait_for(lock, interval);
+        drain(out);
+    }
 }
 
-bool TempFile::construct(const std::string & dir, const std::string & template_prefix, const std::string & template_suffix) {
-    return construct(dir, template_prefix, template_suffix, false);
+void TempFileLogSink::flush() {
+    if (file == nullptr) {
+        return;
+    }
+    SaveError e;
+    std::vector<char> out;
+    std::lock_guard<std::mutex> lock(mutex);
+    drain(out);
 }
 
-bool TempFile::construct(const std::string & dir, const std::string & template_prefix, const std::string & template_suffix, bool log_create_close) {
-    if (dir.length() == 0) {
-        return construct(TempDir(), template_prefix, template_suffix, log_create_close);
+void TempFileLogSink::shutdown() {
+    std::thread * thread;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stop = true;
+        thread = writer;
+        writer = nullptr;
     }
+    stopped.store(true, std::memory_order_release);
+    wake_cv.notify_all();
+    if (thread != nullptr) {
+        thread->join();
+        delete thread;
+    }
+    running.store(false, std::memory_order_release);
+    flush();
+}
 
-    if (this->data->is_valid()) {
-        // return true if we are already set-up
-        return true;
+TempFileLogSink::~TempFileLogSink() {
+    {
+        LogSinkRegistry * registry = LogSinkRegistry::get();
+        std::lock_guard<std::mutex> lock(registry->mutex);
+        auto it = std::find(registry->sinks.begin(), registry->sinks.end(), this);
+        if (it != registry->sinks.end()) {
+            registry->sinks.erase(it);
+        }
+    }
+    shutdown();
+    if (file != nullptr) {
+        fclose(file);
     }
+}
 
-    SaveError error;
+// paths
 
-    // we dont care if we get any errors here, if we fail to clean up then we should not consider this an error
-    this->data->reset();
+#define PATH_STEMS_MAX 4096
 
-    this->data->log_create_close = log_create_close;
+// what comes before and after the generated name of a TempFilePath
+struct PathStem {
+    std::string head;
+    std::string tail;
+    // where the subdirectories of a TEMP_FILE_CREATE_FANOUT path go in head, 0 if there are none
+    uint32_t fanout_at = 0;
 
-    // we have cleaned up
+    bool matches(const char * head, size_t head_length, const char * tail, size_t tail_length, uint32_t fanout_at) const {
+        return this->head.length() == head_length && this->tail.length() == tail_length && this->fanout_at == fanout_at
+            && memcmp(this->head.data(), head, head_length) == 0
+            && memcmp(this->tail.data(), tail, tail_length) == 0;
+    }
+};
 
-    std::string path = {};
-    path += dir;
-    path += "/";
-    path += template_prefix;
-    path += "XXXXXX";
-    path += template_suffix;
+/* The interned stems. A stem is never removed or changed once published,
+   so they are read without a lock. Never destroyed, files may still be
+   cleaned up during static destruction.  */
+struct PathStems {
+    std::atomic<const PathStem *> stems[PATH_STEMS_MAX];
 
-#if defined(_WIN32)
-    char * XXXXXX = &path[path.length()-template_suffix.length()-6];
+    std::mutex mutex;
+    std::unordered_map<std::string, uint32_t> ids;
+    uint32_t next = 1;
 
-    // based on
-    // https://github.com/wbx-github/uclibc-ng/blob/master/libc/misc/internals/tempname.c#L166
+    PathStems() {
+        for (auto & stem : stems) stem.store(nullptr, std::memory_order_relaxed);
+#if !defined(_WIN32)
+        pthread_atfork(&PathStems::before_fork, &PathStems::after_fork, &PathStems::after_fork);
+#endif
+    }
 
-    /* Generate a temporary file name based on TMPL. TMPL must match the
-    rules for mk[s]temp[s] (i.e. end in "prefixXXXXXXsuffix"). The name
-    constructed does not exist at the time of the call to __gen_tempname.
-    TMPL is overwritten with the result.
-    KIND may be one of:
-    __GT_NOCREATE:       simply verify that the name does not exist
-                            at the time of the call. mode argument is ignored.
-    __GT_FILE:           create the file using open(O_CREAT|O_EXCL)
-                            and return a read-write fd with given mode.
-    __GT_BIGFILE:        same as __GT_FILE but use open64().
-    __GT_DIR:            create a directory with given mode.
-    */
+    static PathStems * get() {
+        static PathStems * stems = new PathStems();
+        return stems;
+    }
 
-    unsigned int i;
+#if !defined(_WIN32)
+    static void before_fork() {
+        get()->mutex.lock();
+    }
+
+    static void after_fork() {
+        get()->mutex.unlock();
+    }
 #endif
 
-    while (true) {
+    const PathStem * at(uint32_t id) const {
+        return stems[id].load(std::memory_order_acquire);
+    }
 
-        // if we are invalid we need to clean up and try again
-        this->data->reset();
+    // returns 0 once the table is full
+    uint32_t intern(const char * head, size_t head_length, const char * tail, size_t tail_length, uint32_t fanout_at) {
+        // a thread usually creates its files in the same place, skip the lock if it did last time
+        static thread_local uint32_t last = 0;
+        if (last != 0 && at(last)->matches(head, head_length, tail, tail_length, fanout_at)) {
+            return last;
+        }
 
-#if defined(_WIN32)
+        std::string key;
+        key.reserve(head_length + 1 + tail_length + sizeof(fanout_at));
+        key.append(head, head_length);
+        key.push_back('\0');
+        key.append(tail, tail_length);
+        key.append(reinterpret_cast<const char *>(&fanout_at), sizeof(fanout_at));
+
+        std::lock_guard<std::mutex> lock(mutex);
+        auto it = ids.find(key);
+        if (it != ids.end()) {
+            last = it->second;
+            return last;
+        }
+        if (next == PATH_STEMS_MAX) {
+            return 0;
+        }
+        PathStem * stem = new PathStem();
+        stem->head.assign(head, head_length);
+        stem->tail.assign(tail, tail_length);
+        stem->fanout_at = fanout_at;
+        stems[next].store(stem, std::memory_order_release);
+        ids.emplace(std::move(key), next);
+        last = next;
+        return next++;
+    }
+};
 
-#ifndef TMP_MAX
-#define TMP_MAX 238328
-#endif
+TempFilePath::TempFilePath(TempFilePath && other) noexcept {
+    swap(other);
+}
 
-        for (i = 0; i < TMP_MAX; ++i) {
-            
-            /* Get some random data.  */
-            XXXXXX[0] = LETTER_DIST; // 1
-            XXXXXX[1] = LETTER_DIST; // 2
-            XXXXXX[2] = LETTER_DIST; // 3
-            XXXXXX[3] = LETTER_DIST; // 4
-            XXXXXX[4] = LETTER_DIST; // 5
-            XXXXXX[5] = LETTER_DIST; // 6
-            
-            this->data->fd = CreateFile (
-                path.c_str(),
-                GENERIC_READ | GENERIC_WRITE,
-                0,
-                NULL,
-                OPEN_ALWAYS,
-                FILE_ATTRIBUTE_TEMPORARY|FILE_FLAG_DELETE_ON_CLOSE,
-                NULL
-            );
+TempFilePath & TempFilePath::operator=(TempFilePath && other) noexcept {
+    if (this != &other) {
+        clear();
+        swap(other);
+    }
+    return *this;
+}
 
-            if (this->data->fd == INVALID_HANDLE_VALUE) {
-                if (GetLastError() != ERROR_ALREADY_EXISTS) {
-                    /* Any other error will apply also to other names we might
-                    try, and there are 2^32 or so of them, so give up now. */
+TempFilePath::~TempFilePath() {
+    delete full.load(std::memory_order_relaxed);
+}
 
-                    // fd is already invalid thus no need to reset it
+bool TempFilePath::empty() const {
+    return stem == 0 && full.load(std::memory_order_acquire) == nullptr;
+}
 
-                    error = {}; // save current error, and restore after move
+size_t TempFilePath::length() const {
+    if (stem != 0) {
+        const PathStem * s = PathStems::get()->at(stem);
+        // each of the two subdirectory names kept with the generated name is followed by a slash
+        return s->head.length() + unique_length + s->tail.length() + (s->fanout_at != 0 ? 2 : 0);
+    }
+    std::string * f = full.load(std::memory_order_acquire);
+    return f == nullptr ? 0 : f->length();
+}
 
-                    this->data->path = std::move(path); // so the user can see what path may have caused the error
+size_t TempFilePath::copy(char * buffer, size_t size) const {
+    const char * parts[5] = {"", "", "", "", ""};
+    size_t lengths[5] = {0, 0, 0, 0, 0};
+    char fanout[4];
+    if (stem != 0) {
+        const PathStem * s = PathStems::get()->at(stem);
+        if (s->fanout_at != 0) {
+            // dir/ a/b/ prefix XXXXXX suffix, the subdirectory names are the first two characters of unique
+            fanout[0] = unique[0];
+            fanout[1] = '/';
+            fanout[2] = unique[1];
+            fanout[3] = '/';
+            parts[0] = s->head.data();
+            lengths[0] = s->fanout_at;
+            parts[1] = fanout;
+            lengths[1] = 4;
+            parts[2] = s->head.data() + s->fanout_at;
+            lengths[2] = s->head.length() - s->fanout_at;
+            parts[3] = unique + 2;
+            lengths[3] = unique_length - 2;
+        } else {
+            parts[0] = s->head.data();
+            lengths[0] = s->head.length();
+            parts[1] = unique;
+            lengths[1] = unique_length;
+        }
+        parts[4] = s->tail.data();
+        lengths[4] = s->tail.length();
+    } else if (std::string * f = full.load(std::memory_order_acquire)) {
+        parts[0] = f->data();
+        lengths[0] = f->length();
+    }
+    size_t length = 0;
+    for (int i = 0; i < 5; i++) {
+        if (length < size) {
+            memcpy(buffer + length, parts[i], std::min(lengths[i], size - length));
+        }
+        length += lengths[i];
+    }
+    if (size != 0) {
+        buffer[std::min(length, size - 1)] = '\0';
+    }
+    return length;
+}
 
-                    // dont attempt to delete path, it did not exist at time of call and an error has prevented its creation
-                    this->data->fatal_path = true;
+const std::string & TempFilePath::str() const {
+    std::string * f = full.load(std::memory_order_acquire);
+    if (f != nullptr) {
+        return *f;
+    }
+    if (stem == 0) {
+        static const std::string * empty = new std::string();
+        return *empty;
+    }
+    // another thread may be building it from a copy of the same handle, keep whichever is published first
+    std::string * built = new std::string(length(), '\0');
+    copy(&(*built)[0], built->length() + 1);
+    if (!full.compare_exchange_strong(f, built, std::memory_order_acq_rel, std::memory_order_acquire)) {
+        delete built;
+        return *f;
+    }
+    return *built;
+}
 
-                    return false;
-                }
-                // file exists, try again
-                continue;
-            }
-            // we got a valid handle, and we have a valid path
-            this->data->path = std::move(path);
-            if (this->data->log_create_close) {
-                std::cout << "created temporary file: " << this->data->path << std::endl;
-            }
-            return true;
-        }
+void TempFilePath::assign(const std::string & path, size_t unique_begin, size_t tail_length) {
+    if (unique_begin + tail_length > path.length()) {
+        unique_begin = path.length();
+        tail_length = 0;
+    }
+    assign(path.data(), unique_begin, path.data() + unique_begin, path.length() - unique_begin - tail_length, path.data() + path.length() - tail_length, tail_length);
+}
 
-        /* We got out of the loop because we ran out of combinations to try.  */
+void TempFilePath::assign(const std::string & path, size_t unique_begin, size_t tail_length, size_t fanout_at) {
+    if (fanout_at == 0 || fanout_at + 4 > unique_begin || unique_begin + tail_length > path.length()) {
+        assign(path, unique_begin, tail_length);
+        return;
+    }
+    size_t unique_length = path.length() - unique_begin - tail_length;
+    if (unique_length + 2 > unique_max) {
+        // too long to keep inline, so the whole path is too long as well and is kept in full
+        assign("", 0, path.data(), path.length(), "", 0);
+        return;
+    }
+    // the stem leaves out the subdirectories, so the whole tree shares one
+    static thread_local std::string head;
+    head.assign(path, 0, fanout_at);
+    head.append(path, fanout_at + 4, unique_begin - fanout_at - 4);
+    char fanned[unique_max];
+    fanned[0] = path[fanout_at];
+    fanned[1] = path[fanout_at + 2];
+    memcpy(fanned + 2, path.data() + unique_begin, unique_length);
+    assign(head.data(), head.length(), fanned, unique_length + 2, path.data() + path.length() - tail_length, tail_length, static_cast<uint32_t>(fanout_at));
+}
 
-        // fd is already invalid thus no need to reset it
-        error.set_last_error();
-        error.set_errno(EEXIST);
-        this->data->path = std::move(path); // so the user can see what path may have caused the error
+void TempFilePath::assign(const char * head, size_t head_length, const char * unique, size_t unique_length, const char * tail, size_t tail_length) {
+    assign(head, head_length, unique, unique_length, tail, tail_length, 0);
+}
 
-        // dont attempt to delete path, it did not exist at time of call and an error has prevented its creation
-        this->data->fatal_path = true;
+void TempFilePath::assign(const char * head, size_t head_length, const char * unique, size_t unique_length, const char * tail, size_t tail_length, uint32_t fanout_at) {
+    clear();
+    if (unique_length <= unique_max) {
+        uint32_t id = PathStems::get()->intern(head, head_length, tail, tail_length, fanout_at);
+        if (id != 0) {
+            stem = id;
+            this->unique_length = static_cast<uint8_t>(unique_length);
+            memcpy(this->unique, unique, unique_length);
+            return;
+        }
+    }
+    std::string * f = new std::string();
+    f->reserve(head_length + unique_length + tail_length);
+    f->append(head, head_length);
+    f->append(unique, unique_length);
+    f->append(tail, tail_length);
+    full.store(f, std::memory_order_release);
+}
 
-        return false;
-#else
-        this->data->fd = mkstemps(&path[0], template_suffix.length());
+bool TempFilePath::fanned_out() const {
+    return stem != 0 && PathStems::get()->at(stem)->fanout_at != 0;
+}
 
-        if (this->data->fd < 0) {
-            if (this->data->fd == -1) {
-                error = {}; // save current error, and restore after move
-                this->data->path = std::move(path); // so the user can see what path may have caused the error
+void TempFilePath::clear() {
+    delete full.exchange(nullptr, std::memory_order_acq_rel);
+    stem = 0;
+    unique_length = 0;
+}
 
-                // dont attempt to delete path, it did not exist at time of call and an error has prevented its creation
-                this->data->fatal_path = true;
+void TempFilePath::swap(TempFilePath & other) {
+    std::swap(stem, other.stem);
+    std::swap(unique_length, other.unique_length);
+    char tmp[unique_max];
+    memcpy(tmp, unique, unique_max);
+    memcpy(unique, other.unique, unique_max);
+    memcpy(other.unique, tmp, unique_max);
+    std::string * f = full.load(std::memory_order_relaxed);
+    full.store(other.full.load(std::memory_order_relaxed), std::memory_order_relaxed);
+    other.full.store(f, std::memory_order_relaxed);
+}
 
-                return false;
-            }
-            goto LOOP_CONTINUE;
+/* A null terminated copy of a TempFilePath to pass to the system, on the
+   stack unless the path is unusually long.  */
+struct PathString {
+    char buffer[256];
+    const char * c_str;
+    size_t length;
+
+    explicit PathString(const TempFilePath & path) {
+        length = path.copy(buffer, sizeof(buffer));
+        c_str = length < sizeof(buffer) ? buffer : path.str().c_str();
+    }
+};
+
+/* Removes the subdirectories of a TEMP_FILE_CREATE_FANOUT file after the file
+   was unlinked, if they are empty now. Only every 32nd file of a thread tries,
+   a subdirectory that is still in use just fails with ENOTEMPTY.  */
+static void prune_after_unlink(const TempFilePath & path) {
+#if !defined(_WIN32)
+    static thread_local unsigned int unlinked = 0;
+    if (!path.fanned_out() || ++unlinked % 32 != 0) {
+        return;
+    }
+    SaveError e;
+    PathString p(path);
+    if (p.c_str != p.buffer) {
+        return;
+    }
+    for (int level = 0; level < 2; level++) {
+        char * slash = strrchr(p.buffer, '/');
+        if (slash == nullptr) {
+            return;
         }
-        this->data->path = std::move(path);
-        if (this->data->log_create_close) {
-            std::cout << "created temporary file: " << this->data->path << std::endl;
+        *slash = '\0';
+        if (rmdir(p.buffer) != 0) {
+            return;
         }
-        return true;
-#endif
-        LOOP_CONTINUE:
-        continue;
     }
-    // we should not get to here
-    error = {}; // save current error, and restore after move
+#else
+    (void)path;
+#endif
+}
 
-    this->data->path = std::move(path); // so the user can see what path may have caused the error
+static void log_event(int type, int64_t fd, const TempFilePath & path) {
+    PathString p(path);
+    log_event(type, fd, p.c_str, p.length);
+}
 
-    // dont attempt to delete path, it did not exist at time of call and an error has prevented its creation
-    this->data->fatal_path = true;
+// the path of the file, built in a buffer each thread reuses so constructing does not allocate it
+static std::string & scratch_path() {
+    static thread_local std::string path;
+    path.clear();
+    return path;
+}
 
-    return false;
+// the directory named by the environment, only looked up again after invalidate_temp_dir
+static std::string lookup_temp_dir() {
+#if defined(_WIN32)
+    char * tmp_dir = (char*)calloc(1, MAX_PATH+1);
+    if (tmp_dir == nullptr) {
+        throw std::bad_alloc();
+    }
+    DWORD rp = GetTempPathA(MAX_PATH, tmp_dir);
+    if (rp > MAX_PATH || rp == 0) {
+        free(tmp_dir);
+        // failed to get temporary path
+        // it is reasonable to assume subsequent attempts to obtain the path will fail until fixed by user
+        return "";
+    }
+    std::string t = tmp_dir;
+    free(tmp_dir);
+    return t;
+#else
+    /*
+        ISO/IEC 9945 (POSIX): The path supplied by the first environment variable found in the list
+        TMPDIR, TMP, TEMP, TEMPDIR.
+        
+        If none of these are found, "/tmp", or, if macro __ANDROID__ is defined, "/data/local/tmp"
+    */
+    const char * tmp_dir = getenv("TMPDIR");
+    if (tmp_dir == nullptr) {
+        tmp_dir = getenv("TMP");
+        if (tmp_dir == nullptr) {
+            tmp_dir = getenv("TEMP");
+            if (tmp_dir == nullptr) {
+                tmp_dir = getenv("TEMPDIR");
+                if (tmp_dir == nullptr) {
+#ifdef __ANDROID__
+                    tmp_dir = "/data/local/tmp";
+#else
+                    tmp_dir = "/tmp";
+#endif
+                }
+            }
+        }
+    }
+    return tmp_dir;
+#endif
 }
 
-const std::string & TempFile::get_path() const {
-    return this->data->path;
+// temp dir
+
+TempDirInfo::~TempDirInfo() {
+#if !defined(_WIN32)
+    if (dirfd >= 0) {
+        SaveError e;
+        close(dirfd);
+    }
+#endif
 }
 
-TempFile & TempFile::detach() {
-    this->data->detach();
-    return *this;
+#if defined(__linux__)
+// clones a one byte anonymous file, filesystems without reflink refuse with EOPNOTSUPP, EINVAL or EXDEV
+static bool probe_reflink(int dirfd, int src) {
+#if defined(FICLONE) && defined(O_TMPFILE)
+    if (write(src, "", 1) != 1) {
+        return false;
+    }
+    int dst = openat(dirfd, ".", O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+    if (dst < 0) {
+        return false;
+    }
+    bool cloned = ioctl(dst, FICLONE, src) == 0;
+    close(dst);
+    return cloned;
+#else
+    (void)dirfd;
+    (void)src;
+    return false;
+#endif
 }
+#endif
 
+std::shared_ptr<const TempDirInfo> TempFile::probe_dir(const std::string & dir) {
+    SaveError e;
+    std::shared_ptr<TempDirInfo> info = std::make_shared<TempDirInfo>();
+    info->path = dir;
 #if defined(_WIN32)
-HANDLE
+    ULARGE_INTEGER free_bytes, total_bytes;
+    if (GetDiskFreeSpaceExA(dir.c_str(), &free_bytes, nullptr, &total_bytes)) {
+        info->free_bytes = free_bytes.QuadPart;
+        info->total_bytes = total_bytes.QuadPart;
+    }
 #else
-int
+    info->dirfd = open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (info->dirfd < 0) {
+        info->error = errno;
+        return info;
+    }
+#if defined(__linux__)
+    struct statfs sf;
+    if (fstatfs(info->dirfd, &sf) == 0) {
+        info->filesystem = static_cast<uint64_t>(sf.f_type);
+        info->tmpfs = sf.f_type == TMPFS_MAGIC || sf.f_type == RAMFS_MAGIC;
+        info->block_size = sf.f_bsize;
+        info->free_bytes = static_cast<uint64_t>(sf.f_bavail) * sf.f_bsize;
+        info->total_bytes = static_cast<uint64_t>(sf.f_blocks) * sf.f_bsize;
+    }
+#if defined(O_TMPFILE)
+    int fd = openat(info->dirfd, ".", O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+    if (fd >= 0) {
+        info->anonymous_files = true;
+        info->reflink = probe_reflink(info->dirfd, fd);
+        close(fd);
+    }
 #endif
-TempFile::get_handle() const {
-    return this->data->fd;
+#else
+    struct statvfs sv;
+    if (fstatvfs(info->dirfd, &sv) == 0) {
+        info->block_size = sv.f_bsize;
+        info->free_bytes = static_cast<uint64_t>(sv.f_bavail) * sv.f_frsize;
+        info->total_bytes = static_cast<uint64_t>(sv.f_blocks) * sv.f_frsize;
+    }
+#endif
+#endif
+    return info;
 }
 
-TempFile & TempFile::reset() {
-    this->data->reset();
-    return *this;
+/* The directory TempDir resolves to, probed once. Readers load it without
+   taking the lock, invalidate_temp_dir only drops the reference so a file
+   being created in the old directory keeps it open until it is done.
+   Never destroyed, files may still be created during static destruction.  */
+struct TempDirCache {
+    std::mutex mutex;
+    std::shared_ptr<const TempDirInfo> info;
+
+    TempDirCache() {
+#if !defined(_WIN32)
+        pthread_atfork(&TempDirCache::before_fork, &TempDirCache::after_fork, &TempDirCache::after_fork);
+#endif
+    }
+
+    static TempDirCache & get() {
+        static TempDirCache * cache = new TempDirCache();
+        return *cache;
+    }
+
+    static void before_fork() {
+        get().mutex.lock();
+    }
+
+    static void after_fork() {
+        get().mutex.unlock();
+    }
+};
+
+std::shared_ptr<const TempDirInfo> TempFile::temp_dir_info() {
+    TempDirCache & cache = TempDirCache::get();
+    std::shared_ptr<const TempDirInfo> info = std::atomic_load(&cache.info);
+    if (info) {
+        return info;
+    }
+    // one thread probes, the others wait for it
+    std::lock_guard<std::mutex> lock(cache.mutex);
+    info = std::atomic_load(&cache.info);
+    if (!info) {
+        info = probe_dir(lookup_temp_dir());
+        std::atomic_store(&cache.info, info);
+    }
+    return info;
 }
 
-// FD
+void TempFile::invalidate_temp_dir() {
+    std::atomic_store(&TempDirCache::get().info, std::shared_ptr<const TempDirInfo>());
+}
 
-TempFileFD::CleanUp::CleanUp() {
-    fd = -1;
+std::string TempFile::TempDir() {
+    return temp_dir_info()->path;
 }
 
-bool TempFileFD::CleanUp::is_valid() const {
-    return fd >= 0 && path.length() != 0;
+#if !defined(_WIN32)
+// the default directory if DIR is it and it is open, never probes
+static std::shared_ptr<const TempDirInfo> cached_temp_dir(const std::string & dir) {
+    std::shared_ptr<const TempDirInfo> info = std::atomic_load(&TempDirCache::get().info);
+    if (info && info->dirfd >= 0 && info->path == dir) {
+        return info;
+    }
+    return nullptr;
 }
+#endif
 
-void TempFileFD::CleanUp::detach() {
-    detached = true;
+// dir set
+
+static uint64_t steady_ns() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
 }
 
-void TempFileFD::CleanUp::reset_fd() {
-    if (fd >= 0) {
-        SaveError e;
+TempDirSet::TempDirSet(const std::vector<std::string> & dirs)
+    : TempDirSet(dirs, TEMP_DIR_SET_ROUND_ROBIN) {}
+
+TempDirSet::TempDirSet(const std::vector<std::string> & dirs, int policy)
+    : TempDirSet(dirs, policy, 1000) {}
+
+TempDirSet::TempDirSet(const std::vector<std::string> & dirs, int policy, uint64_t refresh_interval_ms)
+    : policy(policy), refresh_interval_ns(refresh_interval_ms * 1000000)
+{
+    size_t count = std::min<size_t>(dirs.size(), UINT16_MAX);
+    for (size_t i = 0; i < count; i++) {
+        // an empty dir is the implementation specific directory, as for construct
+        this->dirs.push_back(dirs[i].length() == 0 ? TempFile::temp_dir_info() : TempFile::probe_dir(dirs[i]));
 #if defined(_WIN32)
-        if (!detached) _close(fd);
+        usable.push_back(static_cast<uint16_t>(i));
 #else
-        if (!detached) close(fd);
+        if (this->dirs.back()->dirfd >= 0) usable.push_back(static_cast<uint16_t>(i));
 #endif
     }
-    fd = -1;
+    if (this->dirs.size() == 0) {
+        this->dirs.push_back(TempFile::temp_dir_info());
+    }
+    if (usable.size() == 0) {
+        // nothing could be opened, let construct report why
+        for (size_t i = 0; i < this->dirs.size(); i++) usable.push_back(static_cast<uint16_t>(i));
+    }
+    free_bytes_.reset(new std::atomic<uint64_t>[this->dirs.size()]());
+    used_bytes_.reset(new std::atomic<uint64_t>[this->dirs.size()]());
+    refresh();
 }
 
-void TempFileFD::CleanUp::reset_path() {
-    if (!fatal_path && path.length() != 0) {
-        SaveError e;
-        if (log_create_close) {
-            if (detached) {
-                std::cout << "detaching temporary file: " << path << std::endl;
-            } else {
-                std::cout << "deleting temporary file: " << path << std::endl;
-            }
+/* Fills the table from the space of the usable directories, must be called
+   with mutex held. Least used puts every slot on one directory, most free
+   spreads the slots in proportion to the free space with a smooth weighted
+   round robin, so a directory with twice the space gets every other file
+   rather than the next 43 in a row.  */
+void TempDirSet::rebuild() {
+    if (policy == TEMP_DIR_SET_LEAST_USED) {
+        uint16_t least = usable[0];
+        for (uint16_t i : usable) {
+            if (used_bytes_[i].load(std::memory_order_relaxed) < used_bytes_[least].load(std::memory_order_relaxed)) least = i;
+        }
+        for (size_t slot = 0; slot < slots; slot++) table[slot].store(least, std::memory_order_relaxed);
+        return;
+    }
+
+    // weights in MiB so the running sums cannot overflow, a full directory still gets a slot now and then
+    std::vector<int64_t> weight(usable.size()), current(usable.size(), 0);
+    int64_t total = 0;
+    for (size_t u = 0; u < usable.size(); u++) {
+        weight[u] = policy == TEMP_DIR_SET_MOST_FREE ? static_cast<int64_t>(free_bytes_[usable[u]].load(std::memory_order_relaxed) >> 20) + 1 : 1;
+        total += weight[u];
+    }
+    for (size_t slot = 0; slot < slots; slot++) {
+        size_t best = 0;
+        for (size_t u = 0; u < usable.size(); u++) {
+            current[u] += weight[u];
+            if (current[u] > current[best]) best = u;
         }
+        current[best] -= total;
+        table[slot].store(usable[best], std::memory_order_relaxed);
+    }
+}
+
+void TempDirSet::refresh() {
+    std::lock_guard<std::mutex> lock(mutex);
+    refresh_locked();
+}
+
+void TempDirSet::refresh_locked() {
+    for (uint16_t i : usable) {
+        const TempDirInfo & info = *dirs[i];
 #if defined(_WIN32)
-        if (!detached) DeleteFile(path.c_str());
+        ULARGE_INTEGER free_bytes, total_bytes;
+        if (GetDiskFreeSpaceExA(info.path.c_str(), &free_bytes, nullptr, &total_bytes)) {
+            free_bytes_[i].store(free_bytes.QuadPart, std::memory_order_relaxed);
+            used_bytes_[i].store(total_bytes.QuadPart - free_bytes.QuadPart, std::memory_order_relaxed);
+        }
 #else
-        if (!detached) unlink(path.c_str());
+        SaveError e;
+        struct statvfs sv;
+        if (info.dirfd >= 0 && fstatvfs(info.dirfd, &sv) == 0) {
+            free_bytes_[i].store(static_cast<uint64_t>(sv.f_bavail) * sv.f_frsize, std::memory_order_relaxed);
+            used_bytes_[i].store(static_cast<uint64_t>(sv.f_blocks - sv.f_bfree) * sv.f_frsize, std::memory_order_relaxed);
+        }
 #endif
     }
-    path = {};
+    rebuild();
+    refreshed_at.store(steady_ns(), std::memory_order_release);
 }
 
-void TempFileFD::CleanUp::reset() {
-    reset_fd();
-    reset_path();
-    detached = false;
+const std::string & TempDirSet::pick() {
+    if (policy == TEMP_DIR_SET_ROUND_ROBIN) {
+        return dirs[usable[next.fetch_add(1, std::memory_order_relaxed) % usable.size()]]->path;
+    }
+    // the first thread to notice the table is stale rebuilds it, the others carry on with the old one
+    if (steady_ns() - refreshed_at.load(std::memory_order_acquire) >= refresh_interval_ns && mutex.try_lock()) {
+        std::lock_guard<std::mutex> lock(mutex, std::adopt_lock);
+        if (steady_ns() - refreshed_at.load(std::memory_order_acquire) >= refresh_interval_ns) {
+            refresh_locked();
+        }
+    }
+    return dirs[table[next.fetch_add(1, std::memory_order_relaxed) % slots].load(std::memory_order_relaxed)]->path;
 }
 
-TempFileFD::CleanUp::~CleanUp() {
-    reset();
+size_t TempDirSet::size() const {
+    return dirs.size();
 }
 
-TempFileFD::TempFileFD() {
-    data = std::make_shared<CleanUp>();
+const TempDirInfo & TempDirSet::dir(size_t index) const {
+    return *dirs[index];
 }
 
-TempFileFD::TempFileFD(const std::string & dir, const std::string & template_prefix) {
-    data = std::make_shared<CleanUp>();
-    construct(dir, template_prefix);
+uint64_t TempDirSet::free_bytes(size_t index) const {
+    return free_bytes_[index].load(std::memory_order_relaxed);
 }
 
-TempFileFD::TempFileFD(const std::string & dir, const std::string & template_prefix, bool log_create_close) {
-    data = std::make_shared<CleanUp>();
-    construct(dir, template_prefix, log_create_close);
+uint64_t TempDirSet::used_bytes(size_t index) const {
+    return used_bytes_[index].load(std::memory_order_relaxed);
 }
 
-TempFileFD::TempFileFD(const std::string & dir, const std::string & template_prefix, const std::string & template_suffix) {
-    data = std::make_shared<CleanUp>();
+// io_uring
+
+// the result of an operation that was never completed by the ring
+#define URING_NOT_RUN INT_MIN
+// the result of an operation the ring took but never completed, it may still run and is never redone
+#define URING_TAKEN (INT_MIN + 1)
+
+#if defined(TMPFILE_IO_URING) && defined(__linux__)
+#define TMPFILE_HAVE_IO_URING
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+
+/* A minimal io_uring submission/completion ring driven with raw syscalls.
+   Used to batch the openat, close and unlinkat calls of many files into a
+   few io_uring_enter calls. A ring belongs to a single thread.  */
+struct Uring {
+    static const unsigned ring_entries = 128;
+
+    int fd = -1;
+    unsigned entries = 0;
+    // operations were left in flight, the ring and the buffers they use are never freed
+    bool abandoned = false;
+
+    unsigned * sq_head = nullptr;
+    unsigned * sq_tail = nullptr;
+    unsigned * sq_mask = nullptr;
+    unsigned * sq_array = nullptr;
+    io_uring_sqe * sqes = nullptr;
+
+    unsigned * cq_head = nullptr;
+    unsigned * cq_tail = nullptr;
+    unsigned * cq_mask = nullptr;
+    io_uring_cqe * cqes = nullptr;
+
+    void * sq_ring = MAP_FAILED;
+    size_t sq_ring_size = 0;
+    void * cq_ring = MAP_FAILED;
+    size_t cq_ring_size = 0;
+    void * sqes_map = MAP_FAILED;
+    size_t sqes_size = 0;
+
+    bool init(unsigned requested_entries) {
+        io_uring_params params;
+        memset(&params, 0, sizeof(params));
+        fd = static_cast<int>(syscall(__NR_io_uring_setup, requested_entries, &params));
+        if (fd < 0) {
+            return false;
+        }
+        entries = params.sq_entries;
+
+        sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+        cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+        bool single_mmap = (params.features & IORING_FEAT_SINGLE_MMAP) == IORING_FEAT_SINGLE_MMAP;
+        if (single_mmap) {
+            sq_ring_size = cq_ring_size = sq_ring_size > cq_ring_size ? sq_ring_size : cq_ring_size;
+        }
+
+        sq_ring = mmap(nullptr, sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+        if (sq_ring == MAP_FAILED) {
+            return false;
+        }
+        if (single_mmap) {
+            cq_ring = sq_ring;
+        } else {
+            cq_ring = mmap(nullptr, cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+            if (cq_ring == MAP_FAILED) {
+                return false;
+            }
+        }
+        sqes_size = params.sq_entries * sizeof(io_uring_sqe);
+        sqes_map = mmap(nullptr, sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+        if (sqes_map == MAP_FAILED) {
+            return false;
+        }
+
+        char * sq = static_cast<char*>(sq_ring);
+        sq_head = reinterpret_cast<unsigned*>(sq + params.sq_off.head);
+        sq_tail = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+        sq_mask = reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+        sq_array = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+        sqes = static_cast<io_uring_sqe*>(sqes_map);
+
+        char * cq = static_cast<char*>(cq_ring);
+        cq_head = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+        cq_tail = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+        cq_mask = reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+        cqes = reinterpret_cast<io_uring_cqe*>(cq + params.cq_off.cqes);
+        return true;
+    }
+
+    ~Uring() {
+        if (sqes_map != MAP_FAILED) munmap(sqes_map, sqes_size);
+        if (cq_ring != MAP_FAILED && cq_ring != sq_ring) munmap(cq_ring, cq_ring_size);
+        if (sq_ring != MAP_FAILED) munmap(sq_ring, sq_ring_size);
+        if (fd >= 0) close(fd);
+    }
+
+    /* Run COUNT operations, PREP(sqe, i) prepares operation i.
+       RESULTS receives the result of each operation, a negative errno on failure.
+       Returns false if the ring itself failed, the results of operations that
+       were never taken are left untouched. Operations the kernel took before
+       it failed are still waited for, those that never complete are left as
+       URING_TAKEN and the ring is abandoned.  */
+    template <typename Prep>
+    bool run(size_t count, Prep prep, int * results) {
+        size_t next = 0;
+        while (next < count) {
+            unsigned tail = *sq_tail;
+            unsigned head = __atomic_load_n(sq_head, __ATOMIC_ACQUIRE);
+            unsigned n = 0;
+            while (next < count && (tail + n) - head < entries) {
+                unsigned index = (tail + n) & *sq_mask;
+                io_uring_sqe * sqe = &sqes[index];
+                memset(sqe, 0, sizeof(*sqe));
+                prep(sqe, next);
+                sqe->user_data = next;
+                sq_array[index] = index;
+                n++;
+                next++;
+            }
+            __atomic_store_n(sq_tail, tail + n, __ATOMIC_RELEASE);
+
+            unsigned completed = 0;
+            unsigned to_submit = n;
+            while (completed < n) {
+                int ret = static_cast<int>(syscall(__NR_io_uring_enter, fd, to_submit, n - completed, IORING_ENTER_GETEVENTS, nullptr, 0));
+                if (ret < 0) {
+                    if (errno == EINTR) {
+                        continue;
+                    }
+                    SaveError error;
+                    // what the kernel did not take never runs, what it took may have opened files already
+                    unsigned taken = n - ((tail + n) - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE));
+                    __atomic_store_n(sq_tail, tail + taken, __ATOMIC_RELEASE);
+                    for (size_t i = next - n; i < next - n + taken; i++) {
+                        if (results[i] == URING_NOT_RUN) results[i] = URING_TAKEN;
+                    }
+                    abandoned = !drain(taken, completed, results);
+                    return false;
+                }
+                to_submit -= std::min<unsigned>(to_submit, ret);
+                completed += reap(results);
+            }
+        }
+        return true;
+    }
+
+    // moves every completion that arrived to RESULTS, returns how many there were
+    unsigned reap(int * results) {
+        unsigned cq_h = *cq_head;
+        unsigned cq_t = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+        unsigned reaped = 0;
+        while (cq_h != cq_t) {
+            io_uring_cqe * cqe = &cqes[cq_h & *cq_mask];
+            results[cqe->user_data] = cqe->res;
+            cq_h++;
+            reaped++;
+        }
+        __atomic_store_n(cq_head, cq_h, __ATOMIC_RELEASE);
+        return reaped;
+    }
+
+    /* Waits for the TAKEN operations of a batch whose io_uring_enter failed,
+       COMPLETED of them were already reaped. Completions of work the kernel
+       handed to its own threads arrive without io_uring_enter, so the queue is
+       polled if waiting keeps failing, for a bounded time.
+       Returns false if some of them are still in flight.  */
+    bool drain(unsigned taken, unsigned completed, int * results) {
+        completed += reap(results);
+        for (unsigned attempt = 0; completed < taken && attempt < 100000; attempt++) {
+            int ret = static_cast<int>(syscall(__NR_io_uring_enter, fd, 0, taken - completed, IORING_ENTER_GETEVENTS, nullptr, 0));
+            if (ret < 0 && errno != EINTR) {
+                std::this_thread::yield();
+            }
+            completed += reap(results);
+        }
+        return completed >= taken;
+    }
+};
+
+static std::atomic<unsigned int> uring_fork_generation {0};
+
+static void uring_after_fork() {
+    uring_fork_generation.fetch_add(1, std::memory_order_relaxed);
+}
+
+// IORING_OP_UNLINKAT needs linux 5.11, older kernels keep using plain syscalls
+static bool uring_probe() {
+    SaveError error;
+    Uring ring;
+    if (!ring.init(2)) {
+        return false;
+    }
+    const unsigned ops = 256;
+    std::vector<char> buf(sizeof(io_uring_probe) + ops * sizeof(io_uring_probe_op), 0);
+    io_uring_probe * probe = reinterpret_cast<io_uring_probe*>(buf.data());
+    if (syscall(__NR_io_uring_register, ring.fd, IORING_REGISTER_PROBE, probe, ops) < 0) {
+        return false;
+    }
+    auto supported = [probe](int op) {
+        return op <= probe->last_op && (probe->ops[op].flags & IO_URING_OP_SUPPORTED) == IO_URING_OP_SUPPORTED;
+    };
+    if (!supported(IORING_OP_OPENAT) || !supported(IORING_OP_CLOSE) || !supported(IORING_OP_UNLINKAT)) {
+        return false;
+    }
+    pthread_atfork(nullptr, nullptr, uring_after_fork);
+    return true;
+}
+
+struct UringHolder {
+    std::unique_ptr<Uring> ring;
+    bool failed = false;
+    unsigned int generation = 0;
+};
+
+static UringHolder & uring_holder() {
+    static thread_local UringHolder holder;
+    return holder;
+}
+
+/* The ring of the calling thread, or nullptr if io_uring cannot be used.  */
+static Uring * uring() {
+    static bool supported = uring_probe();
+    if (!supported) {
+        return nullptr;
+    }
+    UringHolder & holder = uring_holder();
+    unsigned int generation = uring_fork_generation.load(std::memory_order_relaxed);
+    if (holder.generation != generation) {
+        // the ring is shared with the parent, never submit to it from a child
+        holder.ring.reset();
+        holder.failed = false;
+        holder.generation = generation;
+    }
+    if (!holder.ring && !holder.failed) {
+        SaveError error;
+        holder.ring.reset(new Uring());
+        if (!holder.ring->init(Uring::ring_entries)) {
+            holder.ring.reset();
+            holder.failed = true;
+        }
+    }
+    return holder.ring.get();
+}
+
+// stop using the ring of the calling thread after it failed
+static void uring_failed() {
+    UringHolder & holder = uring_holder();
+    if (holder.ring && holder.ring->abandoned) {
+        // the kernel may still write to its memory, unmapping it or reusing the fd is worse than the leak
+        holder.ring.release();
+    }
+    holder.ring.reset();
+    holder.failed = true;
+}
+
+/* Operations left in flight by an abandoned ring may still read BUFFERS,
+   they are handed over to it and never freed, copies are left in place.  */
+static void uring_abandon(std::vector<std::string> & buffers) {
+    std::vector<std::string> * in_flight = new std::vector<std::string>(std::move(buffers));
+    buffers = *in_flight;
+}
+#endif
+
+// deferred cleanup
+
+#if !defined(_WIN32)
+/* Closes and unlinks files on behalf of CleanUp::reset so the thread that
+   destroys the last handle does not wait on the filesystem.
+   Entries go through a bounded lock-free queue (Vyukov's bounded MPMC queue)
+   and are drained in batches by a single reaper thread, if the queue is full
+   the caller cleans up itself.  */
+struct Reaper {
+    struct Entry {
+        int fd = -1;
+        FILE * file = nullptr;
+        TempFilePath path;
+        bool anonymous = false;
+        bool log_create_close = false;
+    };
+
+    struct Slot {
+        std::atomic<size_t> sequence;
+        Entry entry;
+    };
+
+    static const size_t capacity = 4096;
+    static const size_t batch_size = 64;
+
+    Slot * slots;
+
+    std::atomic<size_t> enqueue_pos {0};
+    std::atomic<size_t> dequeue_pos {0};
+
+    std::atomic<uint64_t> pushed {0};
+    std::atomic<uint64_t> reaped {0};
+
+    std::mutex mutex;
+    std::condition_variable wake_cv;
+    std::condition_variable reaped_cv;
+    std::atomic<bool> sleeping {false};
+    std::atomic<bool> running {false};
+    bool stop = false;
+
+    // not a std::thread member, a forked child has to be able to forget it
+    std::thread * thread = nullptr;
+
+    Reaper() {
+        slots = new Slot[capacity];
+        reset_queue();
+        pthread_atfork(&Reaper::before_fork, &Reaper::after_fork_parent, &Reaper::after_fork_child);
+        atexit(&Reaper::shutdown);
+    }
+
+    void reset_queue() {
+        for (size_t i = 0; i < capacity; i++) {
+            slots[i].sequence.store(i, std::memory_order_relaxed);
+            slots[i].entry = {};
+        }
+        enqueue_pos.store(0, std::memory_order_relaxed);
+        dequeue_pos.store(0, std::memory_order_relaxed);
+        pushed.store(0, std::memory_order_relaxed);
+        reaped.store(0, std::memory_order_relaxed);
+    }
+
+    bool push(Entry & entry) {
+        if (!running.load(std::memory_order_acquire) && !start()) {
+            return false;
+        }
+        size_t pos = enqueue_pos.load(std::memory_order_relaxed);
+        Slot * slot;
+        while (true) {
+            slot = &slots[pos & (capacity - 1)];
+            size_t sequence = slot->sequence.load(std::memory_order_acquire);
+            intptr_t diff = static_cast<intptr_t>(sequence) - static_cast<intptr_t>(pos);
+            if (diff == 0) {
+                if (enqueue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    break;
+                }
+            } else if (diff < 0) {
+                // full
+                return false;
+            } else {
+                pos = enqueue_pos.load(std::memory_order_relaxed);
+            }
+        }
+        slot->entry = std::move(entry);
+        slot->sequence.store(pos + 1, std::memory_order_release);
+        uint64_t depth = pushed.fetch_add(1, std::memory_order_seq_cst) + 1 - reaped.load(std::memory_order_relaxed);
+        // waking the reaper costs a futex call per push, below a batch it picks the entries up within its timed wait
+        if (depth >= batch_size && sleeping.load(std::memory_order_seq_cst)) {
+            wake_cv.notify_one();
+        }
+        return true;
+    }
+
+    bool pop(Entry & entry) {
+        size_t pos = dequeue_pos.load(std::memory_order_relaxed);
+        Slot * slot;
+        while (true) {
+            slot = &slots[pos & (capacity - 1)];
+            size_t sequence = slot->sequence.load(std::memory_order_acquire);
+            intptr_t diff = static_cast<intptr_t>(sequence) - static_cast<intptr_t>(pos + 1);
+            if (diff == 0) {
+                if (dequeue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    break;
+                }
+            } else if (diff < 0) {
+                // empty
+                return false;
+            } else {
+                pos = dequeue_pos.load(std::memory_order_relaxed);
+            }
+        }
+        entry = std::move(slot->entry);
+        slot->sequence.store(pos + capacity, std::memory_order_release);
+        return true;
+    }
+
+    bool start() {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (stop) {
+            // the process is exiting, clean up synchronously
+            return false;
+        }
+        if (!running.load(std::memory_order_relaxed)) {
+            thread = new std::thread(&Reaper::run, this);
+            running.store(true, std::memory_order_release);
+        }
+        return true;
+    }
+
+    static void reap(Entry & entry) {
+        SaveError e;
+        if (entry.file != nullptr) fclose(entry.file);
+        if (entry.fd >= 0) close(entry.fd);
+        if (entry.path.length() != 0) {
+            if (entry.log_create_close) {
+                if (entry.anonymous) {
+                    log_event(TEMP_FILE_EVENT_RELEASED_ANONYMOUS, -1, entry.path);
+                } else {
+                    log_event(TEMP_FILE_EVENT_DELETED, -1, entry.path);
+                }
+            }
+            if (!entry.anonymous && unlink(PathString(entry.path).c_str) == 0) {
+                stat_add(STAT_UNLINKS);
+                prune_after_unlink(entry.path);
+            }
+        }
+    }
+
+    static void reap_batch(std::vector<Entry> & batch) {
+#if defined(TMPFILE_HAVE_IO_URING)
+        if (uring_reap_batch(batch)) {
+            return;
+        }
+#endif
+        for (Entry & e : batch) {
+            reap(e);
+        }
+    }
+
+#if defined(TMPFILE_HAVE_IO_URING)
+    // close and unlink the whole batch with a few io_uring_enter calls
+    static bool uring_reap_batch(std::vector<Entry> & batch) {
+        Uring * ring = uring();
+        if (ring == nullptr) {
+            return false;
+        }
+        SaveError e;
+
+        struct Op {
+            int fd;
+            const char * path;
+        };
+        std::vector<Op> ops;
+        ops.reserve(batch.size() * 2);
+        // the paths have to stay put until the ring is done with them
+        std::vector<std::string> paths(batch.size());
+
+        for (size_t i = 0; i < batch.size(); i++) {
+            Entry & entry = batch[i];
+            // a FILE has to be flushed from this process, fclose it here
+            if (entry.file != nullptr) fclose(entry.file);
+            if (entry.fd >= 0) ops.push_back({entry.fd, nullptr});
+            if (entry.path.length() != 0) {
+                if (entry.log_create_close) {
+                    if (entry.anonymous) {
+                        log_event(TEMP_FILE_EVENT_RELEASED_ANONYMOUS, -1, entry.path);
+                    } else {
+                        log_event(TEMP_FILE_EVENT_DELETED, -1, entry.path);
+                    }
+                }
+                if (!entry.anonymous) {
+                    paths[i] = entry.path.str();
+                    ops.push_back({-1, paths[i].c_str()});
+                }
+            }
+        }
+
+        std::vector<int> results(ops.size(), URING_NOT_RUN);
+        bool ok = ring->run(ops.size(), [&ops](io_uring_sqe * sqe, size_t i) {
+            if (ops[i].path != nullptr) {
+                sqe->opcode = IORING_OP_UNLINKAT;
+                sqe->fd = AT_FDCWD;
+                sqe->addr = reinterpret_cast<uintptr_t>(ops[i].path);
+            } else {
+                sqe->opcode = IORING_OP_CLOSE;
+                sqe->fd = ops[i].fd;
+            }
+        }, results.data());
+
+        if (!ok) {
+            if (ring->abandoned) uring_abandon(paths);
+            uring_failed();
+            // a close or unlink that was taken may still run, doing it again could close a reused descriptor
+            for (size_t i = 0; i < ops.size(); i++) {
+                if (results[i] != URING_NOT_RUN) continue;
+                if (ops[i].path != nullptr) results[i] = unlink(ops[i].path);
+                else close(ops[i].fd);
+            }
+        }
+        uint64_t unlinks = 0;
+        for (size_t i = 0; i < ops.size(); i++) {
+            if (ops[i].path != nullptr && results[i] == 0) unlinks++;
+        }
+        for (size_t i = 0; i < batch.size(); i++) {
+            if (paths[i].length() != 0) prune_after_unlink(batch[i].path);
+        }
+        stat_add(STAT_UNLINKS, unlinks);
+        return true;
+    }
+#endif
+
+    // returns the number of entries reaped
+    size_t drain(std::vector<Entry> & batch) {
+        size_t total = 0;
+        while (true) {
+            batch.clear();
+            Entry entry;
+            while (batch.size() < batch_size && pop(entry)) {
+                batch.push_back(std::move(entry));
+            }
+            if (batch.size() == 0) {
+                return total;
+            }
+            reap_batch(batch);
+            total += batch.size();
+            reaped.fetch_add(batch.size(), std::memory_order_release);
+            std::lock_guard<std::mutex> lock(mutex);
+            reaped_cv.notify_all();
+        }
+    }
+
+    void run() {
+        std::vector<Entry> batch;
+        batch.reserve(batch_size);
+        std::unique_lock<std::mutex> lock(mutex);
+        while (true) {
+            lock.unlock();
+            drain(batch);
+            lock.lock();
+            if (stop) {
+                break;
+            }
+            sleeping.store(true, std::memory_order_seq_cst);
+            // a push that raced with going to sleep is picked up by the timeout
+            if (pushed.load(std::memory_order_seq_cst) == reaped.load(std::memory_order_acquire)) {
+                wake_cv.wait_for(lock, std::chrono::milliseconds(10));
+            }
+            sleeping.store(false, std::memory_order_relaxed);
+        }
+        lock.unlock();
+        drain(batch);
+    }
+
+    void flush() {
+        uint64_t target = pushed.load(std::memory_order_acquire);
+        std::unique_lock<std::mutex> lock(mutex);
+        if (!running.load(std::memory_order_relaxed)) {
+            return;
+        }
+        wake_cv.notify_one();
+        reaped_cv.wait(lock, [&] { return reaped.load(std::memory_order_acquire) >= target; });
+    }
+
+    // the reaper is never destroyed, handles that are destroyed after exit clean up synchronously
+    static void shutdown() {
+        Reaper & reaper = get();
+        {
+            std::lock_guard<std::mutex> lock(reaper.mutex);
+            reaper.stop = true;
+        }
+        if (reaper.thread != nullptr) {
+            reaper.wake_cv.notify_one();
+            reaper.thread->join();
+            delete reaper.thread;
+            reaper.thread = nullptr;
+        }
+        reaper.running.store(false, std::memory_order_release);
+        // anything pushed while the thread was stopping
+        std::vector<Entry> batch;
+        reaper.drain(batch);
+    }
+
+    static Reaper & get();
+
+    static void before_fork() {
+        get().mutex.lock();
+    }
+
+    static void after_fork_parent() {
+        get().mutex.unlock();
+    }
+
+    static void after_fork_child() {
+        Reaper & reaper = get();
+        // the reaper thread does not exist in the child and the queued files belong to the parent
+        reaper.thread = nullptr;
+        reaper.running.store(false, std::memory_order_relaxed);
+        reaper.sleeping.store(false, std::memory_order_relaxed);
+        reaper.reset_queue();
+        reaper.mutex.unlock();
+    }
+};
+
+Reaper & Reaper::get() {
+    static Reaper * reaper = new Reaper();
+    return *reaper;
+}
+
+/* Queue FD or FILE and PATH to be cleaned up by the reaper thread.
+   On success PATH is moved from, otherwise nothing is changed and the caller
+   must clean up itself.  */
+static bool defer_cleanup(int fd, FILE * file, TempFilePath & path, bool unlink_path, bool anonymous, bool log_create_close) {
+    Reaper::Entry entry;
+    entry.fd = fd;
+    entry.file = file;
+    if (unlink_path) entry.path = std::move(path);
+    entry.anonymous = anonymous;
+    entry.log_create_close = log_create_close;
+    if (Reaper::get().push(entry)) {
+        return true;
+    }
+    if (unlink_path) path = std::move(entry.path);
+    return false;
+}
+#endif
+
+// fd cache
+
+#if !defined(_WIN32)
+/* The descriptor of a TEMP_FILE_CREATE_LAZY_FD file, owned by the FdCache.
+   While fd is open and the file is not pinned it is linked into the LRU
+   list of the cache, which closes it once too many are open. The offset
+   is kept across a close so the file reads on where it left off.  */
+struct TempFileLazyFd {
+    TempFileLazyFd * prev = nullptr;
+    TempFileLazyFd * next = nullptr;
+    int fd = -1;
+    uint32_t pins = 0;
+    off_t offset = 0;
+};
+
+/* Every TempFileLazyFd of the process. Only the list and counters are
+   touched under the lock, closing and reopening happen outside of it.
+   Never destroyed, files may still be cleaned up during static destruction.  */
+struct FdCache {
+    std::mutex mutex;
+
+    // most recently used first
+    TempFileLazyFd * head = nullptr;
+    TempFileLazyFd * tail = nullptr;
+
+    // open descriptors, pinned or not
+    size_t open = 0;
+    size_t limit;
+
+    FdCache() {
+        struct rlimit rl;
+        limit = 512;
+        if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur != RLIM_INFINITY) {
+            limit = std::max<size_t>(rl.rlim_cur / 2, 1);
+        }
+        pthread_atfork(&FdCache::before_fork, &FdCache::after_fork, &FdCache::after_fork);
+    }
+
+    static FdCache & get() {
+        static FdCache * cache = new FdCache();
+        return *cache;
+    }
+
+    static void before_fork() {
+        get().mutex.lock();
+    }
+
+    static void after_fork() {
+        get().mutex.unlock();
+    }
+
+    void link_front(TempFileLazyFd * entry) {
+        entry->prev = nullptr;
+        entry->next = head;
+        if (head != nullptr) head->prev = entry;
+        head = entry;
+        if (tail == nullptr) tail = entry;
+    }
+
+    void unlink(TempFileLazyFd * entry) {
+        if (entry->prev != nullptr) entry->prev->next = entry->next; else head = entry->next;
+        if (entry->next != nullptr) entry->next->prev = entry->prev; else tail = entry->prev;
+        entry->prev = nullptr;
+        entry->next = nullptr;
+    }
+
+    bool linked(TempFileLazyFd * entry) const {
+        return entry->prev != nullptr || head == entry;
+    }
+
+    // picks the least recently used descriptors to close until open + incoming is within the limit, must be called with mutex held
+    size_t evict(int * victims, size_t max, size_t incoming = 0) {
+        size_t n = 0;
+        while (open + incoming > limit && tail != nullptr && n < max) {
+            TempFileLazyFd * entry = tail;
+            unlink(entry);
+            entry->offset = lseek(entry->fd, 0, SEEK_CUR);
+            victims[n++] = entry->fd;
+            entry->fd = -1;
+            open--;
+        }
+        return n;
+    }
+
+    static void close_victims(const int * victims, size_t n) {
+        if (n == 0) return;
+        SaveError e;
+        for (size_t i = 0; i < n; i++) {
+            close(victims[i]);
+        }
+        stat_add(STAT_FD_EVICTIONS, n);
+    }
+
+    // makes room for a descriptor that is about to be opened, so the cache never holds more than the limit
+    void make_room() {
+        int victims[16];
+        size_t n;
+        do {
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                n = evict(victims, 16, 1);
+            }
+            close_victims(victims, n);
+        } while (n == 16);
+    }
+
+    TempFileLazyFd * adopt(int fd) {
+        TempFileLazyFd * entry = new TempFileLazyFd();
+        entry->fd = fd;
+        make_room();
+        std::lock_guard<std::mutex> lock(mutex);
+        link_front(entry);
+        open++;
+        return entry;
+    }
+
+    // the open descriptor of entry, reopened from path if it was closed, -1 with errno set on failure
+    int acquire(TempFileLazyFd * entry, const TempFilePath & path, bool pin) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (entry->fd >= 0) {
+                if (linked(entry)) unlink(entry);
+                if (pin) {
+                    entry->pins++;
+                } else if (entry->pins == 0) {
+                    link_front(entry);
+                }
+                return entry->fd;
+            }
+        }
+
+        make_room();
+        int fd = open_path(path);
+        if (fd < 0) {
+            return -1;
+        }
+
+        std::unique_lock<std::mutex> lock(mutex);
+        if (entry->fd >= 0) {
+            // another copy of the handle reopened it first
+            lock.unlock();
+            SaveError e;
+            close(fd);
+            return acquire(entry, path, pin);
+        }
+        lseek(fd, entry->offset, SEEK_SET);
+        entry->fd = fd;
+        open++;
+        if (pin) {
+            entry->pins++;
+        } else if (entry->pins == 0) {
+            link_front(entry);
+        }
+        lock.unlock();
+        stat_add(STAT_FD_REOPENS);
+        return fd;
+    }
+
+    static int open_path(const TempFilePath & path) {
+        PathString p(path);
+        return ::open(p.c_str, O_RDWR | O_CLOEXEC);
+    }
+
+    void unpin(TempFileLazyFd * entry) {
+        int victims[16];
+        size_t n = 0;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (entry->pins == 0) return;
+            if (--entry->pins == 0 && entry->fd >= 0) {
+                link_front(entry);
+                n = evict(victims, 16);
+            }
+        }
+        close_victims(victims, n);
+    }
+
+    // gives the descriptor back to the handle and forgets entry, returns -1 if it was closed
+    int release(TempFileLazyFd * entry) {
+        int fd;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (linked(entry)) unlink(entry);
+            fd = entry->fd;
+            if (fd >= 0) open--;
+        }
+        delete entry;
+        return fd;
+    }
+
+    // takes the descriptor out of the cache for good, reopened from path if it was closed
+    int take(TempFileLazyFd * entry, const TempFilePath & path) {
+        acquire(entry, path, true);
+        return release(entry);
+    }
+
+    void set_limit(size_t limit) {
+        int victims[16];
+        size_t n;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            this->limit = std::max<size_t>(limit, 1);
+        }
+        do {
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                n = evict(victims, 16);
+            }
+            close_victims(victims, n);
+        } while (n == 16);
+    }
+};
+#endif
+
+void TempFile::set_fd_cache_limit(size_t limit) {
+#if !defined(_WIN32)
+    FdCache::get().set_limit(limit);
+#endif
+}
+
+size_t TempFile::fd_cache_limit() {
+#if !defined(_WIN32)
+    FdCache & cache = FdCache::get();
+    std::lock_guard<std::mutex> lock(cache.mutex);
+    return cache.limit;
+#else
+    return 0;
+#endif
+}
+
+/* What a TEMP_FILE_CREATE_ON_FIRST_USE handle needs to create its file,
+   freed once the file is created or the handle is reset.  */
+struct TempFilePending {
+    std::string dir;
+    std::string template_prefix;
+    std::string template_suffix;
+    int create_flags = 0;
+    // what construct was asked to preallocate, done once the file exists
+    uint64_t preallocate_size = 0;
+    int preallocate_flags = 0;
+};
+
+#if !defined(_WIN32)
+static bool preallocate_file(int fd, uint64_t size, int preallocate_flags);
+#endif
+
+/* Keeps the preallocation of a file created on first use in its pending
+   state, returns false if DATA is not waiting to be created.  */
+template <typename CleanUp>
+static bool defer_preallocate(CleanUp & data, uint64_t size, int preallocate_flags) {
+    TempFilePending * pending = data.pending.load(std::memory_order_acquire);
+    if (pending == nullptr) {
+        return false;
+    }
+    pending->preallocate_size = size;
+    pending->preallocate_flags = preallocate_flags;
+    return true;
+}
+
+// held by pending while one copy of a handle creates its file, the other copies wait for it to be replaced
+static TempFilePending * claimed_pending() {
+    static TempFilePending * claimed = new TempFilePending();
+    return claimed;
+}
+
+TempFile::CleanUp::CleanUp() {
+#if defined(_WIN32)
+    fd = INVALID_HANDLE_VALUE;
+#else
+    fd = -1;
+#endif
+}
+
+bool TempFile::CleanUp::is_valid() const {
+    // a file that is still to be created counts as valid
+    return
+#if defined(_WIN32)
+    (fd != INVALID_HANDLE_VALUE || pending.load(std::memory_order_acquire) != nullptr)
+#else
+    (fd >= 0 || lazy != nullptr || pending.load(std::memory_order_acquire) != nullptr)
+#endif
+    && path.length() != 0;
+}
+
+void TempFile::CleanUp::detach() {
+    detached = true;
+}
+
+void TempFile::CleanUp::reset_fd() {
+#if !defined(_WIN32)
+    if (lazy != nullptr) {
+        fd = FdCache::get().release(lazy);
+        lazy = nullptr;
+    }
+#endif
+#if defined(_WIN32)
+    if (fd != INVALID_HANDLE_VALUE) {
+        SaveError e;
+        if (!detached) CloseHandle(fd);
+    }
+    fd = INVALID_HANDLE_VALUE;
+#else
+    if (fd >= 0) {
+        SaveError e;
+        if (!detached) close(fd);
+    }
+    fd = -1;
+#endif
+}
+
+void TempFile::CleanUp::reset_path() {
+    if (!fatal_path && path.length() != 0) {
+        SaveError e;
+        if (log_create_close) {
+            if (detached) {
+                log_event(TEMP_FILE_EVENT_DETACHED, -1, path);
+            } else if (anonymous) {
+                log_event(TEMP_FILE_EVENT_RELEASED_ANONYMOUS, -1, path);
+            } else {
+                log_event(TEMP_FILE_EVENT_DELETED, -1, path);
+            }
+        }
+#if defined(_WIN32)
+        if (!detached && DeleteFile(PathString(path).c_str)) stat_add(STAT_UNLINKS);
+#else
+        // an anonymous file has no name, closing it was enough
+        if (!detached && !anonymous && unlink(PathString(path).c_str) == 0) {
+            stat_add(STAT_UNLINKS);
+            prune_after_unlink(path);
+        }
+#endif
+    }
+    path.clear();
+}
+
+void TempFile::CleanUp::reset() {
+    // nothing was created, the reserved name is just forgotten
+    if (TempFilePending * p = pending.exchange(nullptr, std::memory_order_acq_rel)) {
+        if (p != claimed_pending()) delete p;
+        path.clear();
+        detached = false;
+        return;
+    }
+    // only the cleanup of a file that is still ours is timed
+    bool timed = !detached && is_valid();
+    std::chrono::steady_clock::time_point start;
+    if (timed) start = std::chrono::steady_clock::now();
+#if !defined(_WIN32)
+    // a lazy file may have no descriptor open, its path is still deferred
+    if (deferred_cleanup && timed) {
+        if (lazy != nullptr) {
+            fd = FdCache::get().release(lazy);
+            lazy = nullptr;
+        }
+        if (defer_cleanup(fd, nullptr, path, !fatal_path, anonymous, log_create_close)) {
+            fd = -1;
+            path.clear();
+        }
+    }
+#endif
+    reset_fd();
+    reset_path();
+    detached = false;
+    anonymous = false;
+    memfd = false;
+    template_suffix_length = 0;
+    if (timed) stat_cleanup_latency(elapsed_ns(start));
+}
+
+TempFile::CleanUp::~CleanUp() {
+    reset();
+}
+
+void TempFile::CleanUp::swap(CleanUp & other) {
+    path.swap(other.path);
+    std::swap(fatal_path, other.fatal_path);
+    std::swap(detached, other.detached);
+    std::swap(log_create_close, other.log_create_close);
+    std::swap(anonymous, other.anonymous);
+    std::swap(memfd, other.memfd);
+    std::swap(deferred_cleanup, other.deferred_cleanup);
+    std::swap(template_suffix_length, other.template_suffix_length);
+    std::swap(fd, other.fd);
+    std::swap(lazy, other.lazy);
+    TempFilePending * p = pending.load(std::memory_order_relaxed);
+    pending.store(other.pending.load(std::memory_order_relaxed), std::memory_order_relaxed);
+    other.pending.store(p, std::memory_order_relaxed);
+}
+
+void * TempFile::allocate_cleanup() {
+    static const size_t size = std::max({sizeof(TempFile::CleanUp), sizeof(TempFileFD::CleanUp), sizeof(TempFileFILE::CleanUp)});
+    return ::operator new(size);
+}
+
+void TempFile::deallocate_cleanup(void * storage) {
+    ::operator delete(storage);
+}
+
+TempFile::CleanUp * TempFile::CleanUp::create() {
+    return new (TempFile::allocate_cleanup()) CleanUp();
+}
+
+void TempFile::CleanUp::destroy(CleanUp * data) {
+    data->~CleanUp();
+    TempFile::deallocate_cleanup(data);
+}
+
+#include <chrono> // epoch
+#include <stdint.h> // uint64_t
+
+/*
+ * Write `n` bytes of high quality random bytes to `buf`
+ */
+extern "C" int randombytes(void* buf, size_t n);
+
+/* These are the characters used in temporary filenames.  */
+static const char letters[] =
+"abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789";
+#define NUM_LETTERS (62)
+
+// per-thread name generator
+
+/* wyrand, a Weyl sequence counter passed through a multiply-fold mixer.
+   every thread owns its own state so generating a name never takes a lock,
+   the state is seeded once per thread from randombytes.  */
+struct NameGenerator {
+    uint64_t state = 0;
+    // the fork generation the state was seeded in, a child must not repeat the names of its parent
+    unsigned int generation = 0;
+    bool seeded = false;
+
+    // the parts of a deterministic name, see generate_unique_name
+    uint64_t boot = 0;
+    uint64_t pid = 0;
+    uint64_t thread = 0;
+    uint64_t counter = 0;
+
+    uint64_t next() {
+        state += 0xa0761d6478bd642full;
+#if defined(__SIZEOF_INT128__)
+        __uint128_t m = static_cast<__uint128_t>(state) * (state ^ 0xe7037ed1a0b428dbull);
+        return static_cast<uint64_t>(m >> 64) ^ static_cast<uint64_t>(m);
+#else
+        uint64_t z = state;
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+        return z ^ (z >> 31);
+#endif
+    }
+};
+
+static std::atomic<unsigned int> fork_generation {0};
+
+#if !defined(_WIN32)
+static void name_generator_after_fork() {
+    fork_generation.fetch_add(1, std::memory_order_relaxed);
+}
+#endif
+
+static uint64_t name_generator_seed(const NameGenerator & generator) {
+    uint64_t seed = 0;
+    if (randombytes(&seed, sizeof(seed)) != 0 || seed == 0) {
+        // no entropy available, mix in whatever differs between threads and processes
+        seed ^= static_cast<uint64_t>(std::chrono::high_resolution_clock::now().time_since_epoch().count());
+        seed ^= static_cast<uint64_t>(reinterpret_cast<uintptr_t>(&generator)) << 16;
+    }
+    return seed;
+}
+
+/* The boot id tells apart processes that got the same pid in different boots,
+   which matters for files that outlive their process.  */
+static uint64_t read_boot_id() {
+    uint64_t hash = 0xcbf29ce484222325ull; // FNV-1a
+    bool found = false;
+#if defined(__linux__)
+    int fd = open("/proc/sys/kernel/random/boot_id", O_RDONLY);
+    if (fd >= 0) {
+        char buf[64];
+        ssize_t n = read(fd, buf, sizeof(buf));
+        for (ssize_t i = 0; i < n; i++) {
+            hash = (hash ^ static_cast<unsigned char>(buf[i])) * 0x100000001b3ull;
+        }
+        found = n > 0;
+        close(fd);
+    }
+#endif
+    if (!found) {
+        randombytes(&hash, sizeof(hash));
+    }
+    return hash;
+}
+
+static uint64_t boot_id() {
+    static uint64_t id = read_boot_id();
+    return id;
+}
+
+static std::atomic<uint64_t> thread_sequence {0};
+
+static inline NameGenerator & name_generator() {
+    static thread_local NameGenerator generator;
+    unsigned int generation = fork_generation.load(std::memory_order_relaxed);
+    if (!generator.seeded || generator.generation != generation) {
+        SaveError error;
+#if !defined(_WIN32)
+        static bool registered = pthread_atfork(nullptr, nullptr, name_generator_after_fork) == 0;
+        (void) registered;
+#endif
+        generator.state = name_generator_seed(generator);
+        generator.generation = generation;
+        generator.seeded = true;
+        generator.boot = boot_id();
+#if defined(_WIN32)
+        generator.pid = static_cast<uint64_t>(GetCurrentProcessId());
+#else
+        generator.pid = static_cast<uint64_t>(getpid());
+#endif
+        // thread ids are reused once a thread exits, a sequence number is not
+        if (generator.thread == 0) {
+            generator.thread = thread_sequence.fetch_add(1, std::memory_order_relaxed) + 1;
+        }
+    }
+    return generator;
+}
+
+/* Replace the 6 characters at XXXXXX with random letters, 62^6 names are
+   drawn from a single 64 bit value.  */
+static inline void generate_name(char * XXXXXX) {
+    uint64_t v = name_generator().next();
+    for (int i = 0; i < 6; i++) {
+        XXXXXX[i] = letters[v % NUM_LETTERS];
+        v /= NUM_LETTERS;
+    }
+}
+
+/* Write V as exactly WIDTH base62 digits, higher digits are dropped.  */
+static inline char * encode_base62(char * out, uint64_t v, int width) {
+    for (int i = width - 1; i >= 0; i--) {
+        out[i] = letters[v % NUM_LETTERS];
+        v /= NUM_LETTERS;
+    }
+    return out + width;
+}
+
+/* Write V with as many base62 digits as it needs.  */
+static inline char * encode_base62(char * out, uint64_t v) {
+    char digits[11];
+    int n = 0;
+    do {
+        digits[n++] = letters[v % NUM_LETTERS];
+        v /= NUM_LETTERS;
+    } while (v != 0);
+    while (n != 0) {
+        *out++ = digits[--n];
+    }
+    return out;
+}
+
+#define UNIQUE_NAME_MAX (4 + 4 + 4 + 11)
+
+/* Write a name that no other thread or process creates to OUT, returns its length.
+   4 digits of boot id, 4 of pid, 4 of thread and a per-thread counter,
+   the fixed widths keep the encoding unambiguous while the counter grows.  */
+static inline size_t generate_unique_name(char * out) {
+    NameGenerator & generator = name_generator();
+    char * end = out;
+    end = encode_base62(end, generator.boot, 4);
+    end = encode_base62(end, generator.pid, 4);
+    end = encode_base62(end, generator.thread, 4);
+    end = encode_base62(end, generator.counter++);
+    return end - out;
+}
+
+#ifndef TMP_MAX
+#define TMP_MAX 238328
+#endif
+
+#if !defined(_WIN32)
+/* Create an unnamed inode in DIR, it is never visible in the directory and
+   disappears when its last descriptor is closed.  */
+static int open_anonymous(const std::string & dir) {
+#if defined(O_TMPFILE)
+    // the default directory was probed once, dont try again where it cannot work
+    std::shared_ptr<const TempDirInfo> info = cached_temp_dir(dir);
+    if (info) {
+        if (!info->anonymous_files) {
+            errno = EOPNOTSUPP;
+            return -1;
+        }
+        return openat(info->dirfd, ".", O_TMPFILE | O_RDWR, 0600);
+    }
+    return open(dir.c_str(), O_TMPFILE | O_RDWR, 0600);
+#else
+    errno = EOPNOTSUPP;
+    return -1;
+#endif
+}
+
+// kernels without O_TMPFILE treat it as O_DIRECTORY and fail with EISDIR
+static bool anonymous_unsupported(int error) {
+    return error == EOPNOTSUPP || error == EISDIR;
+}
+
+/* Create a file that lives only in memory, NAME is what shows up in /proc.
+   Sealing is always allowed so the file can be made read-only later.  */
+static int open_memfd(const std::string & name) {
+#if defined(__linux__) && defined(MFD_ALLOW_SEALING)
+    // the kernel rejects names longer than 249 bytes
+    return memfd_create(name.substr(0, 249).c_str(), MFD_ALLOW_SEALING);
+#else
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+
+static bool memfd_unsupported(int error) {
+    return error == ENOSYS;
+}
+
+/* Create a file that has no name in DIR according to CREATE_FLAGS.
+   Returns the fd, -1 if creation failed, or -2 if no unnamed backend was
+   requested or supported and a named file should be created instead.
+   PATH receives the memfd name when MEMFD is set.  */
+static int open_unnamed(const std::string & dir, const std::string & template_prefix, const std::string & template_suffix, int create_flags, std::string & path, bool & memfd) {
+    memfd = false;
+    if ((create_flags & TEMP_FILE_CREATE_MEMFD) == TEMP_FILE_CREATE_MEMFD) {
+        std::string name = template_prefix + template_suffix;
+        int fd = open_memfd(name);
+        if (fd >= 0 || !memfd_unsupported(errno)) {
+            path = "memfd:" + name;
+            memfd = fd >= 0;
+            return fd;
+        }
+        // memfd_create is not available, fall back to the filesystem
+    }
+    if ((create_flags & TEMP_FILE_CREATE_ANONYMOUS) == TEMP_FILE_CREATE_ANONYMOUS) {
+        int fd = open_anonymous(dir);
+        if (fd >= 0 || !anonymous_unsupported(errno)) {
+            return fd;
+        }
+        // the filesystem cannot create anonymous files, fall back to a named one
+    }
+    return -2;
+}
+
+static int SEALS_TO_F_SEALS(int seals) {
+    int f_seals = 0;
+#if defined(F_ADD_SEALS)
+    if ((seals & TEMP_FILE_SEAL_SHRINK) == TEMP_FILE_SEAL_SHRINK) f_seals |= F_SEAL_SHRINK;
+    if ((seals & TEMP_FILE_SEAL_GROW) == TEMP_FILE_SEAL_GROW) f_seals |= F_SEAL_GROW;
+    if ((seals & TEMP_FILE_SEAL_WRITE) == TEMP_FILE_SEAL_WRITE) f_seals |= F_SEAL_WRITE;
+    if ((seals & TEMP_FILE_SEAL_SEAL) == TEMP_FILE_SEAL_SEAL) f_seals |= F_SEAL_SEAL;
+#endif
+    return f_seals;
+}
+
+static bool add_seals(int fd, int seals) {
+#if defined(F_ADD_SEALS)
+    return fcntl(fd, F_ADD_SEALS, SEALS_TO_F_SEALS(seals)) == 0;
+#else
+    errno = EINVAL;
+    return false;
+#endif
+}
+
+// how many subdirectories TEMP_FILE_CREATE_FANOUT makes on each of its two levels
+#define FANOUT_WIDTH 16
+
+static const char fanout_digits[] = "0123456789abcdef";
+
+/* Names the two subdirectories at NAME[FANOUT_AT] after a hash of the
+   generated name, the template has "0/0/" there.  */
+static void fanout_name(std::string & name, size_t fanout_at, size_t unique_begin, size_t unique_length) {
+    // FNV-1a
+    uint32_t h = 2166136261u;
+    for (size_t i = 0; i < unique_length; i++) {
+        h = (h ^ static_cast<unsigned char>(name[unique_begin + i])) * 16777619u;
+    }
+    h ^= h >> 16;
+    name[fanout_at] = fanout_digits[h % FANOUT_WIDTH];
+    name[fanout_at + 2] = fanout_digits[(h / FANOUT_WIDTH) % FANOUT_WIDTH];
+}
+
+/* Opens NAME from NAME_BEGIN on with O_CREAT|O_EXCL. A fanned out name
+   gets its subdirectories first, they are only created once a file needs
+   them and may be removed again by another thread once they are empty.  */
+static int create_at(int dirfd, std::string & name, size_t name_begin, size_t fanout_at, size_t unique_begin, size_t unique_length) {
+    if (fanout_at == 0) {
+        return openat(dirfd, name.c_str() + name_begin, O_RDWR | O_CREAT | O_EXCL, 0600);
+    }
+    fanout_name(name, fanout_at, unique_begin, unique_length);
+    for (int attempt = 0; ; attempt++) {
+        int fd = openat(dirfd, name.c_str() + name_begin, O_RDWR | O_CREAT | O_EXCL, 0600);
+        if (fd >= 0 || errno != ENOENT || attempt == 3) {
+            return fd;
+        }
+        // dir/a then dir/a/b, cut off after each level
+        for (size_t end : {fanout_at + 1, fanout_at + 3}) {
+            name[end] = '\0';
+            int made = mkdirat(dirfd, name.c_str() + name_begin, 0700);
+            int error = errno;
+            name[end] = '/';
+            if (made != 0 && error != EEXIST) {
+                errno = error;
+                return -1;
+            }
+        }
+    }
+}
+
+/* Create a file relative to DIRFD by filling in the XXXXXX of NAME, which
+   is followed by TEMPLATE_SUFFIX_LENGTH characters of suffix, and opening
+   it with O_CREAT|O_EXCL. NAME is overwritten with the name that was created.
+   Only NAME from NAME_BEGIN on is opened, so a whole path can be created
+   relative to the descriptor of its directory. If FANOUT_AT is not 0 the
+   file goes in the subdirectories named at NAME[FANOUT_AT].  */
+static int open_unique_at(int dirfd, std::string & name, size_t template_suffix_length, size_t name_begin = 0, size_t fanout_at = 0) {
+    size_t unique_begin = name.length()-template_suffix_length-6;
+    char * XXXXXX = &name[unique_begin];
+
+    for (unsigned int i = 0; i < TMP_MAX; ++i) {
+
+        /* Get some random data.  */
+        generate_name(XXXXXX);
+
+        int fd = create_at(dirfd, name, name_begin, fanout_at, unique_begin, 6);
+        if (fd >= 0 || errno != EEXIST) {
+            return fd;
+        }
+        stat_add(STAT_COLLISIONS);
+    }
+    errno = EEXIST;
+    return -1;
+}
+
+/* Create a file relative to DIRFD from the template NAME like open_unique_at,
+   but try a name from generate_unique_name in place of the XXXXXX first.
+   Random names are only needed if a file with that name was left behind.  */
+static int open_deterministic_at(int dirfd, std::string & name, size_t template_suffix_length, size_t name_begin = 0, size_t fanout_at = 0) {
+    char unique[UNIQUE_NAME_MAX];
+    size_t unique_length = generate_unique_name(unique);
+
+    size_t XXXXXX = name.length()-template_suffix_length-6;
+
+    std::string candidate = {};
+    candidate.reserve(name.length() - 6 + unique_length);
+    candidate.append(name, 0, XXXXXX);
+    candidate.append(unique, unique_length);
+    candidate.append(name, XXXXXX + 6, template_suffix_length);
+
+    int fd = create_at(dirfd, candidate, name_begin, fanout_at, XXXXXX, unique_length);
+    if (fd >= 0 || errno != EEXIST) {
+        name = std::move(candidate);
+        return fd;
+    }
+    stat_add(STAT_COLLISIONS);
+    return open_unique_at(dirfd, name, template_suffix_length, name_begin, fanout_at);
+}
+
+static int open_named_at(int dirfd, std::string & name, size_t template_suffix_length, int create_flags, size_t name_begin = 0, size_t fanout_at = 0) {
+    if ((create_flags & TEMP_FILE_CREATE_UNIQUE_NAME) == TEMP_FILE_CREATE_UNIQUE_NAME) {
+        return open_deterministic_at(dirfd, name, template_suffix_length, name_begin, fanout_at);
+    }
+    return open_unique_at(dirfd, name, template_suffix_length, name_begin, fanout_at);
+}
+
+/* Create the template PATH in DIR like open_named_at. A file in the
+   default directory is created relative to the descriptor kept open for
+   it, so the directory is not looked up again for every file.  */
+static int open_named_in(const std::string & dir, std::string & path, size_t template_suffix_length, int create_flags, size_t fanout_at) {
+    std::shared_ptr<const TempDirInfo> info = cached_temp_dir(dir);
+    if (info) {
+        return open_named_at(info->dirfd, path, template_suffix_length, create_flags, dir.length() + 1, fanout_at);
+    }
+    return open_named_at(AT_FDCWD, path, template_suffix_length, create_flags, 0, fanout_at);
+}
+
+size_t TempFile::prune_fanout(const std::string & dir) {
+    SaveError e;
+    std::string path = dir.length() != 0 ? dir : TempDir();
+    path += "/0/0";
+    size_t mid = path.length() - 3;
+    size_t removed = 0;
+    for (int i = 0; i < FANOUT_WIDTH; i++) {
+        path[mid] = fanout_digits[i];
+        for (int j = 0; j < FANOUT_WIDTH; j++) {
+            path[mid + 2] = fanout_digits[j];
+            if (rmdir(path.c_str()) == 0) removed++;
+        }
+        // then the directory above the leaves
+        if (rmdir(path.substr(0, mid + 1).c_str()) == 0) removed++;
+    }
+    return removed;
+}
+
+#if defined(TMPFILE_HAVE_IO_URING)
+/* Create COUNT files relative to DIRFD like open_unique_at, submitting the
+   openat calls through the ring of the calling thread in batches.
+   NAMES receives the name of each file, RESULTS its fd or a negative errno,
+   files that could not be attempted are left as URING_NOT_RUN, those whose
+   openat never completed as URING_TAKEN.  */
+static void uring_open_many(int dirfd, const std::string & name, size_t template_suffix_length, size_t count, std::vector<std::string> & names, std::vector<int> & results) {
+    Uring * ring = uring();
+    if (ring == nullptr) {
+        return;
+    }
+    SaveError error;
+
+    size_t XXXXXX = name.length()-template_suffix_length-6;
+
+    names.assign(count, name);
+    results.assign(count, URING_NOT_RUN);
+
+    std::vector<size_t> pending(count);
+    for (size_t i = 0; i < count; i++) {
+        pending[i] = i;
+    }
+    std::vector<int> pending_results;
+
+    for (unsigned int attempt = 0; attempt < TMP_MAX && pending.size() != 0; ++attempt) {
+        for (size_t i : pending) {
+            /* Get some random data.  */
+            generate_name(&names[i][XXXXXX]);
+        }
+        pending_results.assign(pending.size(), URING_NOT_RUN);
+        bool ok = ring->run(pending.size(), [&](io_uring_sqe * sqe, size_t i) {
+            sqe->opcode = IORING_OP_OPENAT;
+            sqe->fd = dirfd;
+            sqe->addr = reinterpret_cast<uintptr_t>(names[pending[i]].c_str());
+            sqe->len = 0600;
+            sqe->open_flags = O_RDWR | O_CREAT | O_EXCL;
+        }, pending_results.data());
+
+        size_t retry = 0;
+        for (size_t i = 0; i < pending.size(); i++) {
+            if (pending_results[i] == -EEXIST) {
+                // name collision, try again with another name
+                pending[retry++] = pending[i];
+                stat_add(STAT_COLLISIONS);
+            } else {
+                results[pending[i]] = pending_results[i];
+            }
+        }
+        pending.resize(retry);
+
+        if (!ok) {
+            if (ring->abandoned) uring_abandon(names);
+            uring_failed();
+            return;
+        }
+    }
+    for (size_t i : pending) {
+        results[i] = -EEXIST;
+    }
+}
+#endif
+
+/* Give the anonymous file FD a name by filling in the XXXXXX of PATH, which
+   is followed by TEMPLATE_SUFFIX_LENGTH characters of suffix.
+   PATH is overwritten with the name the file was linked under.  */
+static bool link_anonymous(int fd, std::string & path, size_t template_suffix_length) {
+    char proc_path[64];
+    snprintf(proc_path, sizeof(proc_path), "/proc/self/fd/%d", fd);
+
+    char * XXXXXX = &path[path.length()-template_suffix_length-6];
+
+    for (unsigned int i = 0; i < TMP_MAX; ++i) {
+
+        /* Get some random data.  */
+        generate_name(XXXXXX);
+
+        if (linkat(AT_FDCWD, proc_path, AT_FDCWD, path.c_str(), AT_SYMLINK_FOLLOW) == 0) {
+            return true;
+        }
+        if (errno != EEXIST) {
+            return false;
+        }
+        stat_add(STAT_COLLISIONS);
+    }
+    errno = EEXIST;
+    return false;
+}
+
+static bool link_anonymous(int fd, TempFilePath & path, size_t template_suffix_length) {
+    std::string name = path.str();
+    if (!link_anonymous(fd, name, template_suffix_length)) {
+        return false;
+    }
+    path.assign(name, name.length() - template_suffix_length - 6, template_suffix_length);
+    return true;
+}
+#else
+size_t TempFile::prune_fanout(const std::string &) {
+    // files are never fanned out on windows
+    return 0;
+}
+#endif
+
+#if !defined(_WIN32)
+// the descriptor of a handle, a lazy file gets it from the fd cache
+template <typename CleanUp>
+static int handle_fd(const CleanUp & data, bool pin) {
+    if (data.lazy != nullptr) {
+        return FdCache::get().acquire(data.lazy, data.path, pin);
+    }
+    return data.fd;
+}
+
+template <typename CleanUp>
+static void handle_unpin(const CleanUp & data) {
+    if (data.lazy != nullptr) {
+        FdCache::get().unpin(data.lazy);
+    }
+}
+
+// gives the descriptor of a lazy file to the caller before the handle is converted
+template <typename CleanUp>
+static int take_fd(CleanUp & data) {
+    if (data.lazy == nullptr) {
+        return data.fd;
+    }
+    int fd = FdCache::get().take(data.lazy, data.path);
+    data.lazy = nullptr;
+    return fd;
+}
+
+/* Runs OP on the pinned descriptor of FILE, a TempFile, TempFileFD or
+   TempFileUnique, and unpins it again. Returns FAILED with errno EBADF if
+   FILE has no file.  */
+template <typename File, typename Result, typename Op>
+static Result with_pinned(File & file, Result failed, Op op) {
+    int fd = file.pin();
+    if (fd < 0) {
+        errno = EBADF;
+        return failed;
+    }
+    Result result = op(fd);
+    file.unpin();
+    return result;
+}
+#endif
+
+// get_path of a handle that has never been constructed
+static const std::string & empty_path() {
+    static const std::string empty;
+    return empty;
+}
+
+TempFile::TempFile() {}
+
+TempFile::TempFile(const std::string & dir, const std::string & template_prefix) {
+    construct(dir, template_prefix);
+}
+
+TempFile::TempFile(const std::string & dir, const std::string & template_prefix, bool log_create_close) {
+    construct(dir, template_prefix, log_create_close);
+}
+
+TempFile::TempFile(const std::string & dir, const std::string & template_prefix, const std::string & template_suffix) {
+    construct(dir, template_prefix, template_suffix);
+}
+
+TempFile::TempFile(const std::string & dir, const std::string & template_prefix, const std::string & template_suffix, bool log_create_close) {
+    construct(dir, template_prefix, template_suffix, log_create_close);
+}
+
+TempFile::TempFile(const std::string & dir, const std::string & template_prefix, const std::string & template_suffix, int create_flags) {
+    construct(dir, template_prefix, template_suffix, create_flags);
+}
+
+TempFile::TempFile(const std::string & dir, const std::string & template_prefix, const std::string & template_suffix, int create_flags, bool log_create_close) {
+    construct(dir, template_prefix, template_suffix, create_flags, log_create_close);
+}
+
+TempFile::TempFile(TempDirSet & dirs, const std::string & template_prefix) {
+    construct(dirs, template_prefix);
+}
+
+TempFile::TempFile(TempDirSet & dirs, const std::string & template_prefix, bool log_create_close) {
+    construct(dirs, template_prefix, log_create_close);
+}
+
+TempFile::TempFile(TempDirSet & dirs, const std::string & template_prefix, const std::string & template_suffix) {
+    construct(dirs, template_prefix, template_suffix);
+}
+
+TempFile::TempFile(TempDirSet & dirs, const std::string & template_prefix, const std::string & template_suffix, bool log_create_close) {
+    construct(dirs, template_prefix, template_suffix, log_create_close);
+}
+
+TempFile::TempFile(TempDirSet & dirs, const std::string & template_prefix, const std::string & template_suffix, int create_flags) {
+    construct(dirs, template_prefix, template_suffix, create_flags);
+}
+
+TempFile::TempFile(TempDirSet & dirs, const std::string & template_prefix, const std::string & template_suffix, int create_flags, bool log_create_close) {
+    construct(dirs, template_prefix, template_suffix, create_flags, log_create_close);
+}
+
+TempFile::TempFile(const std::string & dir, const std::string & template_prefix, const std::string & template_suffix, int create_flags, uint64_t preallocate_size, int preallocate_flags) {
+    construct(dir, template_prefix, template_suffix, create_flags, preallocate_size, preallocate_flags);
+}
+
+TempFile::TempFile(const std::string & dir, const std::string & template_prefix, const std::string & template_suffix, int create_flags, uint64_t preallocate_size, int preallocate_flags, bool log_create_close) {
+    construct(dir, template_prefix, template_suffix, create_flags, preallocate_size, preallocate_flags, log_create_close);
+}
+
+TempFile::TempFile(TempDirSet & dirs, const std::string & template_prefix, const std::string & template_suffix, int create_flags, uint64_t preallocate_size, int preallocate_flags) {
+    construct(dirs, template_prefix, template_suffix, create_flags, preallocate_size, preallocate_flags);
+}
+
+TempFile::TempFile(TempDirSet & dirs, const std::string & template_prefix, const std::string & template_suffix, int create_flags, uint64_t preallocate_size, int preallocate_flags, bool log_create_close) {
+    construct(dirs, template_prefix, template_suffix, create_flags, preallocate_size, preallocate_flags, log_create_close);
+}
+
+bool TempFile::is_valid() const {
+    return this->data && this->data->is_valid();
+}
+
+bool TempFile::is_created() const {
+    return is_valid() && this->data->pending.load(std::memory_order_acquire) == nullptr;
+}
+
+bool TempFile::construct(const std::string & dir, const std::string & template_prefix) {
+    return construct(dir, template_prefix, "", false);
+}
+
+bool TempFile::construct(const std::string & dir, const std::string & template_prefix, bool log_create_close) {
+    return construct(dir, template_prefix, "", log_create_close);
+}
+
+bool TempFile::construct(const std::string & dir, const std::string & template_prefix, const std::string & template_suffix) {
+    return construct(dir, template_prefix, template_suffix, false);
+}
+
+bool TempFile::construct(const std::string & dir, const std::string & template_prefix, const std::string & template_suffix, bool log_create_close) {
+    return construct(dir, template_prefix, template_suffix, 0, log_create_close);
+}
+
+bool TempFile::construct(const std::string & dir, const std::string & template_prefix, const std::string & template_suffix, int create_flags) {
+    return construct(dir, template_prefix, template_suffix, create_flags, false);
+}
+
+bool TempFile::construct(TempDirSet & dirs, const std::string & template_prefix) {
+    return construct(dirs, template_prefix, "", false);
+}
+
+bool TempFile::construct(TempDirSet & dirs, const std::string & template_prefix, bool log_create_close) {
+    return construct(dirs, template_prefix, "", log_create_close);
+}
+
+bool TempFile::construct(TempDirSet & dirs, const std::string & template_prefix, const std::string & template_suffix) {
+    return construct(dirs, template_prefix, template_suffix, false);
+}
+
+bool TempFile::construct(TempDirSet & dirs, const std::string & template_prefix, const std::string & template_suffix, bool log_create_close) {
+    return construct(dirs, template_prefix, template_suffix, 0, log_create_close);
+}
+
+bool TempFile::construct(TempDirSet & dirs, const std::string & template_prefix, const std::string & template_suffix, int create_flags) {
+    return construct(dirs, template_prefix, template_suffix, create_flags, false);
+}
+
+bool TempFile::construct(TempDirSet & dirs, const std::string & template_prefix, const std::string & template_suffix, int create_flags, bool log_create_close) {
+    return construct(dirs.pick(), template_prefix, template_suffix, create_flags, log_create_close);
+}
+
+bool TempFile::construct(const std::string & dir, const std::string & template_prefix, const std::string & template_suffix, int create_flags, uint64_t preallocate_size, int preallocate_flags) {
+    return construct(dir, template_prefix, template_suffix, create_flags, preallocate_size, preallocate_flags, false);
+}
+
+bool TempFile::construct(TempDirSet & dirs, const std::string & template_prefix, const std::string & template_suffix, int create_flags, uint64_t preallocate_size, int preallocate_flags) {
+    return construct(dirs, template_prefix, template_suffix, create_flags, preallocate_size, preallocate_flags, false);
+}
+
+bool TempFile::construct(TempDirSet & dirs, const std::string & template_prefix, const std::string & template_suffix, int create_flags, uint64_t preallocate_size, int preallocate_flags, bool log_create_close) {
+    return construct(dirs.pick(), template_prefix, template_suffix, create_flags, preallocate_size, preallocate_flags, log_create_close);
+}
+
+bool TempFile::construct(const std::string & dir, const std::string & template_prefix, const std::string & template_suffix, int create_flags, uint64_t preallocate_size, int preallocate_flags, bool log_create_close) {
+    if (!construct(dir, template_prefix, template_suffix, create_flags, log_create_close)) {
+        return false;
+    }
+    if (preallocate_size == 0 && preallocate_flags == 0) {
+        return true;
+    }
+    // a file created on first use is preallocated when it is created
+    if (defer_preallocate(*this->data, preallocate_size, preallocate_flags)) {
+        return true;
+    }
+    if (!preallocate(preallocate_size, preallocate_flags) && (preallocate_flags & TEMP_FILE_PREALLOCATE_FAIL_FAST)) {
+        // nothing was written yet, the file is given up before anyone relies on the space
+        SaveError e;
+        reset();
+        return false;
+    }
+    return true;
+}
+
+bool TempFile::construct(const std::string & dir, const std::string & template_prefix, const std::string & template_suffix, int create_flags, bool log_create_close) {
+    if (!this->data) {
+        this->data = TempFileRef<CleanUp>(CleanUp::create());
+    }
+    return construct_data(*this->data, dir, template_prefix, template_suffix, create_flags, log_create_close);
+}
+
+/* Reserves a name for a TEMP_FILE_CREATE_ON_FIRST_USE file without creating
+   anything, TempFile::materialize creates the file under that name later.  */
+template <typename CleanUp>
+static void reserve_data(CleanUp & data, const std::string & dir, const std::string & template_prefix, const std::string & template_suffix, int create_flags, bool log_create_close) {
+    data.log_create_close = log_create_close;
+    data.deferred_cleanup = (create_flags & TEMP_FILE_CREATE_DEFERRED_CLEANUP) == TEMP_FILE_CREATE_DEFERRED_CLEANUP;
+
+    std::string & path = scratch_path();
+    path += dir;
+    path += "/";
+    path += template_prefix;
+    size_t unique_begin = path.length();
+    if ((create_flags & (TEMP_FILE_CREATE_ANONYMOUS | TEMP_FILE_CREATE_MEMFD | TEMP_FILE_CREATE_FANOUT)) != 0) {
+        // these get their name when they are created, the template shows there is none yet
+        path += "XXXXXX";
+    } else if ((create_flags & TEMP_FILE_CREATE_UNIQUE_NAME) == TEMP_FILE_CREATE_UNIQUE_NAME) {
+        char unique[UNIQUE_NAME_MAX];
+        path.append(unique, generate_unique_name(unique));
+    } else {
+        path += "XXXXXX";
+        generate_name(&path[unique_begin]);
+    }
+    path += template_suffix;
+    data.path.assign(path, unique_begin, template_suffix.length());
+
+    TempFilePending * pending = new TempFilePending();
+    pending->dir = dir;
+    pending->template_prefix = template_prefix;
+    pending->template_suffix = template_suffix;
+    pending->create_flags = create_flags;
+    data.pending.store(pending, std::memory_order_release);
+}
+
+#if !defined(_WIN32)
+/* Reserves the space construct was asked for once a file created on first
+   use exists. With TEMP_FILE_PREALLOCATE_FAIL_FAST a file that does not fit
+   is closed and deleted before it is used, DATA is then invalid.  */
+template <typename CleanUp>
+static bool preallocate_created(CleanUp & data, const TempFilePending & pending) {
+    if (pending.preallocate_size == 0 && pending.preallocate_flags == 0) {
+        return true;
+    }
+    int fd = handle_fd(data, true);
+    bool reserved = fd >= 0 && preallocate_file(fd, pending.preallocate_size, pending.preallocate_flags);
+    handle_unpin(data);
+    if (!reserved && (pending.preallocate_flags & TEMP_FILE_PREALLOCATE_FAIL_FAST)) {
+        SaveError error;
+        data.reset_fd();
+        data.reset_path();
+        return false;
+    }
+    return true;
+}
+#endif
+
+bool TempFile::materialize(CleanUp & data) {
+    // copies of a TempFile share the file, if they are first used at once the one that claims it creates it
+    TempFilePending * pending = data.pending.load(std::memory_order_acquire);
+    while (true) {
+        if (pending == nullptr) {
+            return data.is_valid();
+        }
+        if (pending == claimed_pending()) {
+            // creating it takes one open, waiting for it is cheaper than sleeping on a lock
+            std::this_thread::yield();
+            pending = data.pending.load(std::memory_order_acquire);
+        } else if (data.pending.compare_exchange_weak(pending, claimed_pending(), std::memory_order_acquire, std::memory_order_acquire)) {
+            break;
+        }
+    }
+
+    SaveError error;
+
+#if !defined(_WIN32)
+    if ((pending->create_flags & (TEMP_FILE_CREATE_ANONYMOUS | TEMP_FILE_CREATE_MEMFD | TEMP_FILE_CREATE_FANOUT)) == 0) {
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        // the reserved name, someone else can only have taken it by chance
+        int fd = open(PathString(data.path).c_str, O_RDWR | O_CREAT | O_EXCL, 0600);
+        if (fd >= 0 || errno != EEXIST) {
+            if (fd >= 0) {
+                data.fd = fd;
+                if (data.log_create_close) {
+                    log_event(TEMP_FILE_EVENT_CREATED, event_fd(data.fd), data.path);
+                }
+                if (!preallocate_created(data, *pending)) {
+                    error = {}; // keep the error of the preallocation
+                }
+                if (data.fd >= 0 && (pending->create_flags & TEMP_FILE_CREATE_LAZY_FD)) {
+                    data.lazy = FdCache::get().adopt(data.fd);
+                    data.fd = -1;
+                }
+            } else {
+                error = {}; // save current error, and restore after move
+
+                // dont attempt to delete path, it did not exist at time of call and an error has prevented its creation
+                data.fatal_path = true;
+            }
+            // published last, a copy that sees no pending file also sees its descriptor
+            data.pending.store(nullptr, std::memory_order_release);
+            delete pending;
+            stat_construct_latency(elapsed_ns(start));
+            stat_add(data.is_valid() ? STAT_CREATES : STAT_FATAL_ERRORS);
+            return data.is_valid();
+        }
+        stat_add(STAT_COLLISIONS);
+    }
+#endif
+
+    // the reserved name was taken, or the file gets its name when it is created
+    CleanUp created;
+    construct_data(created, pending->dir, pending->template_prefix, pending->template_suffix, pending->create_flags, data.log_create_close);
+#if !defined(_WIN32)
+    preallocate_created(created, *pending);
+#endif
+    error = {}; // save current error, and restore after move
+
+    // swap keeps the claim on both sides, so data only stops being pending after it holds the file
+    created.pending.store(claimed_pending(), std::memory_order_relaxed);
+    data.swap(created);
+    created.pending.store(nullptr, std::memory_order_relaxed);
+    // the reserved name was never created by us
+    created.fatal_path = true;
+    data.pending.store(nullptr, std::memory_order_release);
+    delete pending;
+    return data.is_valid();
+}
+
+#if !defined(_WIN32)
+// hands the descriptor of a TEMP_FILE_CREATE_LAZY_FD file to the fd cache
+template <typename CleanUp>
+static void adopt_lazy(CleanUp & data, int fd) {
+    data.lazy = FdCache::get().adopt(fd);
+    data.fd = -1;
+}
+
+// a FILE keeps its descriptor, there is no lazy TempFileFILE
+template <typename CleanUp>
+static void adopt_lazy(CleanUp &, FILE *) {}
+#endif
+
+/* Creates the file of DATA in DIR, which is not empty, for the construct of
+   every handle. STORE(data, fd) keeps the new descriptor, a HANDLE on
+   windows, in DATA the way the handle holds it, if it cannot it closes the
+   descriptor and returns false with errno set.  */
+template <typename CleanUp, typename Store>
+static bool create_data(CleanUp & data, const std::string & dir, const std::string & template_prefix, const std::string & template_suffix, int create_flags, bool log_create_close, Store store) {
+    SaveError error;
+
+    // timed from here, and counted as a create or a fatal error on return
+    ConstructStat<CleanUp> stat(data);
+
+    // we dont care if we get any errors here, if we fail to clean up then we should not consider this an error
+    data.reset();
+
+    data.log_create_close = log_create_close;
+
+    data.deferred_cleanup = (create_flags & TEMP_FILE_CREATE_DEFERRED_CLEANUP) == TEMP_FILE_CREATE_DEFERRED_CLEANUP;
+
+    // we have cleaned up
+
+    std::string & path = scratch_path();
+    path.reserve(dir.length() + 1 + template_prefix.length() + 6 + template_suffix.length());
+    path += dir;
+    path += "/";
+    path += template_prefix;
+    path += "XXXXXX";
+    path += template_suffix;
+
+    // where the generated name starts, the suffix follows it
+    size_t unique_begin = dir.length() + 1 + template_prefix.length();
+    // where the subdirectories of TEMP_FILE_CREATE_FANOUT go, 0 if there are none
+    size_t fanout_at = 0;
+
+#if !defined(_WIN32)
+    {
+        bool memfd;
+        int fd = open_unnamed(dir, template_prefix, template_suffix, create_flags, path, memfd);
+        if (fd >= 0) {
+            if (!store(data, fd)) {
+                error = {}; // save current error, and restore after move
+                data.path.assign(path, unique_begin, template_suffix.length(), fanout_at); // so the user can see what path may have caused the error
+                data.fatal_path = true;
+                return false;
+            }
+            // keep the template around, detach needs it to give the file a name
+            data.path.assign(path, memfd ? path.length() : unique_begin, memfd ? 0 : template_suffix.length());
+            data.anonymous = true;
+            data.memfd = memfd;
+            data.template_suffix_length = template_suffix.length();
+            if (data.log_create_close) {
+                log_event(TEMP_FILE_EVENT_CREATED_ANONYMOUS, event_fd(data.fd), data.path);
+            }
+            return true;
+        }
+        if (fd == -1) {
+            error = {}; // save current error, and restore after move
+            data.path.assign(path, unique_begin, template_suffix.length(), fanout_at); // so the user can see what path may have caused the error
+
+            // dont attempt to delete path, it did not exist at time of call and an error has prevented its creation
+            data.fatal_path = true;
+
+            return false;
+        }
+    }
+    if (create_flags & TEMP_FILE_CREATE_FANOUT) {
+        // two levels of subdirectories right after dir, named by create_at
+        fanout_at = dir.length() + 1;
+        path.insert(fanout_at, "0/0/");
+        unique_begin += 4;
+    }
+#endif
+
+#if defined(_WIN32)
+    char * XXXXXX = &path[path.length()-template_suffix.length()-6];
+
+    // based on
+    // https://github.com/wbx-github/uclibc-ng/blob/master/libc/misc/internals/tempname.c#L166
+
+    /* Generate a temporary file name based on TMPL. TMPL must match the
+    rules for mk[s]temp[s] (i.e. end in "prefixXXXXXXsuffix"). The name
+    constructed does not exist at the time of the call to __gen_tempname.
+    TMPL is overwritten with the result.
+    KIND may be one of:
+    __GT_NOCREATE:       simply verify that the name does not exist
+                            at the time of the call. mode argument is ignored.
+    __GT_FILE:           create the file using open(O_CREAT|O_EXCL)
+                            and return a read-write fd with given mode.
+    __GT_BIGFILE:        same as __GT_FILE but use open64().
+    __GT_DIR:            create a directory with given mode.
+    */
+
+    unsigned int i;
+#endif
+
+    while (true) {
+
+        // if we are invalid we need to clean up and try again
+        data.reset();
+
+#if defined(_WIN32)
+
+        for (i = 0; i < TMP_MAX; ++i) {
+            
+            /* Get some random data.  */
+            generate_name(XXXXXX);
+            
+            HANDLE handle = CreateFile (
+                path.c_str(),
+                GENERIC_READ | GENERIC_WRITE,
+                0,
+                NULL,
+                OPEN_ALWAYS,
+                FILE_ATTRIBUTE_TEMPORARY|FILE_FLAG_DELETE_ON_CLOSE,
+                NULL
+            );
+
+            if (handle == INVALID_HANDLE_VALUE) {
+                if (GetLastError() != ERROR_ALREADY_EXISTS) {
+                    /* Any other error will apply also to other names we might
+                    try, and there are 2^32 or so of them, so give up now. */
+
+                    // fd is already invalid thus no need to reset it
+
+                    error = {}; // save current error, and restore after move
+
+                    data.path.assign(path, unique_begin, template_suffix.length(), fanout_at); // so the user can see what path may have caused the error
+
+                    // dont attempt to delete path, it did not exist at time of call and an error has prevented its creation
+                    data.fatal_path = true;
+
+                    return false;
+                }
+                // file exists, try again
+                stat_add(STAT_COLLISIONS);
+                continue;
+            }
+            // we got a valid handle, and we have a valid path
+            data.path.assign(path, unique_begin, template_suffix.length(), fanout_at);
+            if (!store(data, handle)) {
+                error = {};
+
+                // the file is deleted with the handle store closed
+                data.fatal_path = true;
+
+                return false;
+            }
+            if (data.log_create_close) {
+                log_event(TEMP_FILE_EVENT_CREATED, event_fd(data.fd), data.path);
+            }
+            return true;
+        }
+
+        /* We got out of the loop because we ran out of combinations to try.  */
+
+        // fd is already invalid thus no need to reset it
+        error.set_last_error();
+        error.set_errno(EEXIST);
+        data.path.assign(path, unique_begin, template_suffix.length(), fanout_at); // so the user can see what path may have caused the error
+
+        // dont attempt to delete path, it did not exist at time of call and an error has prevented its creation
+        data.fatal_path = true;
+
+        return false;
+#else
+        int fd = open_named_in(dir, path, template_suffix.length(), create_flags, fanout_at);
+
+        if (fd < 0) {
+            if (fd == -1) {
+                error = {}; // save current error, and restore after move
+                data.path.assign(path, unique_begin, template_suffix.length(), fanout_at); // so the user can see what path may have caused the error
+
+                // dont attempt to delete path, it did not exist at time of call and an error has prevented its creation
+                data.fatal_path = true;
+
+                return false;
+            }
+            goto LOOP_CONTINUE;
+        }
+        data.path.assign(path, unique_begin, template_suffix.length(), fanout_at);
+        if (!store(data, fd)) {
+            error = {}; // save current error, and restore after move
+            // created but never handed out, it is not left behind
+            unlink(path.c_str());
+
+            // the path is already gone
+            data.fatal_path = true;
+
+            return false;
+        }
+        if (data.log_create_close) {
+            log_event(TEMP_FILE_EVENT_CREATED, event_fd(data.fd), data.path);
+        }
+        if (create_flags & TEMP_FILE_CREATE_LAZY_FD) {
+            adopt_lazy(data, data.fd);
+        }
+        return true;
+#endif
+        LOOP_CONTINUE:
+        continue;
+    }
+    // we should not get to here
+    error = {}; // save current error, and restore after move
+
+    data.path.assign(path, unique_begin, template_suffix.length(), fanout_at); // so the user can see what path may have caused the error
+
+    // dont attempt to delete path, it did not exist at time of call and an error has prevented its creation
+    data.fatal_path = true;
+
+    return false;
+}
+
+bool TempFile::construct_data(CleanUp & data, const std::string & dir, const std::string & template_prefix, const std::string & template_suffix, int create_flags, bool log_create_close) {
+    if (dir.length() == 0) {
+        // resolved once, see temp_dir_info
+        std::shared_ptr<const TempDirInfo> info = temp_dir_info();
+        return construct_data(data, info->path, template_prefix, template_suffix, create_flags, log_create_close);
+    }
+
+    if (data.is_valid()) {
+        // return true if we are already set-up
+        return true;
+    }
+
+    if ((create_flags & TEMP_FILE_CREATE_ON_FIRST_USE) == TEMP_FILE_CREATE_ON_FIRST_USE) {
+        SaveError error;
+        // counted once the file is created by materialize
+        data.reset();
+        reserve_data(data, dir, template_prefix, template_suffix, create_flags & ~TEMP_FILE_CREATE_ON_FIRST_USE, log_create_close);
+        return true;
+    }
+
+    return create_data(data, dir, template_prefix, template_suffix, create_flags, log_create_close, [](CleanUp & data, auto fd) {
+        data.fd = fd;
+        return true;
+    });
+}
+
+const std::string & TempFile::get_path() const {
+    if (!this->data) {
+        return empty_path();
+    }
+    return this->data->path.str();
+}
+
+size_t TempFile::get_path(char * buffer, size_t size) const {
+    if (!this->data) {
+        if (size != 0) buffer[0] = '\0';
+        return 0;
+    }
+    return this->data->path.copy(buffer, size);
+}
+
+TempFile & TempFile::detach() {
+    if (this->data) {
+        detach_data(*this->data);
+    }
+    return *this;
+}
+
+void TempFile::detach_data(CleanUp & data) {
+    // a detached file has to exist to be kept
+    materialize(data);
+#if !defined(_WIN32)
+    // a memfd file cannot be linked anywhere, detaching it only gives up the handle
+    if (data.anonymous && !data.memfd && data.is_valid()) {
+        // an anonymous file has no name to keep, give it one before letting go of it
+        SaveError error;
+        if (!link_anonymous(data.fd, data.path, data.template_suffix_length)) {
+            error = {}; // the file stays anonymous and will be released as usual
+            return;
+        }
+        data.anonymous = false;
+    }
+#endif
+    if (data.is_valid()) stat_add(STAT_DETACHES);
+    data.detach();
+}
+
+#if defined(_WIN32)
+HANDLE
+#else
+int
+#endif
+TempFile::get_handle() const {
+    if (!this->data) {
+#if defined(_WIN32)
+        return INVALID_HANDLE_VALUE;
+#else
+        return -1;
+#endif
+    }
+    materialize(*this->data);
+#if defined(_WIN32)
+    return this->data->fd;
+#else
+    return handle_fd(*this->data, false);
+#endif
+}
+
+TempFile & TempFile::reset() {
+    if (this->data) {
+        this->data->reset();
+    }
+    return *this;
+}
+
+#if defined(_WIN32)
+HANDLE
+#else
+int
+#endif
+TempFile::pin() {
+    if (!this->data) {
+#if defined(_WIN32)
+        return INVALID_HANDLE_VALUE;
+#else
+        return -1;
+#endif
+    }
+    materialize(*this->data);
+#if defined(_WIN32)
+    return this->data->fd;
+#else
+    return handle_fd(*this->data, true);
+#endif
+}
+
+void TempFile::unpin() {
+#if !defined(_WIN32)
+    if (this->data) {
+        handle_unpin(*this->data);
+    }
+#endif
+}
+
+void TempFile::flush_cleanup() {
+#if !defined(_WIN32)
+    Reaper::get().flush();
+#endif
+}
+
+std::vector<TempFile> TempFile::construct_many(const std::string & dir, const std::string & template_prefix, const std::string & template_suffix, size_t count) {
+    std::vector<int> errors;
+    return construct_many(dir, template_prefix, template_suffix, count, errors, false);
+}
+
+std::vector<TempFile> TempFile::construct_many(const std::string & dir, const std::string & template_prefix, const std::string & template_suffix, size_t count, bool log_create_close) {
+    std::vector<int> errors;
+    return construct_many(dir, template_prefix, template_suffix, count, errors, log_create_close);
+}
+
+std::vector<TempFile> TempFile::construct_many(const std::string & dir, const std::string & template_prefix, const std::string & template_suffix, size_t count, std::vector<int> & errors) {
+    return construct_many(dir, template_prefix, template_suffix, count, errors, false);
+}
+
+std::vector<TempFile> TempFile::construct_many(const std::string & dir, const std::string & template_prefix, const std::string & template_suffix, size_t count, std::vector<int> & errors, bool log_create_close) {
+    if (dir.length() == 0) {
+        // resolved once, see temp_dir_info
+        std::shared_ptr<const TempDirInfo> info = temp_dir_info();
+        return construct_many(info->path, template_prefix, template_suffix, count, errors, log_create_close);
+    }
+
+    std::vector<TempFile> files(count);
+    errors.assign(count, 0);
+
+#if defined(_WIN32)
+    for (size_t i = 0; i < count; i++) {
+        if (!files[i].construct(dir, template_prefix, template_suffix, log_create_close)) {
+            errors[i] = errno;
+        }
+    }
+#else
+    SaveError error;
+
+    // resolve dir once, every file is created relative to it, the default directory is already open
+    std::shared_ptr<const TempDirInfo> info = cached_temp_dir(dir);
+    int dirfd = info ? info->dirfd : open(dir.c_str(), O_RDONLY | O_DIRECTORY);
+    int dir_errno = errno;
+
+    std::string name = {};
+    name += template_prefix;
+    name += "XXXXXX";
+    name += template_suffix;
+
+    // every path shares what comes before the generated name
+    std::string head = dir + "/" + template_prefix;
+
+    auto start = std::chrono::steady_clock::now();
+    uint64_t created = 0;
+
+    std::vector<std::string> names;
+    std::vector<int> results;
+#if defined(TMPFILE_HAVE_IO_URING)
+    if (dirfd >= 0 && count > 1) {
+        uring_open_many(dirfd, name, template_suffix.length(), count, names, results);
+    }
+#endif
+
+    for (size_t i = 0; i < count; i++) {
+        files[i].data = TempFileRef<CleanUp>(CleanUp::create());
+        CleanUp & data = *files[i].data;
+
+        data.log_create_close = log_create_close;
+
+        int fd;
+        // an open whose outcome is unknown is not retried under its name, a new name is safe
+        if (i < results.size() && results[i] != URING_NOT_RUN && results[i] != URING_TAKEN) {
+            name = std::move(names[i]);
+            fd = results[i];
+            if (fd < 0) {
+                errno = -fd;
+                fd = -1;
+            }
+        } else {
+            fd = dirfd < 0 ? -1 : open_unique_at(dirfd, name, template_suffix.length());
+            if (dirfd < 0) errno = dir_errno;
+        }
+
+        data.path.assign(head.data(), head.length(), name.data() + template_prefix.length(), name.length() - template_prefix.length() - template_suffix.length(), name.data() + name.length() - template_suffix.length(), template_suffix.length());
+
+        if (fd < 0) {
+            error = {}; // save current error, and restore after return
+            errors[i] = error.get_errno();
+
+            // dont attempt to delete path, it did not exist at time of call and an error has prevented its creation
+            data.fatal_path = true;
+            continue;
+        }
+        data.fd = fd;
+        created++;
+        if (data.log_create_close) {
+            log_event(TEMP_FILE_EVENT_CREATED, event_fd(data.fd), data.path);
+        }
+    }
+
+    if (dirfd >= 0 && !info) {
+        close(dirfd);
+    }
+
+    // the files were created together, each is given an equal share of the time
+    if (count != 0) {
+        stat_construct_latency(elapsed_ns(start) / count, count);
+    }
+    stat_add(STAT_CREATES, created);
+    stat_add(STAT_FATAL_ERRORS, count - created);
+#endif
+    return files;
+}
+
+bool TempFile::seal(int seals) {
+    if (!is_valid() || !materialize(*this->data)) {
+        errno = EBADF;
+        return false;
+    }
+#if defined(_WIN32)
+    errno = EINVAL;
+    return false;
+#else
+    return add_seals(handle_fd(*this->data, false), seals);
+#endif
+}
+
+// commit
+
+#if !defined(_WIN32)
+/* Rename SRC to NAME in DIRFD as TEMP_FILE_COMMIT_* COMMIT_FLAGS say,
+   renameat2 does the flags atomically where the kernel has it.  */
+static int rename_at(const char * src, int dirfd, const char * name, int commit_flags) {
+    if ((commit_flags & (TEMP_FILE_COMMIT_NOREPLACE | TEMP_FILE_COMMIT_EXCHANGE)) == 0) {
+        return renameat(AT_FDCWD, src, dirfd, name);
+    }
+#if defined(__linux__) && defined(SYS_renameat2)
+    unsigned int flags = (commit_flags & TEMP_FILE_COMMIT_EXCHANGE) ? RENAME_EXCHANGE : RENAME_NOREPLACE;
+    int r = syscall(SYS_renameat2, AT_FDCWD, src, dirfd, name, flags);
+    if (r == 0 || (errno != ENOSYS && errno != EINVAL)) {
+        return r;
+    }
+#endif
+    if (commit_flags & TEMP_FILE_COMMIT_EXCHANGE) {
+        // there is no other way to swap two files atomically
+        errno = ENOTSUP;
+        return -1;
+    }
+    // linking fails if the destination exists, which is what NOREPLACE asks for
+    if (linkat(AT_FDCWD, src, dirfd, name, 0) != 0) {
+        return -1;
+    }
+    unlink(src);
+    return 0;
+}
+
+// the directory PATH is created in, as a directory to open and the name PATH has in it
+static std::string parent_dir(const std::string & path, size_t & name_begin) {
+    size_t slash = path.rfind('/');
+    if (slash == std::string::npos) {
+        name_begin = 0;
+        return ".";
+    }
+    name_begin = slash + 1;
+    return slash == 0 ? "/" : path.substr(0, slash);
+}
+
+// opens DIR to sync it, the default directory is already open and is returned as is
+static int open_parent(const std::string & dir, std::shared_ptr<const TempDirInfo> & info) {
+    info = cached_temp_dir(dir);
+    if (info) {
+        return info->dirfd;
+    }
+    return open(dir.c_str(), O_RDONLY | O_DIRECTORY);
+}
+
+static bool sync_dir(int dirfd) {
+    if (fsync(dirfd) != 0) {
+        return false;
+    }
+    stat_add(STAT_DIR_SYNCS);
+    return true;
+}
+#endif
+
+bool TempFile::commit_data(CleanUp & data, const std::string & path, int dirfd, int durability, int commit_flags) {
+    // a committed file is no longer ours to move, fatal_path is only set on a valid handle by a commit
+    if (!data.is_valid() || data.detached || data.fatal_path || !materialize(data)) {
+        errno = EBADF;
+        return false;
+    }
+#if defined(_WIN32)
+    // the file is deleted when its handle is closed, it cannot be kept under another name
+    (void)path, (void)dirfd, (void)durability, (void)commit_flags;
+    errno = ENOSYS;
+    return false;
+#else
+    if (data.memfd) {
+        // a memfd file lives in no filesystem
+        errno = EXDEV;
+        return false;
+    }
+    if (durability >= TEMP_FILE_DURABILITY_DATA) {
+        int fd = handle_fd(data, true);
+        int r = fdatasync(fd);
+        handle_unpin(data);
+        if (r != 0) {
+            return false;
+        }
+    }
+    if (data.anonymous) {
+        // rename needs a name to move, the file only gets one on the way to its destination
+        SaveError error;
+        if (!link_anonymous(data.fd, data.path, data.template_suffix_length)) {
+            error = {};
+            return false;
+        }
+        data.anonymous = false;
+    }
+
+    size_t name_begin = 0;
+    if (dirfd != AT_FDCWD) {
+        parent_dir(path, name_begin);
+    }
+    if (rename_at(PathString(data.path).c_str, dirfd, path.c_str() + name_begin, commit_flags) != 0) {
+        return false;
+    }
+    stat_add(STAT_COMMITS);
+
+    if (commit_flags & TEMP_FILE_COMMIT_EXCHANGE) {
+        // the handle now owns the previous file, which is deleted with it as any other temporary file
+        data.reset_fd();
+        data.fd = open(PathString(data.path).c_str, O_RDWR | O_NOFOLLOW | O_CLOEXEC);
+        if (data.fd < 0) {
+            // the destination is already in place, the previous file is deleted now rather than never
+            SaveError error;
+            data.reset_path();
+            return false;
+        }
+        return true;
+    }
+
+    if (data.log_create_close) {
+        log_event(TEMP_FILE_EVENT_DETACHED, event_fd(data.fd), path.c_str(), path.length());
+    }
+    // the file is no longer temporary, it keeps its name and is not logged again when released
+    // destinations are anywhere, they are not interned like the stems of temporary paths
+    data.path.assign("", 0, path.data(), path.length(), "", 0);
+    data.log_create_close = false;
+    // not detached, the handle still closes its descriptor, it only never deletes the path
+    data.fatal_path = true;
+    return true;
+#endif
+}
+
+bool TempFile::commit_path(CleanUp & data, const std::string & path, int durability, int commit_flags) {
+#if defined(_WIN32)
+    return commit_data(data, path, 0, durability, commit_flags);
+#else
+    if (durability < TEMP_FILE_DURABILITY_FULL) {
+        return commit_data(data, path, AT_FDCWD, durability, commit_flags);
+    }
+    size_t name_begin;
+    std::shared_ptr<const TempDirInfo> info;
+    int dirfd = open_parent(parent_dir(path, name_begin), info);
+    if (dirfd < 0) {
+        return false;
+    }
+    bool committed = commit_data(data, path, dirfd, durability, commit_flags) && sync_dir(dirfd);
+    if (!info) {
+        SaveError e;
+        close(dirfd);
+    }
+    return committed;
+#endif
+}
+
+bool TempFile::commit_to(const std::string & path) {
+    return commit_to(path, TEMP_FILE_DURABILITY_FULL, TEMP_FILE_COMMIT_REPLACE);
+}
+
+bool TempFile::commit_to(const std::string & path, int durability) {
+    return commit_to(path, durability, TEMP_FILE_COMMIT_REPLACE);
+}
+
+bool TempFile::commit_to(const std::string & path, int durability, int commit_flags) {
+    if (!this->data) {
+        errno = EBADF;
+        return false;
+    }
+    return commit_path(*this->data, path, durability, commit_flags);
+}
+
+size_t TempFile::commit_many(std::vector<TempFile> & files, const std::vector<std::string> & paths, int durability) {
+    std::vector<int> errors;
+    return commit_many(files, paths, durability, TEMP_FILE_COMMIT_REPLACE, errors);
+}
+
+size_t TempFile::commit_many(std::vector<TempFile> & files, const std::vector<std::string> & paths, int durability, int commit_flags) {
+    std::vector<int> errors;
+    return commit_many(files, paths, durability, commit_flags, errors);
+}
+
+size_t TempFile::commit_many(std::vector<TempFile> & files, const std::vector<std::string> & paths, int durability, int commit_flags, std::vector<int> & errors) {
+    size_t count = std::min(files.size(), paths.size());
+    errors.assign(files.size(), 0);
+    size_t committed = 0;
+
+#if defined(_WIN32)
+    for (size_t i = 0; i < count; i++) {
+        if (files[i].commit_to(paths[i], durability, commit_flags)) {
+            committed++;
+        } else {
+            errors[i] = errno;
+        }
+    }
+#else
+    // each directory is opened once, and synced once after everything was renamed into it
+    struct Parent {
+        int dirfd = -1;
+        int open_errno = 0;
+        std::shared_ptr<const TempDirInfo> info;
+        std::vector<size_t> files;
+    };
+    std::unordered_map<std::string, Parent> parents;
+
+    for (size_t i = 0; i < count; i++) {
+        if (!files[i].data) {
+            errors[i] = EBADF;
+            continue;
+        }
+        int dirfd = AT_FDCWD;
+        if (durability >= TEMP_FILE_DURABILITY_FULL) {
+            size_t name_begin;
+            std::string dir = parent_dir(paths[i], name_begin);
+            auto it = parents.find(dir);
+            if (it == parents.end()) {
+                it = parents.emplace(std::move(dir), Parent()).first;
+                it->second.dirfd = open_parent(it->first, it->second.info);
+                it->second.open_errno = errno;
+            }
+            if (it->second.dirfd < 0) {
+                errors[i] = it->second.open_errno;
+                continue;
+            }
+            dirfd = it->second.dirfd;
+            it->second.files.push_back(i);
+        }
+        if (commit_data(*files[i].data, paths[i], dirfd, durability, commit_flags)) {
+            committed++;
+        } else {
+            errors[i] = errno;
+        }
+    }
+
+    for (auto & entry : parents) {
+        Parent & parent = entry.second;
+        if (parent.dirfd < 0) {
+            continue;
+        }
+        if (!sync_dir(parent.dirfd)) {
+            // the renames into this directory may not survive a crash
+            int sync_errno = errno;
+            for (size_t i : parent.files) {
+                if (errors[i] == 0) {
+                    errors[i] = sync_errno;
+                    committed--;
+                }
+            }
+        }
+        if (!parent.info) {
+            close(parent.dirfd);
+        }
+    }
+    for (size_t i = count; i < files.size(); i++) {
+        errors[i] = EINVAL;
+    }
+#endif
+    return committed;
+}
+
+// copy
+
+#if !defined(_WIN32)
+// how much one syscall is asked to move, and the buffer used where the kernel cannot copy
+#define COPY_STEP_BYTES (1 << 30)
+#define COPY_BUFFER_BYTES (64 * 1024)
+// a copy between two files larger than this is split into chunks copied by up to COPY_PARALLEL_THREADS threads
+#define COPY_PARALLEL_BYTES (uint64_t(256) << 20)
+#define COPY_CHUNK_BYTES (uint64_t(32) << 20)
+#define COPY_PARALLEL_THREADS 4
+
+// the kernel cannot copy between these two descriptors this way, the next way is tried
+static bool copy_unsupported(int error) {
+    return error == ENOSYS || error == EXDEV || error == EINVAL || error == EOPNOTSUPP || error == ENOTSUP
+        // copy_file_range refuses a destination opened with O_APPEND
+        || error == EBADF;
+}
+
+static bool write_all(int fd, const char * buffer, size_t length) {
+    while (length != 0) {
+        ssize_t n = write(fd, buffer, length);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return false;
+        }
+        buffer += n;
+        length -= n;
+    }
+    return true;
+}
+
+/* Moves up to LENGTH bytes from IN to OUT, less if IN ends first. IN is read
+   at *IN_OFFSET, which is advanced, or at its own offset if IN_OFFSET is null,
+   OUT is always written at its own offset so it can be a pipe or a socket.
+   Tries copy_file_range, then sendfile, then splice through a pipe, each until
+   it turns out to be unsupported, and copies through a buffer last.  */
+static int64_t copy_stream(int in, off_t * in_offset, int out, uint64_t length) {
+    uint64_t copied = 0;
+#if defined(__linux__)
+    while (copied < length) {
+        ssize_t n = copy_file_range(in, in_offset, out, nullptr, std::min<uint64_t>(length - copied, COPY_STEP_BYTES), 0);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 && !copy_unsupported(errno)) return -1;
+        // some filesystems report nothing to copy instead of refusing, sendfile tells if IN really is at its end
+        if (n <= 0) break;
+        copied += n;
+    }
+    while (copied < length) {
+        ssize_t n = sendfile(out, in, in_offset, std::min<uint64_t>(length - copied, COPY_STEP_BYTES));
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 && !copy_unsupported(errno)) return -1;
+        if (n < 0) break;
+        if (n == 0) return copied;
+        copied += n;
+    }
+    // sendfile cannot read from a pipe or a socket, splice can
+    int pipefd[2];
+    if (copied < length && pipe2(pipefd, O_CLOEXEC) == 0) {
+        int64_t result = -2;
+        while (result == -2 && copied < length) {
+            ssize_t n = splice(in, in_offset, pipefd[1], nullptr, std::min<uint64_t>(length - copied, COPY_BUFFER_BYTES), SPLICE_F_MOVE);
+            if (n < 0 && errno == EINTR) continue;
+            if (n < 0) {
+                if (!copy_unsupported(errno)) result = -1;
+                break;
+            }
+            if (n == 0) {
+                result = copied;
+                break;
+            }
+            // what is in the pipe was already taken from IN, it has to reach OUT one way or another
+            size_t left = n;
+            while (left != 0) {
+                ssize_t m = splice(pipefd[0], nullptr, out, nullptr, left, SPLICE_F_MOVE);
+                if (m < 0 && errno == EINTR) continue;
+                if (m <= 0) {
+                    char buffer[COPY_BUFFER_BYTES];
+                    ssize_t r = read(pipefd[0], buffer, std::min<size_t>(left, sizeof(buffer)));
+                    if (r <= 0 || !write_all(out, buffer, r)) {
+                        result = -1;
+                        break;
+                    }
+                    m = r;
+                    // OUT cannot be spliced to, the rest is copied through the buffer
+                    if (left == size_t(m)) result = -3;
+                }
+                left -= m;
+                copied += m;
+            }
+        }
+        SaveError e;
+        close(pipefd[0]);
+        close(pipefd[1]);
+        if (result >= 0 || result == -1) {
+            return result;
+        }
+    }
+#endif
+    std::vector<char> buffer(COPY_BUFFER_BYTES);
+    while (copied < length) {
+        size_t step = std::min<uint64_t>(length - copied, buffer.size());
+        ssize_t n = in_offset ? pread(in, buffer.data(), step, *in_offset) : read(in, buffer.data(), step);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) return -1;
+        if (n == 0) break;
+        if (!write_all(out, buffer.data(), n)) return -1;
+        if (in_offset) *in_offset += n;
+        copied += n;
+    }
+    return copied;
+}
+
+/* Copies LENGTH bytes at IN_OFFSET of the file IN to OUT_OFFSET of the file
+   OUT, neither offset of the descriptors is used or changed. Returns less
+   than LENGTH if IN ends first.  */
+static int64_t copy_chunk(int in, off_t in_offset, int out, off_t out_offset, uint64_t length) {
+    uint64_t copied = 0;
+#if defined(__linux__)
+    while (copied < length) {
+        ssize_t n = copy_file_range(in, &in_offset, out, &out_offset, std::min<uint64_t>(length - copied, COPY_STEP_BYTES), 0);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 && !copy_unsupported(errno)) return -1;
+        if (n <= 0) break;
+        copied += n;
+    }
+#endif
+    std::vector<char> buffer;
+    while (copied < length) {
+        if (buffer.empty()) buffer.resize(COPY_BUFFER_BYTES);
+        ssize_t n = pread(in, buffer.data(), std::min<uint64_t>(length - copied, buffer.size()), in_offset);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) return -1;
+        if (n == 0) break;
+        for (ssize_t done = 0; done < n; ) {
+            ssize_t m = pwrite(out, buffer.data() + done, n - done, out_offset + done);
+            if (m < 0 && errno == EINTR) continue;
+            if (m < 0) return -1;
+            done += m;
+        }
+        in_offset += n;
+        out_offset += n;
+        copied += n;
+    }
+    return copied;
+}
+
+/* copy_chunk for the whole range, a large range is split into chunks that
+   several threads take in turn, the calling thread is one of them.  */
+static int64_t copy_range(int in, off_t in_offset, int out, off_t out_offset, uint64_t length) {
+    if (length < COPY_PARALLEL_BYTES) {
+        return copy_chunk(in, in_offset, out, out_offset, length);
+    }
+    std::atomic<uint64_t> next {0};
+    std::atomic<uint64_t> copied {0};
+    std::atomic<int> error {0};
+    // a chunk that comes up short means IN shrank, nothing after it is copied
+    std::atomic<bool> ended {false};
+
+    auto work = [&]() {
+        while (!ended.load(std::memory_order_relaxed) && error.load(std::memory_order_relaxed) == 0) {
+            uint64_t begin = next.fetch_add(COPY_CHUNK_BYTES, std::memory_order_relaxed);
+            if (begin >= length) {
+                return;
+            }
+            uint64_t chunk = std::min(COPY_CHUNK_BYTES, length - begin);
+            int64_t n = copy_chunk(in, in_offset + begin, out, out_offset + begin, chunk);
+            if (n < 0) {
+                int expected = 0;
+                error.compare_exchange_strong(expected, errno);
+                return;
+            }
+            copied.fetch_add(n, std::memory_order_relaxed);
+            if (uint64_t(n) < chunk) ended.store(true, std::memory_order_relaxed);
+        }
+    };
+
+    size_t threads = std::min<size_t>(std::max(1u, std::thread::hardware_concurrency()), COPY_PARALLEL_THREADS);
+    std::vector<std::thread> workers;
+    workers.reserve(threads - 1);
+    for (size_t i = 1; i < threads; i++) {
+        try {
+            workers.emplace_back(work);
+        } catch (const std::system_error &) {
+            // fewer threads just take longer
+            break;
+        }
+    }
+    work();
+    for (std::thread & worker : workers) {
+        worker.join();
+    }
+    if (error.load() != 0) {
+        errno = error.load();
+        return -1;
+    }
+    return copied.load();
+}
+
+static int64_t file_size(int fd) {
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        return -1;
+    }
+    return st.st_size;
+}
+
+// the whole temporary file FD to OUT, at the offset of OUT
+static int64_t copy_file_to(int fd, int out) {
+    int64_t size = file_size(fd);
+    if (size < 0) {
+        return -1;
+    }
+    off_t offset = 0;
+    int64_t copied = copy_stream(fd, &offset, out, size);
+    if (copied > 0) stat_add(STAT_BYTES_COPIED, copied);
+    return copied;
+}
+
+static int64_t copy_file_to(int fd, const std::string & path) {
+    int64_t size = file_size(fd);
+    if (size < 0) {
+        return -1;
+    }
+    int out = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+    if (out < 0) {
+        return -1;
+    }
+    int64_t copied = copy_range(fd, 0, out, 0, size);
+    SaveError e;
+    close(out);
+    if (copied > 0) stat_add(STAT_BYTES_COPIED, copied);
+    return copied;
+}
+
+// everything from the offset of IN until its end to the temporary file FD, at the offset of FD
+static int64_t copy_file_from(int fd, int in) {
+    int64_t copied = copy_stream(in, nullptr, fd, UINT64_MAX);
+    if (copied > 0) stat_add(STAT_BYTES_COPIED, copied);
+    return copied;
+}
+
+static int64_t copy_file_from(int fd, const std::string & path) {
+    int in = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (in < 0) {
+        return -1;
+    }
+    int64_t size = file_size(in);
+    off_t offset = lseek(fd, 0, SEEK_CUR);
+    int64_t copied = -1;
+    if (size >= 0 && offset >= 0) {
+        copied = copy_range(in, 0, fd, offset, size);
+        // the chunks were written at explicit offsets, the file offset moves past them as a write would
+        if (copied > 0) lseek(fd, offset + copied, SEEK_SET);
+    }
+    SaveError e;
+    close(in);
+    if (copied > 0) stat_add(STAT_BYTES_COPIED, copied);
+    return copied;
+}
+
+int64_t TempFile::copy_to(int fd) {
+    return with_pinned(*this, int64_t(-1), [&](int temp) { return copy_file_to(temp, fd); });
+}
+
+int64_t TempFile::copy_to(const std::string & path) {
+    return with_pinned(*this, int64_t(-1), [&](int temp) { return copy_file_to(temp, path); });
+}
+
+int64_t TempFile::copy_from(int fd) {
+    return with_pinned(*this, int64_t(-1), [&](int temp) { return copy_file_from(temp, fd); });
+}
+
+int64_t TempFile::copy_from(const std::string & path) {
+    return with_pinned(*this, int64_t(-1), [&](int temp) { return copy_file_from(temp, path); });
+}
+#endif
+
+// clone
+
+#if !defined(_WIN32)
+/* Makes the temporary file FD a copy of LENGTH bytes at OFFSET of SRC, until
+   the end of SRC if LENGTH is 0, and moves its offset to the start. The
+   blocks are shared if the filesystem can clone them, otherwise they are
+   copied the way copy_from copies a path.  */
+static bool clone_file(int fd, int src, uint64_t offset, uint64_t length) {
+    if (ftruncate(fd, 0) != 0 || lseek(fd, 0, SEEK_SET) != 0) {
+        return false;
+    }
+#if defined(__linux__) && defined(FICLONE) && defined(FICLONERANGE)
+    int r;
+    if (offset == 0 && length == 0) {
+        r = ioctl(fd, FICLONE, src);
+    } else {
+        // the range has to be aligned to blocks, unless it ends at the end of SRC
+        struct file_clone_range range;
+        range.src_fd = src;
+        range.src_offset = offset;
+        range.src_length = length;
+        range.dest_offset = 0;
+        r = ioctl(fd, FICLONERANGE, &range);
+    }
+    if (r == 0) {
+        stat_add(STAT_CLONES);
+        return true;
+    }
+    // tmpfs, ext4 and memory files cannot clone, neither can two filesystems
+    if (!copy_unsupported(errno) && errno != ENOTTY) {
+        return false;
+    }
+#endif
+    int64_t size = file_size(src);
+    if (size < 0) {
+        return false;
+    }
+    uint64_t end = static_cast<uint64_t>(size);
+    if (length != 0 && offset + length < end) {
+        end = offset + length;
+    }
+    if (offset >= end) {
+        return true;
+    }
+    int64_t copied = copy_range(src, offset, fd, 0, end - offset);
+    if (copied < 0) {
+        return false;
+    }
+    stat_add(STAT_BYTES_COPIED, copied);
+    return true;
+}
+
+// clone_from of a path for every handle that can clone
+template <typename File>
+static bool clone_path(File & file, const std::string & path, uint64_t offset, uint64_t length) {
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return false;
+    }
+    bool cloned = file.clone_from(fd, offset, length);
+    SaveError e;
+    close(fd);
+    return cloned;
+}
+
+/* The clone factory of TempFile and TempFileFD, a missing SOURCE is found
+   out before anything is created.  */
+template <typename File>
+static File clone_new(const std::string & source, const std::string & dir, const std::string & template_prefix, const std::string & template_suffix, int create_flags, bool log_create_close) {
+    File file;
+    int src = open(source.c_str(), O_RDONLY | O_CLOEXEC);
+    if (src < 0) {
+        return file;
+    }
+    if (file.construct(dir, template_prefix, template_suffix, create_flags, log_create_close) && !file.clone_from(src)) {
+        SaveError e;
+        file.reset();
+    }
+    SaveError e;
+    close(src);
+    return file;
+}
+
+bool TempFile::clone_from(int fd) {
+    return clone_from(fd, 0, 0);
+}
+
+bool TempFile::clone_from(int fd, uint64_t offset, uint64_t length) {
+    return with_pinned(*this, false, [&](int temp) { return clone_file(temp, fd, offset, length); });
+}
+
+bool TempFile::clone_from(const std::string & path) {
+    return clone_from(path, 0, 0);
+}
+
+bool TempFile::clone_from(const std::string & path, uint64_t offset, uint64_t length) {
+    return clone_path(*this, path, offset, length);
+}
+
+TempFile TempFile::clone(const std::string & source, const std::string & dir, const std::string & template_prefix) {
+    return clone(source, dir, template_prefix, "", 0, false);
+}
+
+TempFile TempFile::clone(const std::string & source, const std::string & dir, const std::string & template_prefix, const std::string & template_suffix) {
+    return clone(source, dir, template_prefix, template_suffix, 0, false);
+}
+
+TempFile TempFile::clone(const std::string & source, const std::string & dir, const std::string & template_prefix, const std::string & template_suffix, int create_flags) {
+    return clone(source, dir, template_prefix, template_suffix, create_flags, false);
+}
+
+TempFile TempFile::clone(const std::string & source, const std::string & dir, const std::string & template_prefix, const std::string & template_suffix, int create_flags, bool log_create_close) {
+    return clone_new<TempFile>(source, dir, template_prefix, template_suffix, create_flags, log_create_close);
+}
+#endif
+
+// preallocate
+
+#if !defined(_WIN32)
+/* Applies the hints of PREALLOCATE_FLAGS to FD and reserves SIZE bytes for
+   it. A filesystem that cannot reserve space, or a kernel without fallocate,
+   only has its free space checked, and the size is set as fallocate would.
+   The hints belong to the descriptor, a lazy file loses them when it is
+   reopened.  */
+static bool preallocate_file(int fd, uint64_t size, int preallocate_flags) {
+#if defined(O_NOATIME)
+    if (preallocate_flags & TEMP_FILE_PREALLOCATE_NOATIME) {
+        int fl = fcntl(fd, F_GETFL);
+        if (fl >= 0) {
+            SaveError e;
+            fcntl(fd, F_SETFL, fl | O_NOATIME);
+        }
+    }
+#endif
+#if defined(POSIX_FADV_SEQUENTIAL)
+    if (preallocate_flags & (TEMP_FILE_PREALLOCATE_SEQUENTIAL | TEMP_FILE_PREALLOCATE_RANDOM)) {
+        posix_fadvise(fd, 0, 0, (preallocate_flags & TEMP_FILE_PREALLOCATE_SEQUENTIAL) ? POSIX_FADV_SEQUENTIAL : POSIX_FADV_RANDOM);
+    }
+#endif
+    if (size == 0) {
+        return true;
+    }
+    bool keep_size = preallocate_flags & TEMP_FILE_PREALLOCATE_KEEP_SIZE;
+#if defined(__linux__)
+    int r;
+    do {
+        r = fallocate(fd, keep_size ? FALLOC_FL_KEEP_SIZE : 0, 0, size);
+    } while (r != 0 && errno == EINTR);
+    if (r == 0) {
+        stat_add(STAT_PREALLOCATED_BYTES, size);
+        return true;
+    }
+    if (errno != EOPNOTSUPP && errno != ENOSYS) {
+        if (errno == ENOSPC || errno == EDQUOT) stat_add(STAT_PREALLOCATION_FAILURES);
+        return false;
+    }
+#endif
+    // nothing can be reserved, at least a file that cannot fit fails before anything is written
+    struct statvfs sv;
+    if (fstatvfs(fd, &sv) == 0 && static_cast<uint64_t>(sv.f_bavail) * sv.f_frsize < size) {
+        stat_add(STAT_PREALLOCATION_FAILURES);
+        errno = ENOSPC;
+        return false;
+    }
+    if (!keep_size) {
+        struct stat st;
+        if (fstat(fd, &st) == 0 && static_cast<uint64_t>(st.st_size) < size && ftruncate(fd, size) != 0) {
+            return false;
+        }
+    }
+    return true;
+}
+#endif
+
+bool TempFile::preallocate(uint64_t size) {
+    return preallocate(size, 0);
+}
+
+bool TempFile::preallocate(uint64_t size, int preallocate_flags) {
+#if defined(_WIN32)
+    // the space is not reserved on windows
+    (void)size;
+    (void)preallocate_flags;
+    return is_valid();
+#else
+    return with_pinned(*this, false, [&](int fd) { return preallocate_file(fd, size, preallocate_flags); });
+#endif
+}
+
+// FD
+
+TempFileFD::CleanUp::CleanUp() {
+    fd = -1;
+}
+
+bool TempFileFD::CleanUp::is_valid() const {
+    return (fd >= 0 || lazy != nullptr) && path.length() != 0;
+}
+
+void TempFileFD::CleanUp::detach() {
+    detached = true;
+}
+
+void TempFileFD::CleanUp::reset_fd() {
+#if !defined(_WIN32)
+    if (lazy != nullptr) {
+        fd = FdCache::get().release(lazy);
+        lazy = nullptr;
+    }
+#endif
+    if (fd >= 0) {
+        SaveError e;
+#if defined(_WIN32)
+        if (!detached) _close(fd);
+#else
+        if (!detached) close(fd);
+#endif
+    }
+    fd = -1;
+}
+
+void TempFileFD::CleanUp::reset_path() {
+    if (!fatal_path && path.length() != 0) {
+        SaveError e;
+        if (log_create_close) {
+            if (detached) {
+                log_event(TEMP_FILE_EVENT_DETACHED, -1, path);
+            } else if (anonymous) {
+                log_event(TEMP_FILE_EVENT_RELEASED_ANONYMOUS, -1, path);
+            } else {
+                log_event(TEMP_FILE_EVENT_DELETED, -1, path);
+            }
+        }
+#if defined(_WIN32)
+        if (!detached && DeleteFile(PathString(path).c_str)) stat_add(STAT_UNLINKS);
+#else
+        // an anonymous file has no name, closing it was enough
+        if (!detached && !anonymous && unlink(PathString(path).c_str) == 0) {
+            stat_add(STAT_UNLINKS);
+            prune_after_unlink(path);
+        }
+#endif
+    }
+    path.clear();
+}
+
+void TempFileFD::CleanUp::reset() {
+    // only the cleanup of a file that is still ours is timed
+    bool timed = !detached && is_valid();
+    std::chrono::steady_clock::time_point start;
+    if (timed) start = std::chrono::steady_clock::now();
+#if !defined(_WIN32)
+    // a lazy file may have no descriptor open, its path is still deferred
+    if (deferred_cleanup && timed) {
+        if (lazy != nullptr) {
+            fd = FdCache::get().release(lazy);
+            lazy = nullptr;
+        }
+        if (defer_cleanup(fd, nullptr, path, !fatal_path, anonymous, log_create_close)) {
+            fd = -1;
+            path.clear();
+        }
+    }
+#endif
+    reset_fd();
+    reset_path();
+    detached = false;
+    anonymous = false;
+    memfd = false;
+    template_suffix_length = 0;
+    if (timed) stat_cleanup_latency(elapsed_ns(start));
+}
+
+TempFileFD::CleanUp::~CleanUp() {
+    reset();
+}
+
+TempFileFD::CleanUp * TempFileFD::CleanUp::create() {
+    return new (TempFile::allocate_cleanup()) CleanUp();
+}
+
+void TempFileFD::CleanUp::destroy(CleanUp * data) {
+    data->~CleanUp();
+    TempFile::deallocate_cleanup(data);
+}
+
+TempFileFD::TempFileFD() {}
+
+TempFileFD::TempFileFD(const std::string & dir, const std::string & template_prefix) {
+    construct(dir, template_prefix);
+}
+
+TempFileFD::TempFileFD(const std::string & dir, const std::string & template_prefix, bool log_create_close) {
+    construct(dir, template_prefix, log_create_close);
+}
+
+TempFileFD::TempFileFD(const std::string & dir, const std::string & template_prefix, const std::string & template_suffix) {
+    construct(dir, template_prefix, template_suffix);
+}
+
+TempFileFD::TempFileFD(const std::string & dir, const std::string & template_prefix, const std::string & template_suffix, bool log_create_close) {
+    construct(dir, template_prefix, template_suffix, log_create_close);
+}
+
+TempFileFD::TempFileFD(const std::string & dir, const std::string & template_prefix, const std::string & template_suffix, int create_flags) {
+    construct(dir, template_prefix, template_suffix, create_flags);
+}
+
+TempFileFD::TempFileFD(const std::string & dir, const std::string & template_prefix, const std::string & template_suffix, int create_flags, bool log_create_close) {
+    construct(dir, template_prefix, template_suffix, create_flags, log_create_close);
+}
+
+TempFileFD::TempFileFD(TempDirSet & dirs, const std::string & template_prefix) {
+    construct(dirs, template_prefix);
+}
+
+TempFileFD::TempFileFD(TempDirSet & dirs, const std::string & template_prefix, bool log_create_close) {
+    construct(dirs, template_prefix, log_create_close);
+}
+
+TempFileFD::TempFileFD(TempDirSet & dirs, const std::string & template_prefix, const std::string & template_suffix) {
+    construct(dirs, template_prefix, template_suffix);
+}
+
+TempFileFD::TempFileFD(TempDirSet & dirs, const std::string & template_prefix, const std::string & template_suffix, bool log_create_close) {
+    construct(dirs, template_prefix, template_suffix, log_create_close);
+}
+
+TempFileFD::TempFileFD(TempDirSet & dirs, const std::string & template_prefix, const std::string & template_suffix, int create_flags) {
+    construct(dirs, template_prefix, template_suffix, create_flags);
+}
+
+TempFileFD::TempFileFD(TempDirSet & dirs, const std::string & template_prefix, const std::string & template_suffix, int create_flags, bool log_create_close) {
+    construct(dirs, template_prefix, template_suffix, create_flags, log_create_close);
+}
+
+TempFileFD::TempFileFD(const std::string & dir, const std::string & template_prefix, const std::string & template_suffix, int create_flags, uint64_t preallocate_size, int preallocate_flags) {
+    construct(dir, template_prefix, template_suffix, create_flags, preallocate_size, preallocate_flags);
+}
+
+TempFileFD::TempFileFD(const std::string & dir, const std::string & template_prefix, const std::string & template_suffix, int create_flags, uint64_t preallocate_size, int preallocate_flags, bool log_create_close) {
+    construct(dir, template_prefix, template_suffix, create_flags, preallocate_size, preallocate_flags, log_create_close);
+}
+
+TempFileFD::TempFileFD(TempDirSet & dirs, const std::string & template_prefix, const std::string & template_suffix, int create_flags, uint64_t preallocate_size, int preallocate_flags) {
+    construct(dirs, template_prefix, template_suffix, create_flags, preallocate_size, preallocate_flags);
+}
+
+TempFileFD::TempFileFD(TempDirSet & dirs, const std::string & template_prefix, const std::string & template_suffix, int create_flags, uint64_t preallocate_size, int preallocate_flags, bool log_create_close) {
+    construct(dirs, template_prefix, template_suffix, create_flags, preallocate_size, preallocate_flags, log_create_close);
+}
+
+bool TempFileFD::is_valid() const {
+    return this->data && this->data->is_valid();
+}
+
+bool TempFileFD::construct(const std::string & dir, const std::string & template_prefix) {
+    return construct(dir, template_prefix, "", false);
+}
+
+bool TempFileFD::construct(const std::string & dir, const std::string & template_prefix, bool log_create_close) {
+    return construct(dir, template_prefix, "", log_create_close);
+}
+
+bool TempFileFD::construct(const std::string & dir, const std::string & template_prefix, const std::string & template_suffix) {
+    return construct(dir, template_prefix, template_suffix, false);
+}
+
+bool TempFileFD::construct(const std::string & dir, const std::string & template_prefix, const std::string & template_suffix, bool log_create_close) {
+    return construct(dir, template_prefix, template_suffix, 0, log_create_close);
+}
+
+bool TempFileFD::construct(const std::string & dir, const std::string & template_prefix, const std::string & template_suffix, int create_flags) {
+    return construct(dir, template_prefix, template_suffix, create_flags, false);
+}
+
+bool TempFileFD::construct(TempDirSet & dirs, const std::string & template_prefix) {
+    return construct(dirs, template_prefix, "", false);
+}
+
+bool TempFileFD::construct(TempDirSet & dirs, const std::string & template_prefix, bool log_create_close) {
+    return construct(dirs, template_prefix, "", log_create_close);
+}
+
+bool TempFileFD::construct(TempDirSet & dirs, const std::string & template_prefix, const std::string & template_suffix) {
+    return construct(dirs, template_prefix, template_suffix, false);
+}
+
+bool TempFileFD::construct(TempDirSet & dirs, const std::string & template_prefix, const std::string & template_suffix, bool log_create_close) {
+    return construct(dirs, template_prefix, template_suffix, 0, log_create_close);
+}
+
+bool TempFileFD::construct(TempDirSet & dirs, const std::string & template_prefix, const std::string & template_suffix, int create_flags) {
+    return construct(dirs, template_prefix, template_suffix, create_flags, false);
+}
+
+bool TempFileFD::construct(TempDirSet & dirs, const std::string & template_prefix, const std::string & template_suffix, int create_flags, bool log_create_close) {
+    return construct(dirs.pick(), template_prefix, template_suffix, create_flags, log_create_close);
+}
+
+bool TempFileFD::construct(const std::string & dir, const std::string & template_prefix, const std::string & template_suffix, int create_flags, uint64_t preallocate_size, int preallocate_flags) {
+    return construct(dir, template_prefix, template_suffix, create_flags, preallocate_size, preallocate_flags, false);
+}
+
+bool TempFileFD::construct(TempDirSet & dirs, const std::string & template_prefix, const std::string & template_suffix, int create_flags, uint64_t preallocate_size, int preallocate_flags) {
+    return construct(dirs, template_prefix, template_suffix, create_flags, preallocate_size, preallocate_flags, false);
+}
+
+bool TempFileFD::construct(TempDirSet & dirs, const std::string & template_prefix, const std::string & template_suffix, int create_flags, uint64_t preallocate_size, int preallocate_flags, bool log_create_close) {
+    return construct(dirs.pick(), template_prefix, template_suffix, create_flags, preallocate_size, preallocate_flags, log_create_close);
+}
+
+bool TempFileFD::construct(const std::string & dir, const std::string & template_prefix, const std::string & template_suffix, int create_flags, uint64_t preallocate_size, int preallocate_flags, bool log_create_close) {
+    if (!construct(dir, template_prefix, template_suffix, create_flags, log_create_close)) {
+        return false;
+    }
+    if (preallocate_size == 0 && preallocate_flags == 0) {
+        return true;
+    }
+    if (!preallocate(preallocate_size, preallocate_flags) && (preallocate_flags & TEMP_FILE_PREALLOCATE_FAIL_FAST)) {
+        // nothing was written yet, the file is given up before anyone relies on the space
+        SaveError e;
+        reset();
+        return false;
+    }
+    return true;
+}
+
+bool TempFileFD::construct(const std::string & dir, const std::string & template_prefix, const std::string & template_suffix, int create_flags, bool log_create_close) {
+    if (dir.length() == 0) {
+        // resolved once, see temp_dir_info
+        std::shared_ptr<const TempDirInfo> info = TempFile::temp_dir_info();
+        return construct(info->path, template_prefix, template_suffix, create_flags, log_create_close);
+    }
+
+    if (!this->data) {
+        this->data = TempFileRef<CleanUp>(CleanUp::create());
+    }
+
+    if (this->data->is_valid()) {
+        // return true if we are already set-up
+        return true;
+    }
+
+    return create_data(*this->data, dir, template_prefix, template_suffix, create_flags, log_create_close, [](CleanUp & data, auto fd) {
+#if defined(_WIN32)
+        data.fd = _open_osfhandle(reinterpret_cast<intptr_t>(fd), _O_APPEND);
+        if (data.fd == -1) {
+            SaveError e;
+            CloseHandle(fd);
+            return false;
+        }
+#else
+        data.fd = fd;
+#endif
+        return true;
+    });
+}
+
+const std::string & TempFileFD::get_path() const {
+    if (!this->data) {
+        return empty_path();
+    }
+    return this->data->path.str();
+}
+
+size_t TempFileFD::get_path(char * buffer, size_t size) const {
+    if (!this->data) {
+        if (size != 0) buffer[0] = '\0';
+        return 0;
+    }
+    return this->data->path.copy(buffer, size);
+}
+
+TempFileFD & TempFileFD::detach() {
+    if (!this->data) {
+        return *this;
+    }
+#if !defined(_WIN32)
+    // a memfd file cannot be linked anywhere, detaching it only gives up the handle
+    if (this->data->anonymous && !this->data->memfd && this->data->is_valid()) {
+        // an anonymous file has no name to keep, give it one before letting go of it
+        SaveError error;
+        if (!link_anonymous(this->data->fd, this->data->path, this->data->template_suffix_length)) {
+            error = {}; // the file stays anonymous and will be released as usual
+            return *this;
+        }
+        this->data->anonymous = false;
+    }
+#endif
+    if (this->data->is_valid()) stat_add(STAT_DETACHES);
+    this->data->detach();
+    return *this;
+}
+
+int TempFileFD::get_handle() const {
+    if (!this->data) {
+        return -1;
+    }
+#if defined(_WIN32)
+    return this->data->fd;
+#else
+    return handle_fd(*this->data, false);
+#endif
+}
+
+TempFileFD & TempFileFD::reset() {
+    if (this->data) {
+        this->data->reset();
+    }
+    return *this;
+}
+
+int TempFileFD::pin() {
+    if (!this->data) {
+        return -1;
+    }
+#if defined(_WIN32)
+    return this->data->fd;
+#else
+    return handle_fd(*this->data, true);
+#endif
+}
+
+void TempFileFD::unpin() {
+#if !defined(_WIN32)
+    if (this->data) {
+        handle_unpin(*this->data);
+    }
+#endif
+}
+
+bool TempFileFD::seal(int seals) {
+    if (!is_valid()) {
+        errno = EBADF;
+        return false;
+    }
+#if defined(_WIN32)
+    errno = EINVAL;
+    return false;
+#else
+    return add_seals(handle_fd(*this->data, false), seals);
+#endif
+}
+
+bool TempFileFD::preallocate(uint64_t size) {
+    return preallocate(size, 0);
+}
+
+bool TempFileFD::preallocate(uint64_t size, int preallocate_flags) {
+#if defined(_WIN32)
+    // the space is not reserved on windows
+    (void)size;
+    (void)preallocate_flags;
+    return is_valid();
+#else
+    return with_pinned(*this, false, [&](int fd) { return preallocate_file(fd, size, preallocate_flags); });
+#endif
+}
+
+#if !defined(_WIN32)
+int64_t TempFileFD::copy_to(int fd) {
+    return with_pinned(*this, int64_t(-1), [&](int temp) { return copy_file_to(temp, fd); });
+}
+
+int64_t TempFileFD::copy_to(const std::string & path) {
+    return with_pinned(*this, int64_t(-1), [&](int temp) { return copy_file_to(temp, path); });
+}
+
+int64_t TempFileFD::copy_from(int fd) {
+    return with_pinned(*this, int64_t(-1), [&](int temp) { return copy_file_from(temp, fd); });
+}
+
+int64_t TempFileFD::copy_from(const std::string & path) {
+    return with_pinned(*this, int64_t(-1), [&](int temp) { return copy_file_from(temp, path); });
+}
+
+bool TempFileFD::clone_from(int fd) {
+    return clone_from(fd, 0, 0);
+}
+
+bool TempFileFD::clone_from(int fd, uint64_t offset, uint64_t length) {
+    return with_pinned(*this, false, [&](int temp) { return clone_file(temp, fd, offset, length); });
+}
+
+bool TempFileFD::clone_from(const std::string & path) {
+    return clone_from(path, 0, 0);
+}
+
+bool TempFileFD::clone_from(const std::string & path, uint64_t offset, uint64_t length) {
+    return clone_path(*this, path, offset, length);
+}
+
+TempFileFD TempFileFD::clone(const std::string & source, const std::string & dir, const std::string & template_prefix) {
+    return clone(source, dir, template_prefix, "", 0, false);
+}
+
+TempFileFD TempFileFD::clone(const std::string & source, const std::string & dir, const std::string & template_prefix, const std::string & template_suffix) {
+    return clone(source, dir, template_prefix, template_suffix, 0, false);
+}
+
+TempFileFD TempFileFD::clone(const std::string & source, const std::string & dir, const std::string & template_prefix, const std::string & template_suffix, int create_flags) {
+    return clone(source, dir, template_prefix, template_suffix, create_flags, false);
+}
+
+TempFileFD TempFileFD::clone(const std::string & source, const std::string & dir, const std::string & template_prefix, const std::string & template_suffix, int create_flags, bool log_create_close) {
+    return clone_new<TempFileFD>(source, dir, template_prefix, template_suffix, create_flags, log_create_close);
+}
+#endif
+
+
+
+// FILE*
+
+TempFileFILE::CleanUp::CleanUp() {
+    fd = nullptr;
+}
+
+bool TempFileFILE::CleanUp::is_valid() const {
+    return fd != nullptr && path.length() != 0;
+}
+
+void TempFileFILE::CleanUp::detach() {
+    detached = true;
+}
+
+void TempFileFILE::CleanUp::reset_fd() {
+    if (fd != nullptr) {
+        SaveError e;
+        if (!detached) fclose(fd);
+    }
+    fd = nullptr;
+}
+
+void TempFileFILE::CleanUp::reset_path() {
+    if (!fatal_path && path.length() != 0) {
+        SaveError e;
+        if (log_create_close) {
+            if (detached) {
+                log_event(TEMP_FILE_EVENT_DETACHED, -1, path);
+            } else if (anonymous) {
+                log_event(TEMP_FILE_EVENT_RELEASED_ANONYMOUS, -1, path);
+            } else {
+                log_event(TEMP_FILE_EVENT_DELETED, -1, path);
+            }
+        }
+#if defined(_WIN32)
+        if (!detached && DeleteFile(PathString(path).c_str)) stat_add(STAT_UNLINKS);
+#else
+        // an anonymous file has no name, closing it was enough
+        if (!detached && !anonymous && unlink(PathString(path).c_str) == 0) {
+            stat_add(STAT_UNLINKS);
+            prune_after_unlink(path);
+        }
+#endif
+    }
+    path.clear();
+}
+
+void TempFileFILE::CleanUp::reset() {
+    // only the cleanup of a file that is still ours is timed
+    bool timed = !detached && is_valid();
+    std::chrono::steady_clock::time_point start;
+    if (timed) start = std::chrono::steady_clock::now();
+#if !defined(_WIN32)
+    if (deferred_cleanup && !detached && fd != nullptr) {
+        if (defer_cleanup(-1, fd, path, !fatal_path, anonymous, log_create_close)) {
+            fd = nullptr;
+            path.clear();
+        }
+    }
+#endif
+    reset_fd();
+    reset_path();
+    detached = false;
+    anonymous = false;
+    memfd = false;
+    template_suffix_length = 0;
+    if (timed) stat_cleanup_latency(elapsed_ns(start));
+}
+
+TempFileFILE::CleanUp::~CleanUp() {
+    reset();
+}
+
+TempFileFILE::CleanUp * TempFileFILE::CleanUp::create() {
+    return new (TempFile::allocate_cleanup()) CleanUp();
+}
+
+void TempFileFILE::CleanUp::destroy(CleanUp * data) {
+    data->~CleanUp();
+    TempFile::deallocate_cleanup(data);
+}
+
+bool TempFileFILE::is_valid() const {
+    return this->data && this->data->is_valid();
+}
+
+const char* OPEN_MODE_TO_FILE_MODE(int open_mode) {
+    if ((open_mode & TEMP_FILE_OPEN_MODE_READ) == TEMP_FILE_OPEN_MODE_READ) return "r+";
+    if ((open_mode & TEMP_FILE_OPEN_MODE_WRITE) == TEMP_FILE_OPEN_MODE_WRITE) return "w+";
+    if ((open_mode & TEMP_FILE_OPEN_MODE_READ) == TEMP_FILE_OPEN_MODE_READ && (open_mode & TEMP_FILE_OPEN_MODE_WRITE) == TEMP_FILE_OPEN_MODE_WRITE) return "rw+";
+    if ((open_mode & TEMP_FILE_OPEN_MODE_READ) == TEMP_FILE_OPEN_MODE_READ && (open_mode & TEMP_FILE_OPEN_MODE_BINARY) == TEMP_FILE_OPEN_MODE_BINARY) return "rb+";
+    if ((open_mode & TEMP_FILE_OPEN_MODE_WRITE) == TEMP_FILE_OPEN_MODE_WRITE && (open_mode & TEMP_FILE_OPEN_MODE_BINARY) == TEMP_FILE_OPEN_MODE_BINARY) return "wb+";
+    if ((open_mode & TEMP_FILE_OPEN_MODE_READ) == TEMP_FILE_OPEN_MODE_READ && (open_mode & TEMP_FILE_OPEN_MODE_WRITE) == TEMP_FILE_OPEN_MODE_WRITE && (open_mode & TEMP_FILE_OPEN_MODE_BINARY) == TEMP_FILE_OPEN_MODE_BINARY) return "rwb+";
+    throw std::runtime_error("invalid mode: TEMP_FILE_OPEN_MODE_BINARY cannot be passed by itself");
+}
+
+// generated by gen.exe -- header start
+
+TempFileFILE::TempFileFILE() {
+
+}
+TempFileFILE::TempFileFILE(const std::string & dir) {
+    construct(dir);
+}
+TempFileFILE::TempFileFILE(const std::string & dir, const std::string & template_prefix) {
+    construct(dir, template_prefix);
+}
+TempFileFILE::TempFileFILE(const std::string & dir, const std::string & template_prefix, int open_mode) {
+    construct(dir, template_prefix, open_mode);
+}
+TempFileFILE::TempFileFILE(const std::string & dir, const std::string & template_prefix, bool log_create_close) {
+    construct(dir, template_prefix, log_create_close);
+}
+TempFileFILE::TempFileFILE(const std::string & dir, const std::string & template_prefix, int open_mode, bool log_create_close) {
+    construct(dir, template_prefix, open_mode, log_create_close);
+}
+TempFileFILE::TempFileFILE(const std::string & dir, const std::string & template_prefix, char * template_suffix) {
+    construct(dir, template_prefix, std::string(template_suffix));
+}
+TempFileFILE::TempFileFILE(const std::string & dir, const std::string & template_prefix, const char * template_suffix) {
+    construct(dir, template_prefix, std::string(template_suffix));
+}
+TempFileFILE::TempFileFILE(const std::string & dir, const std::string & template_prefix, const std::string & template_suffix) {
+    construct(dir, template_prefix, template_suffix);
+}
+TempFileFILE::TempFileFILE(const std::string & dir, const std::string & template_prefix, const std::string & template_suffix, int open_mode) {
+    construct(dir, template_prefix, template_suffix, open_mode);
+}
+TempFileFILE::TempFileFILE(const std::string & dir, const std::string & template_prefix, const std::string & template_suffix, bool log_create_close) {
+    construct(dir, template_prefix, template_suffix, log_create_close);
+}
+TempFileFILE::TempFileFILE(const std::string & dir, const std::string & template_prefix, const std::string & template_suffix, int open_mode, bool log_create_close) {
+    construct(dir, template_prefix, template_suffix, open_mode, log_create_close);
+}
+TempFileFILE::TempFileFILE(const std::string & dir, const std::string & template_prefix, const std::string & template_suffix, int open_mode, int create_flags) {
+    construct(dir, template_prefix, template_suffix, open_mode, create_flags);
+}
+TempFileFILE::TempFileFILE(const std::string & dir, const std::string & template_prefix, const std::string & template_suffix, int open_mode, int create_flags, bool log_create_close) {
+    construct(dir, template_prefix, template_suffix, open_mode, create_flags, log_create_close);
+}
+
+bool TempFileFILE::construct() {
+    return construct("", "", "", TEMP_FILE_OPEN_MODE_READ | TEMP_FILE_OPEN_MODE_WRITE, false);
+}
+bool TempFileFILE::construct(const std::string & dir) {
+    return construct(dir, "", "", TEMP_FILE_OPEN_MODE_READ | TEMP_FILE_OPEN_MODE_WRITE, false);
+}
+bool TempFileFILE::construct(const std::string & dir, const std::string & template_prefix) {
+    return construct(dir, template_prefix, "", TEMP_FILE_OPEN_MODE_READ | TEMP_FILE_OPEN_MODE_WRITE, false);
+}
+bool TempFileFILE::construct(const std::string & dir, const std::string & template_prefix, int open_mode) {
+    return construct(dir, template_prefix, "", open_mode, false);
+}
+bool TempFileFILE::construct(const std::string & dir, const std::string & template_prefix, bool log_create_close) {
+    return construct(dir, template_prefix, "", TEMP_FILE_OPEN_MODE_READ | TEMP_FILE_OPEN_MODE_WRITE, log_create_close);
+}
+bool TempFileFILE::construct(const std::string & dir, const std::string & template_prefix, int open_mode, bool log_create_close) {
+    return construct(dir, template_prefix, "", open_mode, log_create_close);
+}
+bool TempFileFILE::construct(const std::string & dir, const std::string & template_prefix, char * template_suffix) {
+    return construct(dir, template_prefix, std::string(template_suffix));
+}
+bool TempFileFILE::construct(const std::string & dir, const std::string & template_prefix, const char * template_suffix) {
+    return construct(dir, template_prefix, std::string(template_suffix));
+}
+bool TempFileFILE::construct(const std::string & dir, const std::string & template_prefix, const std::string & template_suffix) {
+    return construct(dir, template_prefix, template_suffix, TEMP_FILE_OPEN_MODE_READ | TEMP_FILE_OPEN_MODE_WRITE, false);
+}
+bool TempFileFILE::construct(const std::string & dir, const std::string & template_prefix, const std::string & template_suffix, int open_mode) {
+    return construct(dir, template_prefix, template_suffix, open_mode, false);
+}
+bool TempFileFILE::construct(const std::string & dir, const std::string & template_prefix, const std::string & template_suffix, bool log_create_close) {
+    return construct(dir, template_prefix, template_suffix, TEMP_FILE_OPEN_MODE_READ | TEMP_FILE_OPEN_MODE_WRITE, log_create_close);
+}
+bool TempFileFILE::construct(const std::string & dir, const std::string & template_prefix, const std::string & template_suffix, int open_mode, bool log_create_close) {
+    return construct(dir, template_prefix, template_suffix, open_mode, 0, log_create_close);
+}
+bool TempFileFILE::construct(const std::string & dir, const std::string & template_prefix, const std::string & template_suffix, int open_mode, int create_flags) {
+    return construct(dir, template_prefix, template_suffix, open_mode, create_flags, false);
+}
+bool TempFileFILE::construct(const std::string & dir, const std::string & template_prefix, const std::string & template_suffix, int open_mode, int create_flags, bool log_create_close) {
+    if (dir.length() == 0) {
+        // resolved once, see temp_dir_info
+        std::shared_ptr<const TempDirInfo> info = TempFile::temp_dir_info();
+        return construct(info->path, template_prefix, template_suffix, open_mode, create_flags, log_create_close);
+    }
+
+// generated by gen.exe -- header end
+
+    if (!this->data) {
+        this->data = TempFileRef<CleanUp>(CleanUp::create());
+    }
+
+    if (this->data->is_valid()) {
+        // return true if we are already set-up
+        return true;
+    }
+
+    return create_data(*this->data, dir, template_prefix, template_suffix, create_flags, log_create_close, [open_mode](CleanUp & data, auto fd) {
+#if defined(_WIN32)
+        int crt_fd = _open_osfhandle(reinterpret_cast<intptr_t>(fd), _O_APPEND);
+        if (crt_fd == -1) {
+            SaveError e;
+            CloseHandle(fd);
+            return false;
+        }
+        data.fd = _fdopen(crt_fd, OPEN_MODE_TO_FILE_MODE(open_mode));
+        if (data.fd == nullptr) {
+            SaveError e;
+            _close(crt_fd);
+            return false;
+        }
+#else
+        data.fd = fdopen(fd, OPEN_MODE_TO_FILE_MODE(open_mode));
+        if (data.fd == nullptr) {
+            SaveError e;
+            close(fd);
+            return false;
+        }
+#endif
+        return true;
+    });
+}
+
+const std::string & TempFileFILE::get_path() const {
+    if (!this->data) {
+        return empty_path();
+    }
+    return this->data->path.str();
+}
+
+size_t TempFileFILE::get_path(char * buffer, size_t size) const {
+    if (!this->data) {
+        if (size != 0) buffer[0] = '\0';
+        return 0;
+    }
+    return this->data->path.copy(buffer, size);
+}
+
+TempFileFILE & TempFileFILE::detach() {
+    if (!this->data) {
+        return *this;
+    }
+#if !defined(_WIN32)
+    // a memfd file cannot be linked anywhere, detaching it only gives up the handle
+    if (this->data->anonymous && !this->data->memfd && this->data->is_valid()) {
+        // an anonymous file has no name to keep, give it one before letting go of it
+        SaveError error;
+        fflush(this->data->fd);
+        if (!link_anonymous(fileno(this->data->fd), this->data->path, this->data->template_suffix_length)) {
+            error = {}; // the file stays anonymous and will be released as usual
+            return *this;
+        }
+        this->data->anonymous = false;
+    }
+#endif
+    if (this->data->is_valid()) stat_add(STAT_DETACHES);
+    this->data->detach();
+    return *this;
+}
+
+FILE* TempFileFILE::get_handle() const {
+    if (!this->data) {
+        return nullptr;
+    }
+    return this->data->fd;
+}
+
+TempFileFILE & TempFileFILE::reset() {
+    if (this->data) {
+        this->data->reset();
+    }
+    return *this;
+}
+
+bool TempFileFILE::seal(int seals) {
+    if (!is_valid()) {
+        errno = EBADF;
+        return false;
+    }
+#if defined(_WIN32)
+    errno = EINVAL;
+    return false;
+#else
+    fflush(this->data->fd);
+    return add_seals(fileno(this->data->fd), seals);
+#endif
+}
+
+/* Moves the path and flags of FROM into a CleanUp of type TO, leaving the
+   handle for the caller to convert. FROM is reset the way a detached file
+   is, so its handle stays open and its file stays on disk. If nothing else
+   shares FROM, its storage is reused for TO instead of allocating.  */
+template <typename To, typename From>
+static TempFileRef<To> convert_cleanup(TempFileRef<From> & from) {
+    From & f = *from;
+
+    TempFilePath path;
+    path.swap(f.path);
+    // a committed file is never deleted, whatever handle it is held by
+    bool fatal_path = f.fatal_path;
+    bool anonymous = f.anonymous;
+    bool memfd = f.memfd;
+    bool deferred_cleanup = f.deferred_cleanup;
+    size_t template_suffix_length = f.template_suffix_length;
+
+    if (f.log_create_close) {
+        log_event(TEMP_FILE_EVENT_DETACHED, -1, path);
+    }
+    f.detach();
+    f.reset();
+
+    To * to;
+    if (from.unique()) {
+        From * storage = from.release();
+        storage->~From();
+        to = new (storage) To();
+    } else {
+        // every copy of this handle is now empty, as if it had been reset
+        to = To::create();
+    }
+    to->path.swap(path);
+    to->fatal_path = fatal_path;
+    to->anonymous = anonymous;
+    to->memfd = memfd;
+    to->deferred_cleanup = deferred_cleanup;
+    to->template_suffix_length = template_suffix_length;
+    return TempFileRef<To>(to);
+}
+
+TempFileFD TempFile::toFD() {
+    TempFileFD fd;
+    if (!is_valid() || !materialize(*this->data)) {
+        if (this->data) this->data->detach();
+        return fd;
+    }
+    stat_add(STAT_CONVERSIONS_TO_FD);
+#if defined(_WIN32)
+    HANDLE handle = this->data->fd;
+    fd.data = convert_cleanup<TempFileFD::CleanUp>(this->data);
+    fd.data->fd = _open_osfhandle(handle, _O_APPEND);
+    if (fd.data->fd == -1) {
+        // dont attempt to delete path, it did not exist at time of call and an error has prevented its creation
+        fd.data->fatal_path = true;
+    }
+#else
+    int handle = this->data->fd;
+    // a lazy file stays lazy, the fd cache keeps its descriptor
+    TempFileLazyFd * lazy = this->data->lazy;
+    this->data->lazy = nullptr;
+    fd.data = convert_cleanup<TempFileFD::CleanUp>(this->data);
+    fd.data->fd = handle;
+    fd.data->lazy = lazy;
+#endif
+    return fd;
+}
+
+TempFileFILE TempFile::toFILE() {
+    return toFILE(TEMP_FILE_OPEN_MODE_READ);
+}
+
+TempFileFILE TempFile::toFILE(int open_mode) {
+    TempFileFILE fd;
+    if (!is_valid() || !materialize(*this->data)) {
+        if (this->data) this->data->detach();
+        return fd;
+    }
+    stat_add(STAT_CONVERSIONS_TO_FILE);
+#if defined(_WIN32)
+    HANDLE handle = this->data->fd;
+    fd.data = convert_cleanup<TempFileFILE::CleanUp>(this->data);
+    int fd_ = _open_osfhandle(handle, _O_APPEND);
+    if (fd_ == -1) {
+        // dont attempt to delete path, it did not exist at time of call and an error has prevented its creation
+        fd.data->fatal_path = true;
+        return fd;
+    }
+    fd.data->fd = _fdopen(fd_, OPEN_MODE_TO_FILE_MODE(open_mode));
+    if (fd.data->fd == nullptr) {
+        // dont attempt to delete path, it did not exist at time of call and an error has prevented its creation
+        fd.data->fatal_path = true;
+    }
+#else
+    // a FILE keeps its descriptor open, a lazy file gives it up to the FILE
+    int handle = take_fd(*this->data);
+    fd.data = convert_cleanup<TempFileFILE::CleanUp>(this->data);
+    fd.data->fd = fdopen(handle, OPEN_MODE_TO_FILE_MODE(open_mode));
+    if (fd.data->fd == nullptr) {
+        // dont attempt to delete path, it did not exist at time of call and an error has prevented its creation
+        fd.data->fatal_path = true;
+    }
+#endif
+    return fd;
+}
+
+TempFile TempFileFD::toHandle() {
+    TempFile fd;
+    if (!is_valid()) {
+        if (this->data) this->data->detach();
+        return fd;
+    }
+    stat_add(STAT_CONVERSIONS_TO_HANDLE);
+    int handle = this->data->fd;
+#if !defined(_WIN32)
+    // a lazy file stays lazy, the fd cache keeps its descriptor
+    TempFileLazyFd * lazy = this->data->lazy;
+    this->data->lazy = nullptr;
+#endif
+    fd.data = convert_cleanup<TempFile::CleanUp>(this->data);
+#if defined(_WIN32)
+    fd.data->fd = _get_osfhandle(handle);
+    if (fd.data->fd == INVALID_HANDLE_VALUE) {
+        // dont attempt to delete path, it did not exist at time of call and an error has prevented its creation
+        fd.data->fatal_path = true;
+    }
+#else
+    fd.data->fd = handle;
+    fd.data->lazy = lazy;
+#endif
+    return fd;
+}
+
+TempFileFILE TempFileFD::toFILE() {
+    return toFILE(TEMP_FILE_OPEN_MODE_READ);
+}
+
+TempFileFILE TempFileFD::toFILE(int open_mode) {
+    TempFileFILE fd;
+    if (!is_valid()) {
+        if (this->data) this->data->detach();
+        return fd;
+    }
+    stat_add(STAT_CONVERSIONS_TO_FILE);
+#if defined(_WIN32)
+    int handle = this->data->fd;
+#else
+    // a FILE keeps its descriptor open, a lazy file gives it up to the FILE
+    int handle = take_fd(*this->data);
+#endif
+    fd.data = convert_cleanup<TempFileFILE::CleanUp>(this->data);
+#if defined(_WIN32)
+    fd.data->fd = _fdopen(handle, OPEN_MODE_TO_FILE_MODE(open_mode));
+#else
+    fd.data->fd = fdopen(handle, OPEN_MODE_TO_FILE_MODE(open_mode));
+#endif
+    if (fd.data->fd == nullptr) {
+        // dont attempt to delete path, it did not exist at time of call and an error has prevented its creation
+        fd.data->fatal_path = true;
+    }
+    return fd;
+}
+
+TempFileFD TempFileFILE::toFD() {
+    TempFileFD fd;
+    if (!is_valid()) {
+        if (this->data) this->data->detach();
+        return fd;
+    }
+    stat_add(STAT_CONVERSIONS_TO_FD);
+    FILE * handle = this->data->fd;
+    fd.data = convert_cleanup<TempFileFD::CleanUp>(this->data);
+#if defined(_WIN32)
+    fd.data->fd = _fileno(handle);
+#else
+    fd.data->fd = fileno(handle);
+#endif
+    if (fd.data->fd == -1) {
+        // dont attempt to delete path, it did not exist at time of call and an error has prevented its creation
+        fd.data->fatal_path = true;
+    }
+    return fd;
+}
+
+TempFile TempFileFILE::toHandle() {
+    TempFile fd;
+    if (!is_valid()) {
+        if (this->data) this->data->detach();
+        return fd;
+    }
+    stat_add(STAT_CONVERSIONS_TO_HANDLE);
+    FILE * handle = this->data->fd;
+    fd.data = convert_cleanup<TempFile::CleanUp>(this->data);
+#if defined(_WIN32)
+    int fd_ = _fileno(handle);
+    if (fd_ == -1) {
+        // dont attempt to delete path, it did not exist at time of call and an error has prevented its creation
+        fd.data->fatal_path = true;
+        return fd;
+    }
+    fd.data->fd = _get_osfhandle(fd_);
+    if (fd.data->fd == INVALID_HANDLE_VALUE) {
+        // dont attempt to delete path, it did not exist at time of call and an error has prevented its creation
+        fd.data->fatal_path = true;
+    }
+#else
+    fd.data->fd = fileno(handle);
+    if (fd.data->fd == -1) {
+        // dont attempt to delete path, it did not exist at time of call and an error has prevented its creation
+        fd.data->fatal_path = true;
+    }
+#endif
+    return fd;
+}
+
+// unique
+
+TempFileUnique::TempFileUnique() {}
+
+TempFileUnique::TempFileUnique(const std::string & dir, const std::string & template_prefix) {
+    construct(dir, template_prefix);
+}
+
+TempFileUnique::TempFileUnique(const std::string & dir, const std::string & template_prefix, bool log_create_close) {
+    construct(dir, template_prefix, log_create_close);
+}
+
+TempFileUnique::TempFileUnique(const std::string & dir, const std::string & template_prefix, const std::string & template_suffix) {
     construct(dir, template_prefix, template_suffix);
 }
 
-TempFileFD::TempFileFD(const std::string & dir, const std::string & template_prefix, const std::string & template_suffix, bool log_create_close) {
-    data = std::make_shared<CleanUp>();
-    construct(dir, template_prefix, template_suffix, log_create_close);
+TempFileUnique::TempFileUnique(const std::string & dir, const std::string & template_prefix, const std::string & template_suffix, bool log_create_close) {
+    construct(dir, template_prefix, template_suffix, log_create_close);
+}
+
+TempFileUnique::TempFileUnique(const std::string & dir, const std::string & template_prefix, const std::string & template_suffix, int create_flags) {
+    construct(dir, template_prefix, template_suffix, create_flags);
+}
+
+TempFileUnique::TempFileUnique(const std::string & dir, const std::string & template_prefix, const std::string & template_suffix, int create_flags, bool log_create_close) {
+    construct(dir, template_prefix, template_suffix, create_flags, log_create_close);
 }
 
-bool TempFileFD::is_valid() const {
-    return this->data->is_valid();
+TempFileUnique::TempFileUnique(TempDirSet & dirs, const std::string & template_prefix) {
+    construct(dirs, template_prefix);
 }
 
-bool TempFileFD::construct(const std::string & dir, const std::string & template_prefix) {
+TempFileUnique::TempFileUnique(TempDirSet & dirs, const std::string & template_prefix, bool log_create_close) {
+    construct(dirs, template_prefix, log_create_close);
+}
+
+TempFileUnique::TempFileUnique(TempDirSet & dirs, const std::string & template_prefix, const std::string & template_suffix) {
+    construct(dirs, template_prefix, template_suffix);
+}
+
+TempFileUnique::TempFileUnique(TempDirSet & dirs, const std::string & template_prefix, const std::string & template_suffix, bool log_create_close) {
+    construct(dirs, template_prefix, template_suffix, log_create_close);
+}
+
+TempFileUnique::TempFileUnique(TempDirSet & dirs, const std::string & template_prefix, const std::string & template_suffix, int create_flags) {
+    construct(dirs, template_prefix, template_suffix, create_flags);
+}
+
+TempFileUnique::TempFileUnique(TempDirSet & dirs, const std::string & template_prefix, const std::string & template_suffix, int create_flags, bool log_create_close) {
+    construct(dirs, template_prefix, template_suffix, create_flags, log_create_close);
+}
+
+TempFileUnique::TempFileUnique(const std::string & dir, const std::string & template_prefix, const std::string & template_suffix, int create_flags, uint64_t preallocate_size, int preallocate_flags) {
+    construct(dir, template_prefix, template_suffix, create_flags, preallocate_size, preallocate_flags);
+}
+
+TempFileUnique::TempFileUnique(const std::string & dir, const std::string & template_prefix, const std::string & template_suffix, int create_flags, uint64_t preallocate_size, int preallocate_flags, bool log_create_close) {
+    construct(dir, template_prefix, template_suffix, create_flags, preallocate_size, preallocate_flags, log_create_close);
+}
+
+TempFileUnique::TempFileUnique(TempDirSet & dirs, const std::string & template_prefix, const std::string & template_suffix, int create_flags, uint64_t preallocate_size, int preallocate_flags) {
+    construct(dirs, template_prefix, template_suffix, create_flags, preallocate_size, preallocate_flags);
+}
+
+TempFileUnique::TempFileUnique(TempDirSet & dirs, const std::string & template_prefix, const std::string & template_suffix, int create_flags, uint64_t preallocate_size, int preallocate_flags, bool log_create_close) {
+    construct(dirs, template_prefix, template_suffix, create_flags, preallocate_size, preallocate_flags, log_create_close);
+}
+
+TempFileUnique::TempFileUnique(TempFileUnique && other) noexcept {
+    data.swap(other.data);
+}
+
+TempFileUnique & TempFileUnique::operator=(TempFileUnique && other) noexcept {
+    if (this != &other) {
+        data.reset();
+        data.swap(other.data);
+    }
+    return *this;
+}
+
+bool TempFileUnique::is_valid() const {
+    return data.is_valid();
+}
+
+bool TempFileUnique::is_created() const {
+    return data.is_valid() && data.pending.load(std::memory_order_acquire) == nullptr;
+}
+
+bool TempFileUnique::construct(const std::string & dir, const std::string & template_prefix) {
     return construct(dir, template_prefix, "", false);
 }
 
-bool TempFileFD::construct(const std::string & dir, const std::string & template_prefix, bool log_create_close) {
+bool TempFileUnique::construct(const std::string & dir, const std::string & template_prefix, bool log_create_close) {
     return construct(dir, template_prefix, "", log_create_close);
 }
 
-bool TempFileFD::construct(const std::string & dir, const std::string & template_prefix, const std::string & template_suffix) {
+bool TempFileUnique::construct(const std::string & dir, const std::string & template_prefix, const std::string & template_suffix) {
     return construct(dir, template_prefix, template_suffix, false);
 }
 
-bool TempFileFD::construct(const std::string & dir, const std::string & template_prefix, const std::string & template_suffix, bool log_create_close) {
-    if (dir.length() == 0) {
-        return construct(TempDir(), template_prefix, template_suffix, log_create_close);
-    }
+bool TempFileUnique::construct(const std::string & dir, const std::string & template_prefix, const std::string & template_suffix, bool log_create_close) {
+    return construct(dir, template_prefix, template_suffix, 0, log_create_close);
+}
 
-    if (this->data->is_valid()) {
-        // return true if we are already set-up
+bool TempFileUnique::construct(const std::string & dir, const std::string & template_prefix, const std::string & template_suffix, int create_flags) {
+    return construct(dir, template_prefix, template_suffix, create_flags, false);
+}
+
+bool TempFileUnique::construct(TempDirSet & dirs, const std::string & template_prefix) {
+    return construct(dirs, template_prefix, "", false);
+}
+
+bool TempFileUnique::construct(TempDirSet & dirs, const std::string & template_prefix, bool log_create_close) {
+    return construct(dirs, template_prefix, "", log_create_close);
+}
+
+bool TempFileUnique::construct(TempDirSet & dirs, const std::string & template_prefix, const std::string & template_suffix) {
+    return construct(dirs, template_prefix, template_suffix, false);
+}
+
+bool TempFileUnique::construct(TempDirSet & dirs, const std::string & template_prefix, const std::string & template_suffix, bool log_create_close) {
+    return construct(dirs, template_prefix, template_suffix, 0, log_create_close);
+}
+
+bool TempFileUnique::construct(TempDirSet & dirs, const std::string & template_prefix, const std::string & template_suffix, int create_flags) {
+    return construct(dirs, template_prefix, template_suffix, create_flags, false);
+}
+
+bool TempFileUnique::construct(TempDirSet & dirs, const std::string & template_prefix, const std::string & template_suffix, int create_flags, bool log_create_close) {
+    return construct(dirs.pick(), template_prefix, template_suffix, create_flags, log_create_close);
+}
+
+bool TempFileUnique::construct(const std::string & dir, const std::string & template_prefix, const std::string & template_suffix, int create_flags, uint64_t preallocate_size, int preallocate_flags) {
+    return construct(dir, template_prefix, template_suffix, create_flags, preallocate_size, preallocate_flags, false);
+}
+
+bool TempFileUnique::construct(TempDirSet & dirs, const std::string & template_prefix, const std::string & template_suffix, int create_flags, uint64_t preallocate_size, int preallocate_flags) {
+    return construct(dirs, template_prefix, template_suffix, create_flags, preallocate_size, preallocate_flags, false);
+}
+
+bool TempFileUnique::construct(TempDirSet & dirs, const std::string & template_prefix, const std::string & template_suffix, int create_flags, uint64_t preallocate_size, int preallocate_flags, bool log_create_close) {
+    return construct(dirs.pick(), template_prefix, template_suffix, create_flags, preallocate_size, preallocate_flags, log_create_close);
+}
+
+bool TempFileUnique::construct(const std::string & dir, const std::string & template_prefix, const std::string & template_suffix, int create_flags, uint64_t preallocate_size, int preallocate_flags, bool log_create_close) {
+    if (!construct(dir, template_prefix, template_suffix, create_flags, log_create_close)) {
+        return false;
+    }
+    if (preallocate_size == 0 && preallocate_flags == 0) {
+        return true;
+    }
+    // a file created on first use is preallocated when it is created
+    if (defer_preallocate(data, preallocate_size, preallocate_flags)) {
         return true;
     }
+    if (!preallocate(preallocate_size, preallocate_flags) && (preallocate_flags & TEMP_FILE_PREALLOCATE_FAIL_FAST)) {
+        // nothing was written yet, the file is given up before anyone relies on the space
+        SaveError e;
+        reset();
+        return false;
+    }
+    return true;
+}
 
-    SaveError error;
+bool TempFileUnique::construct(const std::string & dir, const std::string & template_prefix, const std::string & template_suffix, int create_flags, bool log_create_close) {
+    return TempFile::construct_data(data, dir, template_prefix, template_suffix, create_flags, log_create_close);
+}
 
-    // we dont care if we get any errors here, if we fail to clean up then we should not consider this an error
-    this->data->reset();
+const std::string & TempFileUnique::get_path() const {
+    return data.path.str();
+}
 
-    this->data->log_create_close = log_create_close;
+size_t TempFileUnique::get_path(char * buffer, size_t size) const {
+    return data.path.copy(buffer, size);
+}
 
-    // we have cleaned up
+TempFileUnique & TempFileUnique::detach() {
+    TempFile::detach_data(data);
+    return *this;
+}
 
-    std::string path = {};
-    path += dir;
-    path += "/";
-    path += template_prefix;
-    path += "XXXXXX";
-    path += template_suffix;
+#if defined(_WIN32)
+HANDLE
+#else
+int
+#endif
+TempFileUnique::get_handle() const {
+    // creating the file on first use does not change which file this is
+    TempFile::materialize(const_cast<TempFile::CleanUp &>(data));
+#if defined(_WIN32)
+    return data.fd;
+#else
+    return handle_fd(data, false);
+#endif
+}
+
+TempFileUnique & TempFileUnique::reset() {
+    data.reset();
+    return *this;
+}
 
 #if defined(_WIN32)
-    char * XXXXXX = &path[path.length()-template_suffix.length()-6];
+HANDLE
+#else
+int
+#endif
+TempFileUnique::pin() {
+    TempFile::materialize(data);
+#if defined(_WIN32)
+    return data.fd;
+#else
+    return handle_fd(data, true);
+#endif
+}
 
-    // based on
-    // https://github.com/wbx-github/uclibc-ng/blob/master/libc/misc/internals/tempname.c#L166
+void TempFileUnique::unpin() {
+#if !defined(_WIN32)
+    handle_unpin(data);
+#endif
+}
 
-    /* Generate a temporary file name based on TMPL. TMPL must match the
-    rules for mk[s]temp[s] (i.e. end in "prefixXXXXXXsuffix"). The name
-    constructed does not exist at the time of the call to __gen_tempname.
-    TMPL is overwritten with the result.
-    KIND may be one of:
-    __GT_NOCREATE:       simply verify that the name does not exist
-                            at the time of the call. mode argument is ignored.
-    __GT_FILE:           create the file using open(O_CREAT|O_EXCL)
-                            and return a read-write fd with given mode.
-    __GT_BIGFILE:        same as __GT_FILE but use open64().
-    __GT_DIR:            create a directory with given mode.
-    */
+bool TempFileUnique::seal(int seals) {
+    if (!is_valid() || !TempFile::materialize(data)) {
+        errno = EBADF;
+        return false;
+    }
+#if defined(_WIN32)
+    errno = EINVAL;
+    return false;
+#else
+    return add_seals(handle_fd(data, false), seals);
+#endif
+}
 
-    unsigned int i;
+bool TempFileUnique::preallocate(uint64_t size) {
+    return preallocate(size, 0);
+}
+
+bool TempFileUnique::preallocate(uint64_t size, int preallocate_flags) {
+#if defined(_WIN32)
+    // the space is not reserved on windows
+    (void)size;
+    (void)preallocate_flags;
+    return is_valid();
+#else
+    return with_pinned(*this, false, [&](int fd) { return preallocate_file(fd, size, preallocate_flags); });
+#endif
+}
+
+bool TempFileUnique::commit_to(const std::string & path) {
+    return commit_to(path, TEMP_FILE_DURABILITY_FULL, TEMP_FILE_COMMIT_REPLACE);
+}
+
+bool TempFileUnique::commit_to(const std::string & path, int durability) {
+    return commit_to(path, durability, TEMP_FILE_COMMIT_REPLACE);
+}
+
+bool TempFileUnique::commit_to(const std::string & path, int durability, int commit_flags) {
+    return TempFile::commit_path(data, path, durability, commit_flags);
+}
+
+#if !defined(_WIN32)
+int64_t TempFileUnique::copy_to(int fd) {
+    return with_pinned(*this, int64_t(-1), [&](int temp) { return copy_file_to(temp, fd); });
+}
+
+int64_t TempFileUnique::copy_to(const std::string & path) {
+    return with_pinned(*this, int64_t(-1), [&](int temp) { return copy_file_to(temp, path); });
+}
+
+int64_t TempFileUnique::copy_from(int fd) {
+    return with_pinned(*this, int64_t(-1), [&](int temp) { return copy_file_from(temp, fd); });
+}
+
+int64_t TempFileUnique::copy_from(const std::string & path) {
+    return with_pinned(*this, int64_t(-1), [&](int temp) { return copy_file_from(temp, path); });
+}
+
+bool TempFileUnique::clone_from(int fd) {
+    return clone_from(fd, 0, 0);
+}
+
+bool TempFileUnique::clone_from(int fd, uint64_t offset, uint64_t length) {
+    return with_pinned(*this, false, [&](int temp) { return clone_file(temp, fd, offset, length); });
+}
+
+bool TempFileUnique::clone_from(const std::string & path) {
+    return clone_from(path, 0, 0);
+}
+
+bool TempFileUnique::clone_from(const std::string & path, uint64_t offset, uint64_t length) {
+    return clone_path(*this, path, offset, length);
+}
 #endif
 
+TempFile TempFileUnique::release() {
+    TempFile file;
+    if (!is_valid()) {
+        return file;
+    }
+    file.data = TempFileRef<TempFile::CleanUp>(TempFile::CleanUp::create());
+    file.data->swap(data);
+    return file;
+}
+
+TempFile TempFileUnique::toHandle() {
+    if (is_valid()) stat_add(STAT_CONVERSIONS_TO_HANDLE);
+    return release();
+}
+
+TempFileFD TempFileUnique::toFD() {
+    return release().toFD();
+}
+
+TempFileFILE TempFileUnique::toFILE() {
+    return toFILE(TEMP_FILE_OPEN_MODE_READ);
+}
+
+TempFileFILE TempFileUnique::toFILE(int open_mode) {
+    return release().toFILE(open_mode);
+}
+
+// pool
+
+TempFilePool::TempFilePool(const std::string & dir, const std::string & template_prefix, size_t capacity)
+    : TempFilePool(dir, template_prefix, "", capacity) {}
+
+TempFilePool::TempFilePool(const std::string & dir, const std::string & template_prefix, const std::string & template_suffix, size_t capacity)
+    : TempFilePool(dir, template_prefix, template_suffix, capacity, capacity / 2) {}
+
+TempFilePool::TempFilePool(const std::string & dir, const std::string & template_prefix, const std::string & template_suffix, size_t capacity, size_t low_water)
+    : dir(dir.length() == 0 ? TempFile::TempDir() : dir), template_prefix(template_prefix), template_suffix(template_suffix), capacity(capacity), low_water(low_water)
+{
+    files.reserve(capacity);
+    // warm the pool without making the caller wait for it
+    refill_requested = true;
+    refill_thread = std::thread(&TempFilePool::refill, this);
+}
+
+void TempFilePool::refill() {
+    std::unique_lock<std::mutex> lock(mutex);
     while (true) {
+        refill_cv.wait(lock, [this] { return stop || refill_requested; });
+        if (stop) {
+            return;
+        }
+        size_t missing = capacity - files.size();
+        lock.unlock();
 
-        // if we are invalid we need to clean up and try again
-        this->data->reset();
+        // create outside of the lock so acquire never waits on the filesystem
+        std::vector<TempFile> created = TempFile::construct_many(dir, template_prefix, template_suffix, missing);
 
-#if defined(_WIN32)
+        lock.lock();
+        for (TempFile & file : created) {
+            if (file.is_valid() && files.size() < capacity) {
+                files.push_back(std::move(file));
+            }
+        }
+        // if creation failed we wait for the next acquire instead of retrying in a loop
+        refill_requested = false;
+    }
+}
 
-#ifndef TMP_MAX
-#define TMP_MAX 238328
+TempFile TempFilePool::acquire() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (files.size() != 0) {
+            TempFile file = std::move(files.back());
+            files.pop_back();
+            if (files.size() < low_water && !refill_requested) {
+                refill_requested = true;
+                refill_cv.notify_one();
+            }
+            hits_++;
+            return file;
+        }
+        if (!refill_requested) {
+            refill_requested = true;
+            refill_cv.notify_one();
+        }
+    }
+    misses_++;
+    return TempFile(dir, template_prefix, template_suffix);
+}
+
+size_t TempFilePool::size() {
+    std::lock_guard<std::mutex> lock(mutex);
+    return files.size();
+}
+
+size_t TempFilePool::hits() const {
+    return hits_.load();
+}
+
+size_t TempFilePool::misses() const {
+    return misses_.load();
+}
+
+TempFilePool::~TempFilePool() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stop = true;
+    }
+    refill_cv.notify_one();
+    refill_thread.join();
+}
+
+// spooled
+
+// the stream of a spooled file is made with fopencookie on glibc and musl, with funopen on the bsds
+#if defined(__linux__) && !defined(__ANDROID__)
+#define TMPFILE_HAVE_FOPENCOOKIE
+#elif defined(__APPLE__) || defined(__FreeBSD__) || defined(__NetBSD__) || defined(__OpenBSD__) || defined(__DragonFly__) || defined(__ANDROID__)
+#define TMPFILE_HAVE_FUNOPEN
 #endif
 
-        HANDLE handle = INVALID_HANDLE_VALUE;
+/* The state of a SpooledTempFile, kept behind a pointer so the stream
+   returned by get_handle can refer to it after the SpooledTempFile moved.  */
+struct TempFileSpool {
+    std::string dir;
+    std::string template_prefix;
+    std::string template_suffix;
+    int create_flags = 0;
+    size_t threshold = 0;
 
-        for (i = 0; i < TMP_MAX; ++i) {
-            
-            /* Get some random data.  */
-            XXXXXX[0] = LETTER_DIST; // 1
-            XXXXXX[1] = LETTER_DIST; // 2
-            XXXXXX[2] = LETTER_DIST; // 3
-            XXXXXX[3] = LETTER_DIST; // 4
-            XXXXXX[4] = LETTER_DIST; // 5
-            XXXXXX[5] = LETTER_DIST; // 6
-            
-            handle = CreateFile (
-                path.c_str(),
-                GENERIC_READ | GENERIC_WRITE,
-                0,
-                NULL,
-                OPEN_ALWAYS,
-                FILE_ATTRIBUTE_TEMPORARY|FILE_FLAG_DELETE_ON_CLOSE,
-                NULL
-            );
+    // the data until it rolls over, then released
+    std::vector<char> memory;
+    TempFileUnique file;
 
-            if (handle == INVALID_HANDLE_VALUE) {
-                if (GetLastError() != ERROR_ALREADY_EXISTS) {
-                    /* Any other error will apply also to other names we might
-                    try, and there are 2^32 or so of them, so give up now. */
+    uint64_t length = 0;
+    uint64_t position = 0;
 
-                    // fd is already invalid thus no need to reset it
+    FILE * stream = nullptr;
 
-                    error = {}; // save current error, and restore after move
+    bool rolled_over() const {
+        return file.is_valid();
+    }
 
-                    this->data->path = std::move(path); // so the user can see what path may have caused the error
+    // holes left by a seek past the end are filled with zeros by resize
+    void grow(uint64_t end) {
+        if (end > memory.capacity()) {
+            // double like vector would, but never beyond what rolls over anyway
+            size_t capacity = std::max(static_cast<size_t>(end), memory.capacity() * 2);
+            memory.reserve(std::min(capacity, std::max(threshold, static_cast<size_t>(end))));
+        }
+        if (end > memory.size()) {
+            memory.resize(end);
+        }
+    }
 
-                    // dont attempt to delete path, it did not exist at time of call and an error has prevented its creation
-                    this->data->fatal_path = true;
+    int64_t pwrite_file(const char * buffer, size_t size, uint64_t offset) {
+        auto handle = file.pin();
+#if defined(_WIN32)
+        OVERLAPPED at = {};
+        at.Offset = static_cast<DWORD>(offset);
+        at.OffsetHigh = static_cast<DWORD>(offset >> 32);
+        DWORD written = 0;
+        DWORD n = size > MAXDWORD ? MAXDWORD : static_cast<DWORD>(size);
+        int64_t result = WriteFile(handle, buffer, n, &written, &at) ? static_cast<int64_t>(written) : -1;
+        if (result < 0) errno = EIO;
+#else
+        int64_t result = ::pwrite(handle, buffer, size, static_cast<off_t>(offset));
+#endif
+        SaveError e;
+        file.unpin();
+        return result;
+    }
 
-                    return false;
-                }
-                // file exists, try again
-                continue;
+    int64_t pread_file(char * buffer, size_t size, uint64_t offset) {
+        auto handle = file.pin();
+#if defined(_WIN32)
+        OVERLAPPED at = {};
+        at.Offset = static_cast<DWORD>(offset);
+        at.OffsetHigh = static_cast<DWORD>(offset >> 32);
+        DWORD read = 0;
+        DWORD n = size > MAXDWORD ? MAXDWORD : static_cast<DWORD>(size);
+        int64_t result;
+        if (!ReadFile(handle, buffer, n, &read, &at)) {
+            // reading at the end fails instead of returning 0
+            result = GetLastError() == ERROR_HANDLE_EOF ? 0 : -1;
+            if (result < 0) errno = EIO;
+        } else {
+            result = static_cast<int64_t>(read);
+        }
+#else
+        int64_t result = ::pread(handle, buffer, size, static_cast<off_t>(offset));
+#endif
+        SaveError e;
+        file.unpin();
+        return result;
+    }
+
+    // writes all of buffer at offset, returns false with errno set if the file is full or failed
+    bool pwrite_all(const char * buffer, size_t size, uint64_t offset) {
+        while (size != 0) {
+            int64_t n = pwrite_file(buffer, size, offset);
+            if (n < 0) {
+                if (errno == EINTR) continue;
+                return false;
             }
-            // we got a valid handle, and we have a valid path
-            this->data->path = std::move(path);
-            this->data->fd = _open_osfhandle(handle, _O_APPEND);
-            if (this->data->fd == -1) {
-                error = {};
+            if (n == 0) {
+                errno = ENOSPC;
+                return false;
+            }
+            buffer += n;
+            size -= static_cast<size_t>(n);
+            offset += static_cast<uint64_t>(n);
+        }
+        return true;
+    }
 
-                // dont attempt to delete path, it did not exist at time of call and an error has prevented its creation
-                this->data->fatal_path = true;
+    bool rollover() {
+        if (rolled_over()) {
+            return true;
+        }
+        if (!file.construct(dir, template_prefix, template_suffix, create_flags)) {
+            return false;
+        }
+        // everything buffered goes out with one write unless the filesystem returns short
+        if (!pwrite_all(memory.data(), static_cast<size_t>(length), 0)) {
+            SaveError e;
+            file.reset();
+            return false;
+        }
+        std::vector<char>().swap(memory);
+        stat_add(STAT_SPILLS);
+        return true;
+    }
 
-                return false;
+    int64_t write(const char * buffer, size_t size) {
+        uint64_t end = position + size;
+        if (!rolled_over() && end > threshold && !rollover()) {
+            return -1;
+        }
+        if (rolled_over()) {
+            if (!pwrite_all(buffer, size, position)) {
+                return -1;
             }
-            if (this->data->log_create_close) {
-                std::cout << "created temporary file: " << this->data->path << std::endl;
+        } else {
+            grow(end);
+            if (size != 0) memcpy(memory.data() + position, buffer, size);
+        }
+        position = end;
+        length = std::max(length, end);
+        return static_cast<int64_t>(size);
+    }
+
+    int64_t read(char * buffer, size_t size) {
+        if (position >= length) {
+            return 0;
+        }
+        size = static_cast<size_t>(std::min<uint64_t>(size, length - position));
+        int64_t n;
+        if (rolled_over()) {
+            do {
+                n = pread_file(buffer, size, position);
+            } while (n < 0 && errno == EINTR);
+            if (n < 0) {
+                return -1;
             }
-            return true;
+        } else {
+            if (size != 0) memcpy(buffer, memory.data() + position, size);
+            n = static_cast<int64_t>(size);
         }
+        position += static_cast<uint64_t>(n);
+        return n;
+    }
 
-        /* We got out of the loop because we ran out of combinations to try.  */
+    int64_t seek(int64_t offset, int whence) {
+        int64_t base;
+        switch (whence) {
+            case SEEK_SET: base = 0; break;
+            case SEEK_CUR: base = static_cast<int64_t>(position); break;
+            case SEEK_END: base = static_cast<int64_t>(length); break;
+            default: errno = EINVAL; return -1;
+        }
+        if ((offset < 0 && base + offset < 0) || (offset > 0 && base > INT64_MAX - offset)) {
+            errno = EINVAL;
+            return -1;
+        }
+        position = static_cast<uint64_t>(base + offset);
+        return static_cast<int64_t>(position);
+    }
 
-        // fd is already invalid thus no need to reset it
-        error.set_last_error();
-        error.set_errno(EEXIST);
-        this->data->path = std::move(path); // so the user can see what path may have caused the error
+#if defined(TMPFILE_HAVE_FOPENCOOKIE)
+    // the cookie functions of the stream, the stream adds its own buffer on top
+    static ssize_t stream_read(void * cookie, char * buffer, size_t size) {
+        return static_cast<ssize_t>(static_cast<TempFileSpool *>(cookie)->read(buffer, size));
+    }
 
-        // dont attempt to delete path, it did not exist at time of call and an error has prevented its creation
-        this->data->fatal_path = true;
+    static ssize_t stream_write(void * cookie, const char * buffer, size_t size) {
+        int64_t n = static_cast<TempFileSpool *>(cookie)->write(buffer, size);
+        // a cookie write reports an error with 0
+        return n < 0 ? 0 : static_cast<ssize_t>(n);
+    }
 
-        return false;
-#else
-        this->data->fd = mkstemps(&path[0], template_suffix.length());
+    // the offset type differs between c libraries
+    template <typename Offset>
+    static int stream_seek(void * cookie, Offset * offset, int whence) {
+        int64_t position = static_cast<TempFileSpool *>(cookie)->seek(static_cast<int64_t>(*offset), whence);
+        if (position < 0) {
+            return -1;
+        }
+        *offset = static_cast<Offset>(position);
+        return 0;
+    }
 
-        if (this->data->fd < 0) {
-            if (this->data->fd == -1) {
-                error = {}; // save current error, and restore after move
-                this->data->path = std::move(path); // so the user can see what path may have caused the error
+#endif
 
-                // dont attempt to delete path, it did not exist at time of call and an error has prevented its creation
-                this->data->fatal_path = true;
+#if defined(TMPFILE_HAVE_FUNOPEN)
+    // funopen takes int sizes and reports a failed write with -1
+    static int stream_read(void * cookie, char * buffer, int size) {
+        return static_cast<int>(static_cast<TempFileSpool *>(cookie)->read(buffer, static_cast<size_t>(size)));
+    }
 
-                return false;
-            }
-            goto LOOP_CONTINUE;
+    static int stream_write(void * cookie, const char * buffer, int size) {
+        return static_cast<int>(static_cast<TempFileSpool *>(cookie)->write(buffer, static_cast<size_t>(size)));
+    }
+
+    static fpos_t stream_seek(void * cookie, fpos_t offset, int whence) {
+        return static_cast<fpos_t>(static_cast<TempFileSpool *>(cookie)->seek(static_cast<int64_t>(offset), whence));
+    }
+#endif
+
+#if defined(TMPFILE_HAVE_FOPENCOOKIE) || defined(TMPFILE_HAVE_FUNOPEN)
+    static int stream_close(void * cookie) {
+        static_cast<TempFileSpool *>(cookie)->stream = nullptr;
+        return 0;
+    }
+#endif
+
+    FILE * open_stream() {
+#if defined(TMPFILE_HAVE_FOPENCOOKIE)
+        if (stream == nullptr) {
+            cookie_io_functions_t functions = {};
+            functions.read = stream_read;
+            functions.write = stream_write;
+            functions.seek = stream_seek;
+            functions.close = stream_close;
+            stream = fopencookie(this, "r+", functions);
         }
-        this->data->path = std::move(path);
-        if (this->data->log_create_close) {
-            std::cout << "created temporary file: " << this->data->path << std::endl;
+        return stream;
+#elif defined(TMPFILE_HAVE_FUNOPEN)
+        if (stream == nullptr) {
+            stream = funopen(this, stream_read, stream_write, stream_seek, stream_close);
         }
-        return true;
+        return stream;
+#else
+        // windows and c libraries without custom streams
+        errno = ENOSYS;
+        return nullptr;
 #endif
-        LOOP_CONTINUE:
-        continue;
     }
-    // we should not get to here
-    error = {}; // save current error, and restore after move
 
-    this->data->path = std::move(path); // so the user can see what path may have caused the error
+    void close_stream() {
+        if (stream != nullptr) {
+            SaveError e;
+            fclose(stream);
+            stream = nullptr;
+        }
+    }
 
-    // dont attempt to delete path, it did not exist at time of call and an error has prevented its creation
-    this->data->fatal_path = true;
+    ~TempFileSpool() {
+        close_stream();
+    }
+};
 
-    return false;
-}
+SpooledTempFile::SpooledTempFile() {}
 
-const std::string & TempFileFD::get_path() const {
-    return this->data->path;
-}
+SpooledTempFile::SpooledTempFile(const std::string & dir, const std::string & template_prefix, size_t threshold)
+    : SpooledTempFile(dir, template_prefix, "", 0, threshold) {}
 
-TempFileFD & TempFileFD::detach() {
-    this->data->detach();
-    return *this;
+SpooledTempFile::SpooledTempFile(const std::string & dir, const std::string & template_prefix, const std::string & template_suffix, size_t threshold)
+    : SpooledTempFile(dir, template_prefix, template_suffix, 0, threshold) {}
+
+SpooledTempFile::SpooledTempFile(const std::string & dir, const std::string & template_prefix, const std::string & template_suffix, int create_flags, size_t threshold)
+    : spool(new TempFileSpool())
+{
+    spool->dir = dir;
+    spool->template_prefix = template_prefix;
+    spool->template_suffix = template_suffix;
+    spool->create_flags = create_flags;
+    spool->threshold = threshold;
 }
 
-int TempFileFD::get_handle() const {
-    return this->data->fd;
+SpooledTempFile::SpooledTempFile(SpooledTempFile && other) noexcept = default;
+SpooledTempFile & SpooledTempFile::operator=(SpooledTempFile && other) noexcept = default;
+SpooledTempFile::~SpooledTempFile() = default;
+
+bool SpooledTempFile::is_valid() const {
+    return spool != nullptr;
 }
 
-TempFileFD & TempFileFD::reset() {
-    this->data->reset();
-    return *this;
+int64_t SpooledTempFile::write(const void * buffer, size_t size) {
+    if (!spool) {
+        errno = EBADF;
+        return -1;
+    }
+    return spool->write(static_cast<const char *>(buffer), size);
 }
 
+int64_t SpooledTempFile::read(void * buffer, size_t size) {
+    if (!spool) {
+        errno = EBADF;
+        return -1;
+    }
+    return spool->read(static_cast<char *>(buffer), size);
+}
 
+int64_t SpooledTempFile::seek(int64_t offset, int whence) {
+    if (!spool) {
+        errno = EBADF;
+        return -1;
+    }
+    return spool->seek(offset, whence);
+}
 
-// FILE*
+int64_t SpooledTempFile::tell() const {
+    return spool ? static_cast<int64_t>(spool->position) : -1;
+}
 
-TempFileFILE::CleanUp::CleanUp() {
-    fd = nullptr;
+uint64_t SpooledTempFile::size() const {
+    return spool ? spool->length : 0;
 }
 
-bool TempFileFILE::CleanUp::is_valid() const {
-    return fd != nullptr && path.length() != 0;
+size_t SpooledTempFile::threshold() const {
+    return spool ? spool->threshold : 0;
 }
 
-void TempFileFILE::CleanUp::detach() {
-    detached = true;
+bool SpooledTempFile::rolled_over() const {
+    return spool && spool->rolled_over();
 }
 
-void TempFileFILE::CleanUp::reset_fd() {
-    if (fd != nullptr) {
-        SaveError e;
-        if (!detached) fclose(fd);
+bool SpooledTempFile::rollover() {
+    if (!spool) {
+        errno = EBADF;
+        return false;
     }
-    fd = nullptr;
+    return spool->rollover();
 }
 
-void TempFileFILE::CleanUp::reset_path() {
-    if (!fatal_path && path.length() != 0) {
-        SaveError e;
-        if (log_create_close) {
-            if (detached) {
-                std::cout << "detaching temporary file: " << path << std::endl;
-            } else {
-                std::cout << "deleting temporary file: " << path << std::endl;
-            }
-        }
-#if defined(_WIN32)
-        if (!detached) DeleteFile(path.c_str());
-#else
-        if (!detached) unlink(path.c_str());
-#endif
+FILE * SpooledTempFile::get_handle() {
+    if (!spool) {
+        errno = EBADF;
+        return nullptr;
     }
-    path = {};
+    return spool->open_stream();
 }
 
-void TempFileFILE::CleanUp::reset() {
-    reset_fd();
-    reset_path();
-    detached = false;
+const std::string & SpooledTempFile::get_path() const {
+    return spool ? spool->file.get_path() : empty_path();
 }
 
-TempFileFILE::CleanUp::~CleanUp() {
-    reset();
+SpooledTempFile & SpooledTempFile::reset() {
+    if (spool) {
+        spool->close_stream();
+        spool->file.reset();
+        std::vector<char>().swap(spool->memory);
+        spool->length = 0;
+        spool->position = 0;
+    }
+    return *this;
 }
 
-bool TempFileFILE::is_valid() const {
-    return this->data->is_valid();
+TempFile SpooledTempFile::toHandle() {
+    if (!spool) {
+        return TempFile();
+    }
+    // whatever the stream still buffers has to reach the file first
+    if (spool->stream != nullptr) fflush(spool->stream);
+    if (!spool->rollover()) {
+        return TempFile();
+    }
+    TempFile file = spool->file.toHandle();
+    spool.reset();
+    return file;
 }
 
-const char* OPEN_MODE_TO_FILE_MODE(int open_mode) {
-    if ((open_mode & TEMP_FILE_OPEN_MODE_READ) == TEMP_FILE_OPEN_MODE_READ) return "r+";
-    if ((open_mode & TEMP_FILE_OPEN_MODE_WRITE) == TEMP_FILE_OPEN_MODE_WRITE) return "w+";
-    if ((open_mode & TEMP_FILE_OPEN_MODE_READ) == TEMP_FILE_OPEN_MODE_READ && (open_mode & TEMP_FILE_OPEN_MODE_WRITE) == TEMP_FILE_OPEN_MODE_WRITE) return "rw+";
-    if ((open_mode & TEMP_FILE_OPEN_MODE_READ) == TEMP_FILE_OPEN_MODE_READ && (open_mode & TEMP_FILE_OPEN_MODE_BINARY) == TEMP_FILE_OPEN_MODE_BINARY) return "rb+";
-    if ((open_mode & TEMP_FILE_OPEN_MODE_WRITE) == TEMP_FILE_OPEN_MODE_WRITE && (open_mode & TEMP_FILE_OPEN_MODE_BINARY) == TEMP_FILE_OPEN_MODE_BINARY) return "wb+";
-    if ((open_mode & TEMP_FILE_OPEN_MODE_READ) == TEMP_FILE_OPEN_MODE_READ && (open_mode & TEMP_FILE_OPEN_MODE_WRITE) == TEMP_FILE_OPEN_MODE_WRITE && (open_mode & TEMP_FILE_OPEN_MODE_BINARY) == TEMP_FILE_OPEN_MODE_BINARY) return "rwb+";
-    throw std::runtime_error("invalid mode: TEMP_FILE_OPEN_MODE_BINARY cannot be passed by itself");
+// map
+
+#if !defined(_WIN32)
+static int ADVICE_TO_MADV(int advice) {
+    switch (advice) {
+        case TEMP_FILE_ADVISE_SEQUENTIAL: return MADV_SEQUENTIAL;
+        case TEMP_FILE_ADVISE_RANDOM: return MADV_RANDOM;
+        case TEMP_FILE_ADVISE_WILLNEED: return MADV_WILLNEED;
+        case TEMP_FILE_ADVISE_DONTNEED: return MADV_DONTNEED;
+        default: return MADV_NORMAL;
+    }
 }
 
-// generated by gen.exe -- header start
+TempFileMap::TempFileMap() {}
 
-TempFileFILE::TempFileFILE() {
-    data = std::make_shared<CleanUp>();
+TempFileMap::TempFileMap(const std::string & dir, const std::string & template_prefix, size_t size)
+    : TempFileMap(dir, template_prefix, "", 0, size) {}
 
-}
-TempFileFILE::TempFileFILE(const std::string & dir) {
-    data = std::make_shared<CleanUp>();
-    construct(dir);
-}
-TempFileFILE::TempFileFILE(const std::string & dir, const std::string & template_prefix) {
-    data = std::make_shared<CleanUp>();
-    construct(dir, template_prefix);
-}
-TempFileFILE::TempFileFILE(const std::string & dir, const std::string & template_prefix, int open_mode) {
-    data = std::make_shared<CleanUp>();
-    construct(dir, template_prefix, open_mode);
-}
-TempFileFILE::TempFileFILE(const std::string & dir, const std::string & template_prefix, bool log_create_close) {
-    data = std::make_shared<CleanUp>();
-    construct(dir, template_prefix, log_create_close);
-}
-TempFileFILE::TempFileFILE(const std::string & dir, const std::string & template_prefix, int open_mode, bool log_create_close) {
-    data = std::make_shared<CleanUp>();
-    construct(dir, template_prefix, open_mode, log_create_close);
-}
-TempFileFILE::TempFileFILE(const std::string & dir, const std::string & template_prefix, char * template_suffix) {
-    data = std::make_shared<CleanUp>();
-    construct(dir, template_prefix, std::string(template_suffix));
-}
-TempFileFILE::TempFileFILE(const std::string & dir, const std::string & template_prefix, const char * template_suffix) {
-    data = std::make_shared<CleanUp>();
-    construct(dir, template_prefix, std::string(template_suffix));
-}
-TempFileFILE::TempFileFILE(const std::string & dir, const std::string & template_prefix, const std::string & template_suffix) {
-    data = std::make_shared<CleanUp>();
-    construct(dir, template_prefix, template_suffix);
-}
-TempFileFILE::TempFileFILE(const std::string & dir, const std::string & template_prefix, const std::string & template_suffix, int open_mode) {
-    data = std::make_shared<CleanUp>();
-    construct(dir, template_prefix, template_suffix, open_mode);
-}
-TempFileFILE::TempFileFILE(const std::string & dir, const std::string & template_prefix, const std::string & template_suffix, bool log_create_close) {
-    data = std::make_shared<CleanUp>();
-    construct(dir, template_prefix, template_suffix, log_create_close);
-}
-TempFileFILE::TempFileFILE(const std::string & dir, const std::string & template_prefix, const std::string & template_suffix, int open_mode, bool log_create_close) {
-    data = std::make_shared<CleanUp>();
-    construct(dir, template_prefix, template_suffix, open_mode, log_create_close);
-}
+TempFileMap::TempFileMap(const std::string & dir, const std::string & template_prefix, const std::string & template_suffix, size_t size)
+    : TempFileMap(dir, template_prefix, template_suffix, 0, size) {}
 
-bool TempFileFILE::construct() {
-    return construct("", "", "", TEMP_FILE_OPEN_MODE_READ | TEMP_FILE_OPEN_MODE_WRITE, false);
-}
-bool TempFileFILE::construct(const std::string & dir) {
-    return construct(dir, "", "", TEMP_FILE_OPEN_MODE_READ | TEMP_FILE_OPEN_MODE_WRITE, false);
-}
-bool TempFileFILE::construct(const std::string & dir, const std::string & template_prefix) {
-    return construct(dir, template_prefix, "", TEMP_FILE_OPEN_MODE_READ | TEMP_FILE_OPEN_MODE_WRITE, false);
-}
-bool TempFileFILE::construct(const std::string & dir, const std::string & template_prefix, int open_mode) {
-    return construct(dir, template_prefix, "", open_mode, false);
-}
-bool TempFileFILE::construct(const std::string & dir, const std::string & template_prefix, bool log_create_close) {
-    return construct(dir, template_prefix, "", TEMP_FILE_OPEN_MODE_READ | TEMP_FILE_OPEN_MODE_WRITE, log_create_close);
-}
-bool TempFileFILE::construct(const std::string & dir, const std::string & template_prefix, int open_mode, bool log_create_close) {
-    return construct(dir, template_prefix, "", open_mode, log_create_close);
-}
-bool TempFileFILE::construct(const std::string & dir, const std::string & template_prefix, char * template_suffix) {
-    return construct(dir, template_prefix, std::string(template_suffix));
-}
-bool TempFileFILE::construct(const std::string & dir, const std::string & template_prefix, const char * template_suffix) {
-    return construct(dir, template_prefix, std::string(template_suffix));
-}
-bool TempFileFILE::construct(const std::string & dir, const std::string & template_prefix, const std::string & template_suffix) {
-    return construct(dir, template_prefix, template_suffix, TEMP_FILE_OPEN_MODE_READ | TEMP_FILE_OPEN_MODE_WRITE, false);
+TempFileMap::TempFileMap(const std::string & dir, const std::string & template_prefix, const std::string & template_suffix, int create_flags, size_t size)
+    : file(dir, template_prefix, template_suffix, create_flags)
+{
+    // a file that failed to be created keeps its path so the user can see what was attempted
+    if (file.is_valid() && !resize(size)) {
+        SaveError e;
+        file.reset();
+    }
 }
-bool TempFileFILE::construct(const std::string & dir, const std::string & template_prefix, const std::string & template_suffix, int open_mode) {
-    return construct(dir, template_prefix, template_suffix, open_mode, false);
+
+TempFileMap::TempFileMap(TempFileFD && file) : file(std::move(file)) {
+    if (!this->file.is_valid()) {
+        return;
+    }
+    struct stat st;
+    int fd = this->file.pin();
+    bool ok = fstat(fd, &st) == 0 && map(static_cast<size_t>(st.st_size));
+    SaveError e;
+    this->file.unpin();
+    if (!ok) {
+        this->file.reset();
+    }
 }
-bool TempFileFILE::construct(const std::string & dir, const std::string & template_prefix, const std::string & template_suffix, bool log_create_close) {
-    return construct(dir, template_prefix, template_suffix, TEMP_FILE_OPEN_MODE_READ | TEMP_FILE_OPEN_MODE_WRITE, log_create_close);
+
+TempFileMap::TempFileMap(TempFileMap && other) noexcept
+    : file(std::move(other.file)), data_(other.data_), size_(other.size_)
+{
+    other.data_ = nullptr;
+    other.size_ = 0;
 }
-bool TempFileFILE::construct(const std::string & dir, const std::string & template_prefix, const std::string & template_suffix, int open_mode, bool log_create_close) {
-    if (dir.length() == 0) {
-        return construct(TempDir(), template_prefix, template_suffix, open_mode, log_create_close);
+
+TempFileMap & TempFileMap::operator=(TempFileMap && other) noexcept {
+    if (this != &other) {
+        reset();
+        file = std::move(other.file);
+        data_ = other.data_;
+        size_ = other.size_;
+        other.data_ = nullptr;
+        other.size_ = 0;
     }
+    return *this;
+}
 
-// generated by gen.exe -- header end
+TempFileMap::~TempFileMap() {
+    // the file member is closed after this, the mapping has to go first
+    unmap();
+}
 
-    if (this->data->is_valid()) {
-        // return true if we are already set-up
+bool TempFileMap::map(size_t size) {
+    if (size == 0) {
         return true;
     }
+    int fd = file.pin();
+    void * p = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    SaveError e;
+    file.unpin();
+    if (p == MAP_FAILED) {
+        return false;
+    }
+    data_ = static_cast<std::byte *>(p);
+    size_ = size;
+    return true;
+}
 
-    SaveError error;
-
-    // we dont care if we get any errors here, if we fail to clean up then we should not consider this an error
-    this->data->reset();
+void TempFileMap::unmap() {
+    if (data_ != nullptr) {
+        SaveError e;
+        munmap(data_, size_);
+        data_ = nullptr;
+    }
+    size_ = 0;
+}
 
-    this->data->log_create_close = log_create_close;
+bool TempFileMap::is_valid() const {
+    return file.is_valid();
+}
 
-    // we have cleaned up
+std::byte * TempFileMap::data() const {
+    return data_;
+}
 
-    std::string path = {};
-    path += dir;
-    path += "/";
-    path += template_prefix;
-    path += "XXXXXX";
-    path += template_suffix;
+size_t TempFileMap::size() const {
+    return size_;
+}
 
-#if defined(_WIN32)
-    char * XXXXXX = &path[path.length()-template_suffix.length()-6];
+std::byte * TempFileMap::begin() const {
+    return data_;
+}
 
-    // based on
-    // https://github.com/wbx-github/uclibc-ng/blob/master/libc/misc/internals/tempname.c#L166
+std::byte * TempFileMap::end() const {
+    return data_ + size_;
+}
 
-    /* Generate a temporary file name based on TMPL. TMPL must match the
-    rules for mk[s]temp[s] (i.e. end in "prefixXXXXXXsuffix"). The name
-    constructed does not exist at the time of the call to __gen_tempname.
-    TMPL is overwritten with the result.
-    KIND may be one of:
-    __GT_NOCREATE:       simply verify that the name does not exist
-                            at the time of the call. mode argument is ignored.
-    __GT_FILE:           create the file using open(O_CREAT|O_EXCL)
-                            and return a read-write fd with given mode.
-    __GT_BIGFILE:        same as __GT_FILE but use open64().
-    __GT_DIR:            create a directory with given mode.
-    */
+bool TempFileMap::resize(size_t size) {
+    if (!file.is_valid()) {
+        errno = EBADF;
+        return false;
+    }
+    if (size == size_) {
+        return true;
+    }
+    if (size == 0) {
+        unmap();
+        int fd = file.pin();
+        bool ok = ftruncate(fd, 0) == 0;
+        SaveError e;
+        file.unpin();
+        return ok;
+    }
 
-    unsigned int i;
+    int fd = file.pin();
+    // shrink the mapping before the file and grow the file before the mapping,
+    // so no page of the mapping is ever beyond the end of the file
+    bool ok = true;
+    if (size > size_) {
+        ok = ftruncate(fd, static_cast<off_t>(size)) == 0;
+    }
+    if (ok) {
+        if (data_ == nullptr) {
+            void * p = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+            ok = p != MAP_FAILED;
+            if (ok) data_ = static_cast<std::byte *>(p);
+        } else {
+#if defined(__linux__)
+            void * p = mremap(data_, size_, size, MREMAP_MAYMOVE);
+#else
+            // without mremap the file is mapped again, it is shared so nothing is copied
+            void * p = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+            if (p != MAP_FAILED) munmap(data_, size_);
 #endif
+            ok = p != MAP_FAILED;
+            if (ok) data_ = static_cast<std::byte *>(p);
+        }
+    }
+    if (ok) {
+        size_t old_size = size_;
+        size_ = size;
+        if (size < old_size) {
+            ok = ftruncate(fd, static_cast<off_t>(size)) == 0;
+        }
+    } else if (size > size_) {
+        // the mapping could not follow, give the file its old size back
+        SaveError e;
+        bool restored = ftruncate(fd, static_cast<off_t>(size_)) == 0;
+        (void) restored;
+    }
+    SaveError e;
+    file.unpin();
+    return ok;
+}
 
-    while (true) {
-
-        // if we are invalid we need to clean up and try again
-        this->data->reset();
-
-#if defined(_WIN32)
+bool TempFileMap::advise(int advice) {
+    return advise(advice, 0, size_);
+}
 
-#ifndef TMP_MAX
-#define TMP_MAX 238328
-#endif
+bool TempFileMap::advise(int advice, size_t offset, size_t length) {
+    if (offset >= size_ || length == 0) {
+        // nothing is mapped there
+        return file.is_valid();
+    }
+    length = std::min(length, size_ - offset);
+    // madvise wants a page aligned start, the mapping itself is
+    size_t page = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+    size_t aligned = offset - offset % page;
+    return madvise(data_ + aligned, length + (offset - aligned), ADVICE_TO_MADV(advice)) == 0;
+}
 
-        HANDLE handle = INVALID_HANDLE_VALUE;
+bool TempFileMap::sync() {
+    if (data_ == nullptr) {
+        return file.is_valid();
+    }
+    return msync(data_, size_, MS_SYNC) == 0;
+}
 
-        for (i = 0; i < TMP_MAX; ++i) {
-            
-            /* Get some random data.  */
-            XXXXXX[0] = LETTER_DIST; // 1
-            XXXXXX[1] = LETTER_DIST; // 2
-            XXXXXX[2] = LETTER_DIST; // 3
-            XXXXXX[3] = LETTER_DIST; // 4
-            XXXXXX[4] = LETTER_DIST; // 5
-            XXXXXX[5] = LETTER_DIST; // 6
-            
-            handle = CreateFile (
-                path.c_str(),
-                GENERIC_READ | GENERIC_WRITE,
-                0,
-                NULL,
-                OPEN_ALWAYS,
-                FILE_ATTRIBUTE_TEMPORARY|FILE_FLAG_DELETE_ON_CLOSE,
-                NULL
-            );
+const std::string & TempFileMap::get_path() const {
+    return file.get_path();
+}
 
-            if (handle == INVALID_HANDLE_VALUE) {
-                if (GetLastError() != ERROR_ALREADY_EXISTS) {
-                    /* Any other error will apply also to other names we might
-                    try, and there are 2^32 or so of them, so give up now. */
+size_t TempFileMap::get_path(char * buffer, size_t size) const {
+    return file.get_path(buffer, size);
+}
 
-                    // fd is already invalid thus no need to reset it
+int TempFileMap::get_handle() const {
+    return file.get_handle();
+}
 
-                    error = {}; // save current error, and restore after move
+TempFileMap & TempFileMap::detach() {
+    file.detach();
+    return *this;
+}
 
-                    this->data->path = std::move(path); // so the user can see what path may have caused the error
+TempFileMap & TempFileMap::reset() {
+    unmap();
+    file.reset();
+    return *this;
+}
 
-                    // dont attempt to delete path, it did not exist at time of call and an error has prevented its creation
-                    this->data->fatal_path = true;
+TempFileFD TempFileMap::toFD() {
+    unmap();
+    return std::move(file);
+}
+#endif
 
-                    return false;
-                }
-                // file exists, try again
-                continue;
-            }
-            // we got a valid handle, and we have a valid path
-            this->data->path = std::move(path);
-            int fd = _open_osfhandle(handle, _O_APPEND);
-            if (fd == -1) {
-                error = {};
+// directory
 
-                // dont attempt to delete path, it did not exist at time of call and an error has prevented its creation
-                this->data->fatal_path = true;
+#if !defined(_WIN32)
+// a directory with more entries than this is emptied by several threads
+#define REMOVE_PARALLEL_ENTRIES 1024
+// and by at most this many
+#define REMOVE_PARALLEL_THREADS 8
 
-                return false;
-            }
-            this->data->fd = _fdopen(fd, OPEN_MODE_TO_FILE_MODE(open_mode));
-            if (this->data->fd == nullptr) {
-                error = {};
+/* The entries of one directory, the names are kept back to back in one
+   string so reading a large directory allocates only a few times.  */
+struct DirEntries {
+    std::string names;
+    std::vector<std::pair<size_t, unsigned char>> entries;
 
-                // dont attempt to delete path, it did not exist at time of call and an error has prevented its creation
-                this->data->fatal_path = true;
+    size_t size() const {
+        return entries.size();
+    }
 
-                return false;
-            }
-            if (this->data->log_create_close) {
-                std::cout << "created temporary file: " << this->data->path << std::endl;
-            }
-            return true;
-        }
+    const char * name(size_t i) const {
+        return names.data() + entries[i].first;
+    }
 
-        /* We got out of the loop because we ran out of combinations to try.  */
+    unsigned char type(size_t i) const {
+        return entries[i].second;
+    }
 
-        // fd is already invalid thus no need to reset it
-        error.set_last_error();
-        error.set_errno(EEXIST);
-        this->data->path = std::move(path); // so the user can see what path may have caused the error
+    void add(const char * name, unsigned char type) {
+        if (name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0'))) {
+            return;
+        }
+        entries.emplace_back(names.length(), type);
+        names.append(name, strlen(name) + 1);
+    }
+};
 
-        // dont attempt to delete path, it did not exist at time of call and an error has prevented its creation
-        this->data->fatal_path = true;
+#if defined(__linux__)
+struct linux_dirent64 {
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[1];
+};
+#endif
 
+// reads every entry of DIRFD from the start, returns false with errno set if reading failed
+static bool read_entries(int dirfd, DirEntries & out) {
+    out.names.clear();
+    out.entries.clear();
+#if defined(__linux__)
+    if (lseek(dirfd, 0, SEEK_SET) < 0) {
         return false;
+    }
+    // straight from getdents64 instead of through a DIR, which would need its own descriptor
+    alignas(linux_dirent64) char buffer[32768];
+    while (true) {
+        long n = syscall(SYS_getdents64, dirfd, buffer, sizeof(buffer));
+        if (n < 0) {
+            return false;
+        }
+        if (n == 0) {
+            return true;
+        }
+        for (long offset = 0; offset < n;) {
+            linux_dirent64 * entry = reinterpret_cast<linux_dirent64 *>(buffer + offset);
+            out.add(entry->d_name, entry->d_type);
+            offset += entry->d_reclen;
+        }
+    }
 #else
-        int fd = mkstemps(&path[0], template_suffix.length());
+    int copy = dup(dirfd);
+    if (copy < 0) {
+        return false;
+    }
+    DIR * dir = fdopendir(copy);
+    if (dir == nullptr) {
+        SaveError e;
+        close(copy);
+        return false;
+    }
+    rewinddir(dir);
+    errno = 0;
+    while (dirent * entry = readdir(dir)) {
+        out.add(entry->d_name, entry->d_type);
+    }
+    bool ok = errno == 0;
+    SaveError e;
+    closedir(dir);
+    return ok;
+#endif
+}
 
-        if (fd < 0) {
-            if (fd == -1) {
-                error = {}; // save current error, and restore after move
-                this->data->path = std::move(path); // so the user can see what path may have caused the error
+static bool empty_directory(int dirfd, bool parallel);
 
-                // dont attempt to delete path, it did not exist at time of call and an error has prevented its creation
-                this->data->fatal_path = true;
+// removes NAME from DIRFD, and everything inside it if it is a directory
+static bool remove_entry(int dirfd, const char * name, unsigned char type) {
+    if (type == DT_UNKNOWN) {
+        // some filesystems do not fill in d_type
+        struct stat st;
+        if (fstatat(dirfd, name, &st, AT_SYMLINK_NOFOLLOW) != 0) {
+            return errno == ENOENT;
+        }
+        type = S_ISDIR(st.st_mode) ? DT_DIR : DT_REG;
+    }
+    if (type != DT_DIR) {
+        if (unlinkat(dirfd, name, 0) == 0 || errno == ENOENT) {
+            return true;
+        }
+        // it became a directory since it was read
+        if (errno != EISDIR && errno != EPERM) {
+            return false;
+        }
+    }
+    // O_NOFOLLOW so a symlink swapped in for a directory is never followed out of the tree
+    int fd = openat(dirfd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    if (fd < 0) {
+        return errno == ENOENT;
+    }
+    bool ok = empty_directory(fd, false);
+    {
+        SaveError e;
+        close(fd);
+    }
+    if (!ok) {
+        return false;
+    }
+    return unlinkat(dirfd, name, AT_REMOVEDIR) == 0 || errno == ENOENT;
+}
 
-                return false;
-            }
-            goto LOOP_CONTINUE;
+// removes ENTRIES[begin, end) from DIRFD, returns false and leaves the first error in errno
+static bool remove_entries(int dirfd, const DirEntries & entries, size_t begin, size_t end) {
+    bool ok = true;
+    int error = 0;
+    for (size_t i = begin; i < end; i++) {
+        if (!remove_entry(dirfd, entries.name(i), entries.type(i)) && ok) {
+            ok = false;
+            error = errno;
         }
-        this->data->path = std::move(path);
-        this->data->fd = fdopen(fd, OPEN_MODE_TO_FILE_MODE(open_mode));
-        if (this->data->fd == nullptr) {
-            error = {};
+    }
+    if (!ok) errno = error;
+    return ok;
+}
 
-            // dont attempt to delete path, it did not exist at time of call and an error has prevented its creation
-            this->data->fatal_path = true;
+// several threads take chunks of ENTRIES until all are removed, the calling thread is one of them
+static bool remove_entries_parallel(int dirfd, const DirEntries & entries) {
+    const size_t chunk = 64;
+    std::atomic<size_t> next {0};
+    std::atomic<int> error {0};
+
+    auto work = [&]() {
+        while (true) {
+            size_t begin = next.fetch_add(chunk, std::memory_order_relaxed);
+            if (begin >= entries.size()) {
+                return;
+            }
+            if (!remove_entries(dirfd, entries, begin, std::min(begin + chunk, entries.size()))) {
+                int expected = 0;
+                error.compare_exchange_strong(expected, errno);
+            }
+        }
+    };
+
+    size_t threads = std::min<size_t>(std::max(1u, std::thread::hardware_concurrency()), REMOVE_PARALLEL_THREADS);
+    threads = std::min(threads, entries.size() / chunk + 1);
+    std::vector<std::thread> workers;
+    workers.reserve(threads - 1);
+    for (size_t i = 1; i < threads; i++) {
+        try {
+            workers.emplace_back(work);
+        } catch (const std::system_error &) {
+            // fewer threads just take longer
+            break;
+        }
+    }
+    work();
+    for (std::thread & worker : workers) {
+        worker.join();
+    }
+    if (error.load() != 0) {
+        errno = error.load();
+        return false;
+    }
+    return true;
+}
 
+/* Removes everything inside DIRFD. The directory is read in full before
+   anything is removed, and read again until it is empty, so entries are
+   neither skipped because of the removals nor missed if they were created
+   meanwhile. Only the first large directory is split between threads, the
+   threads themselves work serially.  */
+static bool empty_directory(int dirfd, bool parallel) {
+    DirEntries entries;
+    while (true) {
+        if (!read_entries(dirfd, entries)) {
             return false;
         }
-        if (this->data->log_create_close) {
-            std::cout << "created temporary file: " << this->data->path << std::endl;
+        if (entries.size() == 0) {
+            return true;
+        }
+        bool ok;
+        if (parallel && entries.size() > REMOVE_PARALLEL_ENTRIES) {
+            ok = remove_entries_parallel(dirfd, entries);
+        } else {
+            ok = remove_entries(dirfd, entries, 0, entries.size());
+        }
+        if (!ok) {
+            return false;
         }
-        return true;
-#endif
-        LOOP_CONTINUE:
-        continue;
     }
-    // we should not get to here
-    error = {}; // save current error, and restore after move
-
-    this->data->path = std::move(path); // so the user can see what path may have caused the error
-
-    // dont attempt to delete path, it did not exist at time of call and an error has prevented its creation
-    this->data->fatal_path = true;
+}
 
-    return false;
+bool TempDirectory::remove_contents(int dirfd) {
+    return empty_directory(dirfd, true);
 }
 
-const std::string & TempFileFILE::get_path() const {
-    return this->data->path;
+TempDirectory::TempDirectory() {}
+
+TempDirectory::TempDirectory(const std::string & dir, const std::string & template_prefix) {
+    construct(dir, template_prefix);
 }
 
-TempFileFILE & TempFileFILE::detach() {
-    this->data->detach();
-    return *this;
+TempDirectory::TempDirectory(const std::string & dir, const std::string & template_prefix, bool log_create_close) {
+    construct(dir, template_prefix, log_create_close);
 }
 
-FILE* TempFileFILE::get_handle() const {
-    return this->data->fd;
+TempDirectory::TempDirectory(TempDirectory && other) noexcept
+    : path(std::move(other.path)), fd(other.fd), detached(other.detached), log_create_close(other.log_create_close)
+{
+    other.path.clear();
+    other.fd = -1;
+    other.detached = false;
 }
 
-TempFileFILE & TempFileFILE::reset() {
-    this->data->reset();
+TempDirectory & TempDirectory::operator=(TempDirectory && other) noexcept {
+    if (this != &other) {
+        reset();
+        path = std::move(other.path);
+        fd = other.fd;
+        detached = other.detached;
+        log_create_close = other.log_create_close;
+        other.path.clear();
+        other.fd = -1;
+        other.detached = false;
+    }
     return *this;
 }
 
-TempFileFD TempFile::toFD() {
-    detach();
-    TempFileFD fd;
-    if (!is_valid()) return fd;
-    fd.data->path = this->data->path;
-#if defined(_WIN32)
-    fd.data->fd = _open_osfhandle(this->data->fd, _O_APPEND);
-    if (fd.data->fd == -1) {
-        // dont attempt to delete path, it did not exist at time of call and an error has prevented its creation
-        fd.data->fatal_path = true;
-    }
-#else
-    fd.data->fd = this->data->fd;
-#endif
+TempDirectory::~TempDirectory() {
     reset();
-    return fd;
 }
 
-TempFileFILE TempFile::toFILE() {
-    return toFILE(TEMP_FILE_OPEN_MODE_READ);
+bool TempDirectory::is_valid() const {
+    return fd >= 0;
 }
 
-TempFileFILE TempFile::toFILE(int open_mode) {
-    detach();
-    TempFileFILE fd;
-    if (!is_valid()) return fd;
-    fd.data->path = this->data->path;
-#if defined(_WIN32)
-    int fd_ = _open_osfhandle(this->data->fd, _O_APPEND);
-    if (fd_ == -1) {
-        // dont attempt to delete path, it did not exist at time of call and an error has prevented its creation
-        fd.data->fatal_path = true;
-        reset();
-        return fd;
-    }
-    fd.data->fd = _fdopen(fd_, OPEN_MODE_TO_FILE_MODE(open_mode));
-    if (fd.data->fd == nullptr) {
-        // dont attempt to delete path, it did not exist at time of call and an error has prevented its creation
-        fd.data->fatal_path = true;
+bool TempDirectory::construct(const std::string & dir, const std::string & template_prefix) {
+    return construct(dir, template_prefix, false);
+}
+
+bool TempDirectory::construct(const std::string & dir, const std::string & template_prefix, bool log_create_close) {
+    if (dir.length() == 0) {
+        // resolved once, see temp_dir_info
+        std::shared_ptr<const TempDirInfo> info = TempFile::temp_dir_info();
+        return construct(info->path, template_prefix, log_create_close);
     }
-#else
-    fd.data->fd = fdopen(this->data->fd, OPEN_MODE_TO_FILE_MODE(open_mode));
-    if (fd.data->fd == nullptr) {
-        // dont attempt to delete path, it did not exist at time of call and an error has prevented its creation
-        fd.data->fatal_path = true;
+
+    if (is_valid()) {
+        // return true if we are already set-up
+        return true;
     }
-#endif
+
     reset();
-    return fd;
-}
+    this->log_create_close = log_create_close;
 
-TempFile TempFileFD::toHandle() {
-    detach();
-    TempFile fd;
-    if (!is_valid()) return fd;
-    fd.data->path = this->data->path;
-#if defined(_WIN32)
-    fd.data->fd = _get_osfhandle(this->data->fd);
-    if (fd.data->fd == INVALID_HANDLE_VALUE) {
-        // dont attempt to delete path, it did not exist at time of call and an error has prevented its creation
-        fd.data->fatal_path = true;
+    path.reserve(dir.length() + 1 + template_prefix.length() + 6);
+    path = dir;
+    path += "/";
+    path += template_prefix;
+    path += "XXXXXX";
+    char * XXXXXX = &path[path.length() - 6];
+
+    // relative to the descriptor kept for the default directory, like the files
+    std::shared_ptr<const TempDirInfo> info = cached_temp_dir(dir);
+    int dirfd = info ? info->dirfd : AT_FDCWD;
+    const char * name = info ? path.c_str() + dir.length() + 1 : path.c_str();
+
+    for (unsigned int i = 0; i < TMP_MAX; ++i) {
+        generate_name(XXXXXX);
+        if (mkdirat(dirfd, name, 0700) == 0) {
+            fd = openat(dirfd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+            if (fd < 0) {
+                SaveError e;
+                unlinkat(dirfd, name, AT_REMOVEDIR);
+                return false;
+            }
+            if (log_create_close) {
+                log_event(TEMP_FILE_EVENT_CREATED, fd, path.data(), path.length());
+            }
+            return true;
+        }
+        if (errno != EEXIST) {
+            // any other error will apply to the other names too, path is kept so the user can see what failed
+            return false;
+        }
+        stat_add(STAT_COLLISIONS);
     }
-#else
-    fd.data->fd = this->data->fd;
-#endif
-    reset();
-    return fd;
+    errno = EEXIST;
+    return false;
 }
 
-TempFileFILE TempFileFD::toFILE() {
-    return toFILE(TEMP_FILE_OPEN_MODE_READ);
+const std::string & TempDirectory::get_path() const {
+    return path;
 }
 
-TempFileFILE TempFileFD::toFILE(int open_mode) {
-    detach();
-    TempFileFILE fd;
-    if (!is_valid()) return fd;
-    fd.data->path = this->data->path;
-#if defined(_WIN32)
-    fd.data->fd = _fdopen(this->data->fd, OPEN_MODE_TO_FILE_MODE(open_mode));
-#else
-    fd.data->fd = fdopen(this->data->fd, OPEN_MODE_TO_FILE_MODE(open_mode));
-#endif
-    if (fd.data->fd == nullptr) {
-        // dont attempt to delete path, it did not exist at time of call and an error has prevented its creation
-        fd.data->fatal_path = true;
-    }
-    reset();
+int TempDirectory::get_handle() const {
     return fd;
 }
 
-TempFileFD TempFileFILE::toFD() {
-    detach();
-    TempFileFD fd;
-    if (!is_valid()) return fd;
-    fd.data->path = this->data->path;
-#if defined(_WIN32)
-    fd.data->fd = _fileno(this->data->fd);
-#else
-    fd.data->fd = fileno(this->data->fd);
-#endif
-    if (fd.data->fd == -1) {
-        // dont attempt to delete path, it did not exist at time of call and an error has prevented its creation
-        fd.data->fatal_path = true;
+TempDirectory & TempDirectory::detach() {
+    if (is_valid()) {
+        detached = true;
     }
-    reset();
-    return fd;
+    return *this;
 }
 
-TempFile TempFileFILE::toHandle() {
-    detach();
-    TempFile fd;
-    if (!is_valid()) return fd;
-    fd.data->path = this->data->path;
-#if defined(_WIN32)
-    int fd_ = _fileno(this->data->fd);
-    if (fd_ == -1) {
-        // dont attempt to delete path, it did not exist at time of call and an error has prevented its creation
-        fd.data->fatal_path = true;
-        reset();
-        return fd;
-    }
-    fd.data->fd = _get_osfhandle(fd_);
-    if (fd.data->fd == INVALID_HANDLE_VALUE) {
-        // dont attempt to delete path, it did not exist at time of call and an error has prevented its creation
-        fd.data->fatal_path = true;
-    }
-#else
-    fd.data->fd = fileno(this->data->fd);
-    if (fd.data->fd == -1) {
-        // dont attempt to delete path, it did not exist at time of call and an error has prevented its creation
-        fd.data->fatal_path = true;
+TempDirectory & TempDirectory::reset() {
+    SaveError e;
+    if (fd >= 0) {
+        if (detached) {
+            if (log_create_close) {
+                log_event(TEMP_FILE_EVENT_DETACHED, -1, path.data(), path.length());
+            }
+        } else {
+            if (log_create_close) {
+                log_event(TEMP_FILE_EVENT_DELETED, -1, path.data(), path.length());
+            }
+            empty_directory(fd, true);
+            rmdir(path.c_str());
+        }
+        close(fd);
+        fd = -1;
     }
-#endif
-    reset();
-    return fd;
+    path.clear();
+    detached = false;
+    return *this;
 }
+#endif